@@ -0,0 +1,130 @@
+#pragma once
+
+// Server admission control. Two limits keep an overloaded server's latency
+// predictable instead of letting every arrival compete for the same cores,
+// descriptors and disk:
+//
+// - Connections. At maxConnections the workers stop accepting; new clients
+//   wait in the kernel's listen backlog until a connection closes.
+// - Transfers, the responses that carry file data (READ, BATCH, DELTA). At
+//   most maxTransfers are in flight server-wide. Further requests queue in
+//   arrival order, and a freed slot passes straight to the oldest one. A
+//   request that waits longer than queueTimeout is answered busy so the
+//   client can back off.
+//
+// Requests without file data (STAT, OPEN, DIGEST, ...) are never queued.
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "net.h"
+
+class AdmissionControl {
+public:
+    struct Limits {
+        size_t maxConnections = 0;  // Open connections, 0 for no limit
+        size_t maxTransfers = 0;    // Data responses in flight, 0 for no limit
+        std::chrono::milliseconds queueTimeout{10000};
+    };
+
+    // A queued request: its connection and the worker loop that owns it.
+    // The connection serial tells a reused descriptor from the original.
+    struct Ticket {
+        int worker = 0;
+        socket_t fd = INVALID_SOCKET_FD;
+        uint64_t connection = 0;
+    };
+
+private:
+    Limits limits;
+    std::atomic<size_t> connections{0};
+    std::mutex transferMutex;
+    size_t transfers = 0;
+    std::deque<Ticket> waiting;
+
+public:
+    explicit AdmissionControl(const Limits& limits) : limits(limits) {}
+
+    const Limits& configuration() const {
+        return limits;
+    }
+
+    // Counts a connection about to be accepted. Returns false at the limit.
+    bool tryOpen() {
+        size_t current = connections.load();
+        do {
+            if (limits.maxConnections > 0 && current >= limits.maxConnections) {
+                return false;
+            }
+        } while (!connections.compare_exchange_weak(current, current + 1));
+        return true;
+    }
+
+    // Undoes tryOpen once the connection is closed (or failed to open).
+    void close() {
+        connections--;
+    }
+
+    bool hasRoom() const {
+        return limits.maxConnections == 0 || connections.load() < limits.maxConnections;
+    }
+
+    size_t openConnections() const {
+        return connections.load();
+    }
+
+    bool limitsTransfers() const {
+        return limits.maxTransfers > 0;
+    }
+
+    // Takes a transfer slot for ticket, or queues it and returns false. A
+    // queued ticket is handed a slot by leave(), or removed by cancel().
+    bool enter(const Ticket& ticket) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        if (waiting.empty() && transfers < limits.maxTransfers) {
+            transfers++;
+            return true;
+        }
+        waiting.push_back(ticket);
+        return false;
+    }
+
+    // Frees a slot. If a request is waiting, the slot passes to it: returns
+    // true with next set, and the caller must wake next's worker.
+    bool leave(Ticket& next) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        if (!waiting.empty()) {
+            next = waiting.front();
+            waiting.pop_front();
+            return true;
+        }
+        transfers--;
+        return false;
+    }
+
+    // Removes a queued ticket. Returns false if it already left the queue
+    // (a slot is on its way to it).
+    bool cancel(const Ticket& ticket) {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+            if (it->connection == ticket.connection) {
+                waiting.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t transfersInFlight() {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        return transfers;
+    }
+
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        return waiting.size();
+    }
+};
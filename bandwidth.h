@@ -0,0 +1,239 @@
+#pragma once
+
+// Server-side bandwidth scheduler. Before a connection sends, it reserves a
+// grant of bytes from the client's token bucket (the per-client cap) and
+// from the global token bucket (the server-wide cap). Buckets may go into
+// debt. A grant is sendable once both buckets are out of debt, so
+// reservations are served in the order they were made and no connection
+// can be starved by luckier ones. The worker parks the connection until
+// then and sleeps in epoll_wait; it does not poll.
+//
+// When the global cap is the bottleneck, clients also share it by
+// weighted fair queuing. Clients are identified by IP address, so opening
+// more connections does not buy a larger share. Every client's virtual time
+// advances by bytes / weight. A client may not reserve more than one grant
+// ahead of another client that is waiting for bandwidth. A client that was
+// idle for a while starts level with the others instead of spending its
+// old credit.
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <cstddef>
+
+class BandwidthScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Limits {
+        double globalRate = 0;  // Bytes per second for the whole server, 0 for no cap
+        double clientRate = 0;  // Bytes per second per client IP, 0 for no cap
+        std::unordered_map<std::string, double> weights;  // Client IP -> share weight (default 1)
+
+        bool enabled() const {
+            return globalRate > 0 || clientRate > 0;
+        }
+    };
+
+private:
+    static constexpr size_t maxGrant = 128 * 1024;
+    static constexpr size_t minGrant = 4 * 1024;
+    static constexpr double burstSeconds = 0.05;
+    static constexpr auto idleReset = std::chrono::milliseconds(100);
+
+    class TokenBucket {
+    private:
+        double rate = 0;
+        double burst = 0;
+        double tokens = 0;
+        Clock::time_point updated;
+
+    public:
+        TokenBucket() = default;
+
+        TokenBucket(double rate, double burst, Clock::time_point now)
+            : rate(rate), burst(burst), tokens(burst), updated(now) {}
+
+        bool limited() const {
+            return rate > 0;
+        }
+
+        void refill(Clock::time_point now) {
+            double elapsed = std::chrono::duration<double>(now - updated).count();
+            tokens = std::min(burst, tokens + rate * elapsed);
+            updated = now;
+        }
+
+        // Seconds until the bucket is out of debt.
+        double debtSeconds() const {
+            return tokens >= 0 ? 0 : -tokens / rate;
+        }
+
+        void take(double count) {
+            tokens -= count;
+        }
+    };
+
+public:
+    struct Client {
+        std::string address;
+        double weight = 1;
+        double virtualTime = 0;   // Bytes granted / weight
+        TokenBucket bucket;
+        Clock::time_point lastSeen;
+        Clock::time_point waitingUntil;  // Latest time a connection was told to wait for
+    };
+
+private:
+    Limits limits;
+    size_t grantSize;             // Largest single grant
+    std::mutex schedulerMutex;
+    TokenBucket global;
+    std::unordered_map<std::string, std::weak_ptr<Client>> clients;
+
+    // Smallest virtual time among other clients, either those waiting for
+    // bandwidth or, with waitingOnly false, those active recently; weights
+    // is the sum over them and self. Returns false if there is none.
+    bool minimumVirtualTime(const Client& self, bool waitingOnly, Clock::time_point now, double& minimum,
+                            double& weights) {
+        bool found = false;
+        weights = self.weight;
+        for (auto& entry : clients) {
+            std::shared_ptr<Client> other = entry.second.lock();
+            if (!other || other.get() == &self) {
+                continue;
+            }
+            bool counts = waitingOnly ? other->waitingUntil > now : now - other->lastSeen < idleReset;
+            if (!counts) {
+                continue;
+            }
+            weights += other->weight;
+            if (!found || other->virtualTime < minimum) {
+                minimum = other->virtualTime;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+public:
+    explicit BandwidthScheduler(const Limits& limits) : limits(limits) {
+        // Grants small enough that a capped stream still gets data every
+        // few tens of milliseconds
+        double slowest = 0;
+        for (double rate : {limits.globalRate, limits.clientRate}) {
+            if (rate > 0 && (slowest == 0 || rate < slowest)) {
+                slowest = rate;
+            }
+        }
+        grantSize = slowest > 0 ? std::max(minGrant, std::min(maxGrant, static_cast<size_t>(slowest * burstSeconds)))
+                                : maxGrant;
+        if (limits.globalRate > 0) {
+            global = TokenBucket(limits.globalRate, std::max<double>(grantSize, limits.globalRate * burstSeconds),
+                                 Clock::now());
+        }
+    }
+
+    bool enabled() const {
+        return limits.enabled();
+    }
+
+    const Limits& configuration() const {
+        return limits;
+    }
+
+    // Registers a connection from address. Connections from one address
+    // share a Client for as long as any of them is open.
+    std::shared_ptr<Client> join(const std::string& address) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        std::shared_ptr<Client> client = clients[address].lock();
+        if (!client) {
+            for (auto it = clients.begin(); it != clients.end();) {
+                it = it->second.expired() ? clients.erase(it) : std::next(it);
+            }
+            client = std::make_shared<Client>();
+            client->address = address;
+            auto weight = limits.weights.find(address);
+            if (weight != limits.weights.end() && weight->second > 0) {
+                client->weight = weight->second;
+            }
+            if (limits.clientRate > 0) {
+                double burst = std::max<double>(grantSize, limits.clientRate * burstSeconds);
+                client->bucket = TokenBucket(limits.clientRate, burst, Clock::now());
+            }
+            clients[address] = client;
+        }
+        return client;
+    }
+
+    // Reserves up to wanted bytes for one connection of client, to be sent
+    // after wait. Returns 0 when the client is ahead of its fair share; the
+    // connection asks again after wait.
+    size_t acquire(Client& client, size_t wanted, std::chrono::nanoseconds& wait) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        auto now = Clock::now();
+        size_t grant = std::min(wanted, grantSize);
+
+        if (now - client.lastSeen > idleReset) {
+            double minimum = 0;
+            double weights = 0;
+            if (minimumVirtualTime(client, false, now, minimum, weights)) {
+                client.virtualTime = std::max(client.virtualTime, minimum);
+            }
+        }
+        client.lastSeen = now;
+
+        double delay = 0;
+        size_t reserved = grant;
+        if (global.limited()) {
+            // Let clients that are waiting catch up
+            double minimum = 0;
+            double weights = 0;
+            if (minimumVirtualTime(client, true, now, minimum, weights)) {
+                double lead = client.virtualTime - minimum - static_cast<double>(grantSize) / client.weight;
+                if (lead > 0) {
+                    delay = lead * weights / limits.globalRate;
+                    reserved = 0;
+                }
+            }
+        }
+
+        if (reserved > 0) {
+            if (client.bucket.limited()) {
+                client.bucket.refill(now);
+                client.bucket.take(static_cast<double>(reserved));
+                delay = std::max(delay, client.bucket.debtSeconds());
+            }
+            if (global.limited()) {
+                global.refill(now);
+                global.take(static_cast<double>(reserved));
+                delay = std::max(delay, global.debtSeconds());
+            }
+            client.virtualTime += static_cast<double>(reserved) / client.weight;
+        }
+
+        wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(delay));
+        if (delay > 0) {
+            client.waitingUntil = std::max(client.waitingUntil, now + wait);
+        }
+        return reserved;
+    }
+
+    // Returns reserved bytes that will not be sent.
+    void release(Client& client, size_t unused) {
+        if (unused == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        if (client.bucket.limited()) {
+            client.bucket.take(-static_cast<double>(unused));
+        }
+        if (global.limited()) {
+            global.take(-static_cast<double>(unused));
+        }
+        client.virtualTime -= static_cast<double>(unused) / client.weight;
+    }
+};
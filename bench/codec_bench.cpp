@@ -0,0 +1,186 @@
+// Per-chunk compression benchmark: ratio and codec speed of the wire codec
+// on compressible (log, CSV, JSON) and incompressible (random) corpora, and
+// the effective transfer rate those imply on 1 and 10 Gbit/s links - with
+// compression forced on, and with the adaptive sampler the server uses.
+//
+//   cmake --build build --target codec_bench
+//   build/codec_bench [file...]    (built-in corpora when no files are given)
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "compression.h"
+
+namespace {
+
+constexpr size_t corpusSize = 64 * 1024 * 1024;
+constexpr size_t chunkSize = 1024 * 1024;  // One READ request
+
+std::string makeLog(std::mt19937& rng) {
+    static const char* levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    static const char* components[] = {"auth", "db", "cache", "http", "scheduler"};
+    std::ostringstream out;
+    double time = 1700000000.0;
+    while (static_cast<size_t>(out.tellp()) < corpusSize) {
+        time += (rng() % 10000) / 1e6;
+        out << std::fixed << std::setprecision(3) << time << " " << levels[rng() % 4]
+            << " [" << components[rng() % 5] << "] request id=" << std::hex << rng() << std::dec
+            << " user=" << rng() % 5000 << " latency_ms=" << rng() % 900
+            << " path=/api/v1/" << components[rng() % 5] << "/" << rng() % 100000
+            << " status=" << (rng() % 5 == 0 ? 500 : 200) << "\n";
+    }
+    return out.str();
+}
+
+std::string makeCsv(std::mt19937& rng) {
+    std::ostringstream out;
+    out << "id,timestamp,region,sku,quantity,price\n";
+    static const char* regions[] = {"eu-west", "us-east", "ap-south"};
+    for (uint64_t id = 0; static_cast<size_t>(out.tellp()) < corpusSize; ++id) {
+        out << id << "," << 1700000000 + id * 7 << "," << regions[rng() % 3] << ",SKU-"
+            << rng() % 2000 << "," << rng() % 20 << "," << rng() % 10000 / 100.0 << "\n";
+    }
+    return out.str();
+}
+
+std::string makeJson(std::mt19937& rng) {
+    std::ostringstream out;
+    out << "[\n";
+    for (uint64_t id = 0; static_cast<size_t>(out.tellp()) < corpusSize; ++id) {
+        out << "  {\"id\": " << id << ", \"name\": \"user" << rng() % 100000
+            << "\", \"active\": " << (rng() % 2 ? "true" : "false")
+            << ", \"score\": " << rng() % 1000 << ", \"tags\": [\"alpha\", \"beta\"]},\n";
+    }
+    out << "]\n";
+    return out.str();
+}
+
+std::string makeRandom(std::mt19937& rng) {
+    std::string data(corpusSize, '\0');
+    for (char& c : data) {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+struct Result {
+    double ratio = 1;             // Wire bytes / raw bytes
+    double compressMBps = 0;
+    double decompressMBps = 0;
+    double adaptiveRatio = 1;     // Wire bytes / raw bytes with the sampler
+    double adaptiveShare = 0;     // Fraction of chunks the sampler compressed
+};
+
+Result measure(const std::string& corpus) {
+    Result result;
+    std::vector<std::string> encoded;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t wire = 0;
+    for (size_t offset = 0; offset < corpus.size(); offset += chunkSize) {
+        std::string out;
+        compression::encode(corpus.data() + offset, std::min(chunkSize, corpus.size() - offset), out);
+        wire += out.size();
+        encoded.push_back(std::move(out));
+    }
+    double compressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<char> raw(compression::blockSize);
+    start = std::chrono::steady_clock::now();
+    size_t offset = 0;
+    for (const std::string& chunk : encoded) {
+        size_t position = 0;
+        while (position < chunk.size()) {
+            size_t rawLength = 0;
+            size_t storedLength = 0;
+            compression::decodeBlockHeader(chunk.data() + position, rawLength, storedLength);
+            position += compression::blockHeaderSize;
+            if (storedLength == rawLength) {
+                std::copy_n(chunk.data() + position, rawLength, raw.data());
+            } else {
+                lz4::decompress(chunk.data() + position, storedLength, raw.data(), rawLength);
+            }
+            if (!std::equal(raw.begin(), raw.begin() + rawLength, corpus.begin() + offset)) {
+                throw std::runtime_error("Round trip mismatch");
+            }
+            position += storedLength;
+            offset += rawLength;
+        }
+    }
+    double decompressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    compression::Sampler sampler;
+    uint64_t adaptiveWire = 0;
+    size_t compressedChunks = 0;
+    for (size_t i = 0; i < encoded.size(); ++i) {
+        size_t rawLength = std::min(chunkSize, corpus.size() - i * chunkSize);
+        if (sampler.shouldCompress()) {
+            sampler.record(rawLength, encoded[i].size());
+            adaptiveWire += encoded[i].size();
+            compressedChunks++;
+        } else {
+            adaptiveWire += rawLength;
+        }
+    }
+
+    double megabytes = corpus.size() / (1024.0 * 1024.0);
+    result.ratio = static_cast<double>(wire) / corpus.size();
+    result.compressMBps = megabytes / compressSeconds;
+    result.decompressMBps = megabytes / decompressSeconds;
+    result.adaptiveRatio = static_cast<double>(adaptiveWire) / corpus.size();
+    result.adaptiveShare = static_cast<double>(compressedChunks) / encoded.size();
+    return result;
+}
+
+// Raw MB/s delivered when the link carries ratio-compressed bytes and the
+// two ends compress and decompress in a pipeline with the transfer; only
+// compressedShare of the chunks pay the codec cost.
+double effectiveMBps(double linkMBps, double ratio, const Result& result, double compressedShare) {
+    double perMB = ratio / linkMBps;
+    double codec = compressedShare * std::max(1 / result.compressMBps, 1 / result.decompressMBps);
+    return 1 / std::max(perMB, codec);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<std::pair<std::string, std::string>> corpora;
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            std::ifstream input(argv[i], std::ios::binary);
+            std::ostringstream contents;
+            contents << input.rdbuf();
+            corpora.emplace_back(argv[i], contents.str());
+        }
+    } else {
+        std::mt19937 rng(42);
+        corpora.emplace_back("log", makeLog(rng));
+        corpora.emplace_back("csv", makeCsv(rng));
+        corpora.emplace_back("json", makeJson(rng));
+        corpora.emplace_back("random", makeRandom(rng));
+    }
+
+    const double links[] = {125.0, 1250.0};  // 1 and 10 Gbit/s in MB/s
+    std::cout << std::fixed << std::setprecision(1)
+              << "corpus     ratio  comp MB/s  decomp MB/s  sampled"
+                 "  |  1G raw/forced/adaptive  |  10G raw/forced/adaptive\n";
+    for (const auto& corpus : corpora) {
+        Result result = measure(corpus.second);
+        std::cout << std::left << std::setw(10) << corpus.first << std::right
+                  << std::setw(6) << std::setprecision(3) << result.ratio << std::setprecision(1)
+                  << std::setw(11) << result.compressMBps << std::setw(13) << result.decompressMBps
+                  << std::setw(8) << result.adaptiveShare * 100 << "%";
+        for (double link : links) {
+            std::cout << "  |  " << std::setw(6) << link
+                      << std::setw(8) << effectiveMBps(link, result.ratio, result, 1)
+                      << std::setw(8) << effectiveMBps(link, result.adaptiveRatio, result, result.adaptiveShare);
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
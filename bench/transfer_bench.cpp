@@ -0,0 +1,569 @@
+// Loopback benchmark for the server and client binaries. Starts a server on
+// a local port, then for every combination of server send mode, file size,
+// connection count, READ size, concurrent client count and page cache state
+// runs the client processes against it and reports throughput, time to
+// first byte, CPU per GB and peak RSS.
+// Rows are appended to a CSV file so runs from different commits can be
+// compared. A run fails if a client exits non-zero or leaves a file of the
+// wrong size; its row is marked FAILED and the bench exits 1.
+//
+//   transfer_bench --server ./server --client ./client [options] [-- client args]
+//
+//   --sizes 1K,1M,64M,1G   File sizes (K/M/G suffixes; up to 10G and beyond)
+//   --threads 1,4,8        Connections per client
+//   --request-sizes 1M     READ sizes (client --request-size)
+//   --clients 1,4          Concurrent client processes
+//   --send-modes sendfile  Server send paths: sendfile, copy (pread/send), mmap,
+//                          direct (O_DIRECT pread/send)
+//   --cache warm           Page cache state: warm (file resident) or cold
+//                          (evicted before every run and probe)
+//   --repeat 3             Runs per configuration; medians are reported
+//   --ttfb-samples 50      Time-to-first-byte probes per configuration
+//   --workers 0            Server worker loops (0: one per core)
+//   --work-dir <dir>       Test files and downloads (default: transfer-bench
+//                          under the system temp directory)
+//   --csv results.csv      Appended; the header is written for a new file
+//   --label text           Stored in every row, e.g. the commit
+//   --port 18080
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <csignal>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "net.h"
+#include "protocol.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+    std::string serverPath;
+    std::string clientPath;
+    std::vector<uint64_t> sizes{1024, 1024 * 1024, 64ull * 1024 * 1024, 1024ull * 1024 * 1024};
+    std::vector<uint64_t> threads{1, 4, 8};
+    std::vector<uint64_t> requestSizes{1024 * 1024};
+    std::vector<uint64_t> clients{1, 4};
+    std::vector<std::string> sendModes{"sendfile"};
+    std::vector<std::string> caches{"warm"};
+    int repeat = 3;
+    int ttfbSamples = 50;
+    int workers = 0;
+    int port = 18080;
+    std::string workDir = (fs::temp_directory_path() / "transfer-bench").string();
+    std::string csvPath = "results.csv";
+    std::string label;
+    std::vector<std::string> clientArgs;
+};
+
+struct Row {
+    std::string sendMode;
+    std::string cache;
+    uint64_t fileSize = 0;
+    uint64_t threads = 0;
+    uint64_t requestSize = 0;
+    uint64_t clients = 0;
+    bool ok = true;
+    double seconds = 0;        // Median wall time of a run
+    double mbps = 0;           // All clients' bytes over the median wall time
+    double ttfbP50 = 0;        // Milliseconds
+    double ttfbP99 = 0;
+    double cpuPerGB = 0;       // Client and server CPU seconds per GB moved
+    long clientRssKB = 0;      // Largest client peak RSS
+    long serverRssKB = 0;      // Server peak RSS during the configuration
+};
+
+uint64_t parseSize(const std::string& text) {
+    size_t end = 0;
+    double value = std::stod(text, &end);
+    std::string suffix = text.substr(end);
+    uint64_t scale = 1;
+    if (suffix == "K" || suffix == "k") {
+        scale = 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        scale = 1024 * 1024;
+    } else if (suffix == "G" || suffix == "g") {
+        scale = 1024ull * 1024 * 1024;
+    } else if (!suffix.empty()) {
+        throw std::invalid_argument("Bad size: " + text);
+    }
+    return static_cast<uint64_t>(value * scale);
+}
+
+std::vector<uint64_t> parseList(const std::string& text) {
+    std::vector<uint64_t> values;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        values.push_back(parseSize(item));
+    }
+    return values;
+}
+
+std::vector<std::string> parseNames(const std::string& text, const std::vector<std::string>& allowed) {
+    std::vector<std::string> names;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (std::find(allowed.begin(), allowed.end(), item) == allowed.end()) {
+            throw std::invalid_argument("Unknown value: " + item);
+        }
+        names.push_back(item);
+    }
+    return names;
+}
+
+std::string formatSize(uint64_t bytes) {
+    static const char* units[] = {"B", "K", "M", "G"};
+    int unit = 0;
+    while (unit < 3 && bytes >= 1024 && bytes % 1024 == 0) {
+        bytes /= 1024;
+        unit++;
+    }
+    return std::to_string(bytes) + units[unit];
+}
+
+// Incompressible test data, regenerated only when the size is wrong.
+void makeFile(const fs::path& path, uint64_t size) {
+    std::error_code ec;
+    if (fs::file_size(path, ec) == size && !ec) {
+        return;
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    std::vector<uint64_t> block(128 * 1024);
+    uint64_t state = 0x9E3779B97F4A7C15ull ^ size;
+    for (uint64_t written = 0; written < size;) {
+        for (uint64_t& word : block) {
+            // splitmix64
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            word = z ^ (z >> 31);
+        }
+        size_t length = static_cast<size_t>(std::min<uint64_t>(block.size() * 8, size - written));
+        out.write(reinterpret_cast<const char*>(block.data()), length);
+        written += length;
+    }
+    if (!out) {
+        throw std::runtime_error("Cannot write test file " + path.string());
+    }
+}
+
+// Makes the file resident in the page cache, or evicts it. Eviction needs
+// no privileges: the test file is clean, so POSIX_FADV_DONTNEED drops it.
+void setCached(const fs::path& path, bool resident) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), "Cannot open " + path.string());
+    }
+    if (resident) {
+        std::vector<char> buffer(1024 * 1024);
+        while (read(fd, buffer.data(), buffer.size()) > 0) {
+        }
+    } else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+}
+
+pid_t spawn(const std::vector<std::string>& args, const fs::path& cwd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::system_error(errno, std::system_category(), "fork failed");
+    }
+    if (pid == 0) {
+        if (chdir(cwd.c_str()) != 0) {
+            _exit(127);
+        }
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        std::vector<char*> argv;
+        for (const std::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+double cpuSeconds(const rusage& usage) {
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// utime + stime of a running process, from /proc.
+double processCpuSeconds(pid_t pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string field;
+    unsigned long long utime = 0;
+    unsigned long long stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+long processPeakRssKB(pid_t pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+// Restarts a process's peak RSS from its current RSS.
+void resetPeakRss(pid_t pid) {
+    std::ofstream out("/proc/" + std::to_string(pid) + "/clear_refs");
+    out << "5";
+}
+
+void sendFrame(socket_t fd, protocol::FrameHeader header, const std::string& payload) {
+    std::string frame = protocol::encodeFrame(header, payload);
+    net::sendAll(fd, frame.data(), frame.size());
+}
+
+void receiveExact(socket_t fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = recv(fd, data, length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Probe connection closed");
+        }
+        data += received;
+        length -= static_cast<size_t>(received);
+    }
+}
+
+protocol::FrameHeader receiveResponse(socket_t fd, std::string& payload) {
+    char bytes[protocol::headerSize];
+    receiveExact(fd, bytes, sizeof(bytes));
+    protocol::FrameHeader header = protocol::decodeHeader(bytes);
+    payload.resize(header.payloadLength);
+    receiveExact(fd, &payload[0], payload.size());
+    if (header.op == protocol::Op::Error) {
+        throw std::runtime_error("Server error: " + payload);
+    }
+    return header;
+}
+
+// Time a fresh client needs to see the first data byte of a file: STAT on
+// one connection, then OPEN and READ on a new one, as the client does.
+double probeFirstByte(int port, const std::string& name, uint64_t requestSize) {
+    auto start = Clock::now();
+    std::string payload;
+
+    socket_t statFd = net::connectTo("127.0.0.1", port);
+    net::setNoDelay(statFd);
+    protocol::FrameHeader stat;
+    stat.op = protocol::Op::Stat;
+    sendFrame(statFd, stat, name);
+    uint64_t size = receiveResponse(statFd, payload).length;
+    net::closeSocket(statFd);
+
+    socket_t fd = net::connectTo("127.0.0.1", port);
+    net::setNoDelay(fd);
+    protocol::FrameHeader open;
+    open.op = protocol::Op::Open;
+    open.fileId = 1;
+    sendFrame(fd, open, name);
+    receiveResponse(fd, payload);
+
+    protocol::FrameHeader read;
+    read.op = protocol::Op::Read;
+    read.fileId = 1;
+    read.length = std::min(size, requestSize);
+    sendFrame(fd, read, "");
+    uint64_t remaining = receiveResponse(fd, payload).length;
+    char buffer[64 * 1024];
+    receiveExact(fd, buffer, 1);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Drain the rest so closing does not reset a connection with unread data
+    for (remaining--; remaining > 0;) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(sizeof(buffer), remaining));
+        receiveExact(fd, buffer, length);
+        remaining -= length;
+    }
+    net::closeSocket(fd);
+    return seconds;
+}
+
+double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(fraction * values.size()));
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+class Bench {
+private:
+    Settings settings;
+    fs::path dataDir;
+    fs::path runDir;
+    pid_t serverPid = -1;
+
+    void startServer(const std::string& sendMode) {
+        std::vector<std::string> args{settings.serverPath};
+        if (sendMode == "copy") {
+            args.push_back("--copy");
+        } else if (sendMode == "mmap") {
+            args.push_back("--mmap");
+        } else if (sendMode == "direct") {
+            args.push_back("--direct-io");
+        }
+        args.insert(args.end(), {std::to_string(settings.port), std::to_string(settings.workers)});
+        serverPid = spawn(args, dataDir);
+        auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (true) {
+            try {
+                net::closeSocket(net::connectTo("127.0.0.1", settings.port));
+                return;
+            } catch (const std::system_error&) {
+                if (Clock::now() > deadline || waitpid(serverPid, nullptr, WNOHANG) != 0) {
+                    throw std::runtime_error("Server did not start on port " + std::to_string(settings.port));
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        }
+    }
+
+    void stopServer() {
+        if (serverPid > 0) {
+            kill(serverPid, SIGTERM);
+            waitpid(serverPid, nullptr, 0);
+            serverPid = -1;
+        }
+    }
+
+    Row measure(const std::string& sendMode, uint64_t fileSize, uint64_t threads, uint64_t requestSize,
+                uint64_t clients, const std::string& cache) {
+        Row row;
+        row.sendMode = sendMode;
+        row.cache = cache;
+        row.fileSize = fileSize;
+        row.threads = threads;
+        row.requestSize = requestSize;
+        row.clients = clients;
+        std::string name = "file_" + std::to_string(fileSize) + ".bin";
+        bool cold = cache == "cold";
+        resetPeakRss(serverPid);
+
+        std::vector<double> seconds;
+        std::vector<double> cpuPerGB;
+        for (int run = 0; run < settings.repeat; ++run) {
+            setCached(dataDir / name, !cold);
+            std::vector<pid_t> pids;
+            double serverCpu = processCpuSeconds(serverPid);
+            auto start = Clock::now();
+            for (uint64_t c = 0; c < clients; ++c) {
+                fs::path cwd = runDir / ("client" + std::to_string(c));
+                fs::remove_all(cwd / "downloads");
+                fs::create_directories(cwd);
+                std::vector<std::string> args{settings.clientPath, "--quiet", "--request-size",
+                                              std::to_string(requestSize)};
+                args.insert(args.end(), settings.clientArgs.begin(), settings.clientArgs.end());
+                args.insert(args.end(), {"127.0.0.1", std::to_string(threads), name, std::to_string(settings.port)});
+                pids.push_back(spawn(args, cwd));
+            }
+
+            double clientCpu = 0;
+            for (size_t c = 0; c < pids.size(); ++c) {
+                int status = 0;
+                rusage usage;
+                wait4(pids[c], &status, 0, &usage);
+                clientCpu += cpuSeconds(usage);
+                row.clientRssKB = std::max(row.clientRssKB, usage.ru_maxrss);
+                std::error_code ec;
+                fs::path output = runDir / ("client" + std::to_string(c)) / "downloads" / name;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || fs::file_size(output, ec) != fileSize || ec) {
+                    row.ok = false;
+                }
+            }
+            seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+            double cpu = clientCpu + processCpuSeconds(serverPid) - serverCpu;
+            cpuPerGB.push_back(cpu / (static_cast<double>(fileSize * clients) / 1e9));
+        }
+
+        std::vector<double> ttfb;
+        if (fileSize > 0) {
+            for (int i = 0; i < settings.ttfbSamples; ++i) {
+                try {
+                    if (cold) {
+                        setCached(dataDir / name, false);
+                    }
+                    ttfb.push_back(probeFirstByte(settings.port, name, requestSize) * 1000);
+                } catch (const std::exception&) {
+                    row.ok = false;
+                }
+            }
+        }
+
+        row.seconds = percentile(seconds, 0.5);
+        row.mbps = row.seconds > 0 ? fileSize * clients / (1024.0 * 1024.0) / row.seconds : 0;
+        row.cpuPerGB = fileSize > 0 ? percentile(cpuPerGB, 0.5) : 0;
+        row.ttfbP50 = percentile(ttfb, 0.5);
+        row.ttfbP99 = percentile(ttfb, 0.99);
+        row.serverRssKB = processPeakRssKB(serverPid);
+        return row;
+    }
+
+    void writeCsv(const std::vector<Row>& rows) {
+        bool fresh = !fs::exists(settings.csvPath);
+        std::ofstream csv(settings.csvPath, std::ios::app);
+        if (fresh) {
+            csv << "label,file_bytes,threads,request_bytes,clients,ok,seconds,mb_per_s,"
+                   "ttfb_p50_ms,ttfb_p99_ms,cpu_s_per_gb,client_peak_rss_kb,server_peak_rss_kb,send_mode,cache\n";
+        }
+        csv << std::fixed << std::setprecision(4);
+        for (const Row& row : rows) {
+            csv << settings.label << "," << row.fileSize << "," << row.threads << "," << row.requestSize << ","
+                << row.clients << "," << (row.ok ? 1 : 0) << "," << row.seconds << "," << row.mbps << ","
+                << row.ttfbP50 << "," << row.ttfbP99 << "," << row.cpuPerGB << "," << row.clientRssKB << ","
+                << row.serverRssKB << "," << row.sendMode << "," << row.cache << "\n";
+        }
+    }
+
+public:
+    explicit Bench(const Settings& settings) : settings(settings) {
+        fs::path work = fs::absolute(settings.workDir);
+        dataDir = work / "data";
+        runDir = work / "run";
+        fs::create_directories(dataDir);
+        fs::create_directories(runDir);
+        this->settings.serverPath = fs::absolute(settings.serverPath).string();
+        this->settings.clientPath = fs::absolute(settings.clientPath).string();
+    }
+
+    ~Bench() {
+        stopServer();
+    }
+
+    // Returns false if any configuration failed.
+    bool run() {
+        for (uint64_t size : settings.sizes) {
+            makeFile(dataDir / ("file_" + std::to_string(size) + ".bin"), size);
+        }
+        std::cout << std::fixed << std::setprecision(2)
+                  << "    mode cache     size threads request clients       MB/s  ttfb p50/p99 ms  cpu s/GB"
+                     "  rss client/server MB\n";
+        std::vector<Row> rows;
+        for (const std::string& sendMode : settings.sendModes) {
+            startServer(sendMode);
+            for (uint64_t size : settings.sizes) {
+                for (uint64_t threads : settings.threads) {
+                    for (uint64_t requestSize : settings.requestSizes) {
+                        for (uint64_t clients : settings.clients) {
+                            for (const std::string& cache : settings.caches) {
+                                Row row = measure(sendMode, size, threads, requestSize, clients, cache);
+                                std::cout << std::setw(8) << sendMode << std::setw(6) << cache
+                                          << std::setw(9) << formatSize(size) << std::setw(8) << threads
+                                          << std::setw(8) << formatSize(requestSize) << std::setw(8) << clients
+                                          << std::setw(11) << row.mbps << std::setw(8) << row.ttfbP50 << "/"
+                                          << std::left << std::setw(8) << row.ttfbP99 << std::right
+                                          << std::setw(10) << row.cpuPerGB << std::setw(10)
+                                          << row.clientRssKB / 1024.0 << "/" << row.serverRssKB / 1024.0
+                                          << (row.ok ? "" : "  FAILED") << std::endl;
+                                rows.push_back(row);
+                            }
+                        }
+                    }
+                }
+            }
+            stopServer();
+        }
+        writeCsv(rows);
+        std::cout << "Results appended to " << settings.csvPath << std::endl;
+        return std::all_of(rows.begin(), rows.end(), [](const Row& row) { return row.ok; });
+    }
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Settings settings;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--") {
+                settings.clientArgs.assign(argv + i + 1, argv + argc);
+                break;
+            } else if (arg == "--server" && hasValue) {
+                settings.serverPath = argv[++i];
+            } else if (arg == "--client" && hasValue) {
+                settings.clientPath = argv[++i];
+            } else if (arg == "--sizes" && hasValue) {
+                settings.sizes = parseList(argv[++i]);
+            } else if (arg == "--threads" && hasValue) {
+                settings.threads = parseList(argv[++i]);
+            } else if (arg == "--request-sizes" && hasValue) {
+                settings.requestSizes = parseList(argv[++i]);
+            } else if (arg == "--clients" && hasValue) {
+                settings.clients = parseList(argv[++i]);
+            } else if (arg == "--send-modes" && hasValue) {
+                settings.sendModes = parseNames(argv[++i], {"sendfile", "copy", "mmap", "direct"});
+            } else if (arg == "--cache" && hasValue) {
+                settings.caches = parseNames(argv[++i], {"warm", "cold"});
+            } else if (arg == "--repeat" && hasValue) {
+                settings.repeat = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--ttfb-samples" && hasValue) {
+                settings.ttfbSamples = std::stoi(argv[++i]);
+            } else if (arg == "--workers" && hasValue) {
+                settings.workers = std::stoi(argv[++i]);
+            } else if (arg == "--work-dir" && hasValue) {
+                settings.workDir = argv[++i];
+            } else if (arg == "--csv" && hasValue) {
+                settings.csvPath = argv[++i];
+            } else if (arg == "--label" && hasValue) {
+                settings.label = argv[++i];
+            } else if (arg == "--port" && hasValue) {
+                settings.port = std::stoi(argv[++i]);
+            } else {
+                throw std::invalid_argument("Unknown argument: " + arg);
+            }
+        }
+        if (settings.serverPath.empty() || settings.clientPath.empty()) {
+            throw std::invalid_argument("--server and --client are required");
+        }
+
+        Bench bench(settings);
+        if (!bench.run()) {
+            std::cerr << "Some runs failed; see the rows marked FAILED" << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+// Page-aligned I/O buffers shared by every connection of a process. A
+// buffer is leased for the length of a transfer and goes back on the free
+// list afterwards, so large buffers are allocated once instead of per
+// request. The alignment also satisfies O_DIRECT, which needs the memory,
+// file offset and length of each transfer to be multiples of the logical
+// block size.
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+
+class BufferPool {
+public:
+    static constexpr size_t alignment = 4096;
+    static constexpr size_t defaultBufferSize = 1024 * 1024;
+    static constexpr size_t minBufferSize = 64 * 1024;
+    static constexpr size_t maxBufferSize = 64 * 1024 * 1024;
+
+    // A leased buffer; returns itself to the pool when destroyed. An empty
+    // Buffer holds nothing.
+    class Buffer {
+    private:
+        BufferPool* pool = nullptr;
+        char* memory = nullptr;
+
+        friend class BufferPool;
+        Buffer(BufferPool* pool, char* memory) : pool(pool), memory(memory) {}
+
+    public:
+        Buffer() = default;
+
+        Buffer(Buffer&& other) noexcept : pool(other.pool), memory(other.memory) {
+            other.pool = nullptr;
+            other.memory = nullptr;
+        }
+
+        Buffer& operator=(Buffer&& other) noexcept {
+            if (this != &other) {
+                reset();
+                pool = other.pool;
+                memory = other.memory;
+                other.pool = nullptr;
+                other.memory = nullptr;
+            }
+            return *this;
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        ~Buffer() {
+            reset();
+        }
+
+        void reset() {
+            if (memory) {
+                pool->release(memory);
+                pool = nullptr;
+                memory = nullptr;
+            }
+        }
+
+        bool empty() const {
+            return memory == nullptr;
+        }
+
+        char* data() const {
+            return memory;
+        }
+
+        size_t size() const {
+            return memory ? pool->bufferSize() : 0;
+        }
+    };
+
+private:
+    size_t size;
+    size_t maxIdle;
+    std::mutex poolMutex;
+    std::vector<char*> idle;
+
+    void release(char* memory) {
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (idle.size() < maxIdle) {
+                idle.push_back(memory);
+                return;
+            }
+        }
+        std::free(memory);
+    }
+
+public:
+    // bufferSize is rounded up to a multiple of the alignment and clamped
+    // to [minBufferSize, maxBufferSize]. At most maxIdle free buffers are
+    // kept; more are freed as they come back.
+    explicit BufferPool(size_t bufferSize = defaultBufferSize, size_t maxIdle = 64)
+        : size(roundUp(bufferSize < minBufferSize ? minBufferSize
+                                                  : bufferSize > maxBufferSize ? maxBufferSize : bufferSize)),
+          maxIdle(maxIdle) {}
+
+    ~BufferPool() {
+        for (char* memory : idle) {
+            std::free(memory);
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer acquire() {
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (!idle.empty()) {
+                char* memory = idle.back();
+                idle.pop_back();
+                return Buffer(this, memory);
+            }
+        }
+        void* memory = nullptr;
+        if (posix_memalign(&memory, alignment, size) != 0) {
+            throw std::bad_alloc();
+        }
+        return Buffer(this, static_cast<char*>(memory));
+    }
+
+    size_t bufferSize() const {
+        return size;
+    }
+
+    static size_t roundUp(size_t value) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    static size_t roundDown(size_t value) {
+        return value / alignment * alignment;
+    }
+};
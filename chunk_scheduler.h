@@ -0,0 +1,189 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+// Dynamic range scheduler for the client. The file is cut into many ranges
+// held in a shared queue; each connection claims the next range and fetches
+// it in sub-requests. When the queue runs dry, an idle connection steals the
+// tail half of the range that is furthest from finishing, so one slow stream
+// no longer holds up the whole download.
+class ChunkScheduler {
+public:
+    struct Range {
+        int id = 0;
+        uint64_t offset = 0;     // First byte of the range
+        uint64_t end = 0;        // One past the last byte; shrinks when stolen from
+        uint64_t requested = 0;  // Bytes up to here have been asked for
+        uint64_t received = 0;   // Bytes up to here are written
+        bool active = false;
+        std::chrono::steady_clock::time_point claimedAt;
+    };
+
+private:
+    std::mutex schedulerMutex;
+    std::vector<Range> ranges;
+    std::deque<int> pending;
+    uint64_t minStealSize;
+
+    int addRange(uint64_t offset, uint64_t end) {
+        Range range;
+        range.id = static_cast<int>(ranges.size());
+        range.offset = offset;
+        range.end = end;
+        range.requested = offset;
+        range.received = offset;
+        ranges.push_back(range);
+        return range.id;
+    }
+
+    // Estimated time until a range finishes at its observed rate; ranges
+    // that have not received anything yet are treated as the slowest.
+    double secondsRemaining(const Range& range, std::chrono::steady_clock::time_point now) const {
+        double elapsed = std::chrono::duration<double>(now - range.claimedAt).count();
+        uint64_t done = range.received - range.offset;
+        uint64_t left = range.end - range.received;
+        if (done == 0 || elapsed <= 0) {
+            return static_cast<double>(left);
+        }
+        return left / (done / elapsed);
+    }
+
+    bool steal(int& rangeId) {
+        auto now = std::chrono::steady_clock::now();
+        Range* victim = nullptr;
+        double slowest = -1;
+        for (Range& range : ranges) {
+            if (!range.active || range.end - range.requested < 2 * minStealSize) {
+                continue;
+            }
+            double remaining = secondsRemaining(range, now);
+            if (remaining > slowest) {
+                slowest = remaining;
+                victim = &range;
+            }
+        }
+        if (victim == nullptr) {
+            return false;
+        }
+
+        uint64_t mid = victim->requested + (victim->end - victim->requested) / 2;
+        uint64_t end = victim->end;
+        victim->end = mid;
+        rangeId = addRange(mid, end);
+        return true;
+    }
+
+public:
+    ChunkScheduler(uint64_t fileSize, uint64_t chunkSize, uint64_t minStealSize)
+        : ChunkScheduler({{0, fileSize}}, chunkSize, minStealSize) {}
+
+    // Schedules only the given [begin, end) spans, e.g. the parts of a
+    // resumed download that are not on disk yet.
+    ChunkScheduler(const std::vector<std::pair<uint64_t, uint64_t>>& spans, uint64_t chunkSize, uint64_t minStealSize)
+        : minStealSize(std::max<uint64_t>(1, minStealSize)) {
+        chunkSize = std::max<uint64_t>(1, chunkSize);
+        for (const auto& span : spans) {
+            for (uint64_t offset = span.first; offset < span.second; offset += chunkSize) {
+                pending.push_back(addRange(offset, std::min(span.second, offset + chunkSize)));
+            }
+        }
+    }
+
+    // Hands out the next queued range, or steals from the slowest active
+    // one. Returns false when there is nothing left to fetch.
+    bool claim(int& rangeId) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        if (!pending.empty()) {
+            rangeId = pending.front();
+            pending.pop_front();
+        } else if (!steal(rangeId)) {
+            return false;
+        }
+
+        Range& range = ranges[rangeId];
+        range.active = true;
+        range.claimedAt = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Reserves the next sub-request of at most maxLength bytes within the
+    // range. Returns 0 once the range (possibly shortened by a steal) has
+    // been fully requested.
+    uint64_t nextRequest(int rangeId, uint64_t maxLength, uint64_t& offset) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        Range& range = ranges[rangeId];
+        if (range.requested >= range.end) {
+            return 0;
+        }
+        offset = range.requested;
+        uint64_t length = std::min(maxLength, range.end - range.requested);
+        range.requested += length;
+        return length;
+    }
+
+    Range range(int rangeId) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        return ranges[rangeId];
+    }
+
+    void markReceived(int rangeId, uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        ranges[rangeId].received += bytes;
+    }
+
+    void complete(int rangeId) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        ranges[rangeId].active = false;
+    }
+
+    // Gives up on a range after a connection failure: what was written is
+    // kept, the rest goes back to the queue for another connection.
+    void abandon(int rangeId) {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        Range& range = ranges[rangeId];
+        range.active = false;
+        if (range.received < range.end) {
+            uint64_t end = range.end;
+            range.end = range.received;
+            range.requested = range.received;
+            pending.push_back(addRange(range.received, end));
+        }
+    }
+
+    // Ranges that hold data, ordered by offset.
+    std::vector<Range> filledRanges() {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        std::vector<Range> result;
+        for (const Range& range : ranges) {
+            if (range.received > range.offset) {
+                result.push_back(range);
+            }
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const Range& a, const Range& b) { return a.offset < b.offset; });
+        return result;
+    }
+
+    int rangeCount() {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        return static_cast<int>(ranges.size());
+    }
+
+    bool finished() {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        if (!pending.empty()) {
+            return false;
+        }
+        for (const Range& range : ranges) {
+            if (range.received < range.end) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
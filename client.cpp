@@ -1,288 +1,2580 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <thread>
-#include <mutex>
-#include <atomic>
-#include <cstring>
-#include <fstream>
-#include <memory>
-#include <system_error>
-#include <chrono>
-#include <filesystem>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#pragma comment(lib, "ws2_32.lib")
-
-namespace fs = std::filesystem;
-
-class DownloadClient {
-private:
-    std::mutex fileMutex;  // Mutex for file access
-    std::string ipAddress;
-    std::string filename;
-    int threadCount;
-    std::string outputDir;
-    
-    void handleConnection(int threadId) {
-        try {
-            // Initialize socket with timeout
-            SOCKET sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-            if (sockfd == INVALID_SOCKET) {
-                throw std::system_error(WSAGetLastError(), std::system_category(), "Could not create socket");
-            }
-
-            // Set socket timeout (5000ms - increased for reliability)
-            DWORD timeout = 5000;
-            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-
-            // Configure server address
-            sockaddr_in serv_addr;
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(8000);
-            
-            if (inet_pton(AF_INET, ipAddress.c_str(), &serv_addr.sin_addr) <= 0) {
-                closesocket(sockfd);
-                throw std::runtime_error("Invalid address");
-            }
-
-            // Connection with retries
-            int retries = 3;
-            while (retries-- > 0) {
-                if (connect(sockfd, (sockaddr*)&serv_addr, sizeof(serv_addr)) != SOCKET_ERROR) {
-                    break;
-                }
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-            }
-            
-            if (retries < 0) {
-                int error = WSAGetLastError();
-                closesocket(sockfd);
-                throw std::system_error(error, std::system_category(), "Connection failed after retries");
-            }
-
-            // Send request (threadId,threadCount,filename)
-            std::string request = std::to_string(threadId) + "," + 
-                                 std::to_string(threadCount) + "," + 
-                                 filename;
-            
-            if (send(sockfd, request.c_str(), request.size(), 0) == SOCKET_ERROR) {
-                int error = WSAGetLastError();
-                closesocket(sockfd);
-                throw std::system_error(error, std::system_category(), "Request failed");
-            }
-
-            // Receive response header
-            std::vector<char> headerBuffer;
-            char buffer[1024];
-            bool headerComplete = false;
-            size_t expectedSize = 0;
-            std::string partFilename = "";
-            
-            // Read until we find the newline that terminates the header
-            while (!headerComplete) {
-                int bytesReceived = recv(sockfd, buffer, sizeof(buffer), 0);
-                if (bytesReceived <= 0) {
-                    closesocket(sockfd);
-                    throw std::system_error(WSAGetLastError(), std::system_category(), "Failed to receive header");
-                }
-                
-                // Add to our header buffer
-                headerBuffer.insert(headerBuffer.end(), buffer, buffer + bytesReceived);
-                
-                // Check if we have a complete header
-                std::string headerStr(headerBuffer.begin(), headerBuffer.end());
-                size_t endOfHeader = headerStr.find('\n');
-                if (endOfHeader != std::string::npos) {
-                    // We have the complete header
-                    headerComplete = true;
-                    
-                    // Parse the size
-                    size_t sizeStart = headerStr.find("SIZE:") + 5;
-                    size_t sizeEnd = headerStr.find(":", sizeStart);
-                    expectedSize = std::stoull(headerStr.substr(sizeStart, sizeEnd - sizeStart));
-                    
-                    // Parse the filename
-                    size_t filenameStart = headerStr.find("FILENAME:") + 9;
-                    partFilename = headerStr.substr(filenameStart, endOfHeader - filenameStart);
-                    
-                    // Any remaining data is part of the file content
-                    headerBuffer.erase(headerBuffer.begin(), headerBuffer.begin() + endOfHeader + 1);
-                }
-            }
-            
-            // Create part filename for this thread
-            std::string threadFilename = outputDir + "/" + fs::path(partFilename).filename().string() + 
-                                       ".part" + std::to_string(threadId);
-            
-            // Create output directory if it doesn't exist
-            {
-                std::lock_guard<std::mutex> lock(fileMutex);
-                if (!fs::exists(outputDir)) {
-                    fs::create_directories(outputDir);
-                }
-            }
-            
-            // Open output file for this thread's part
-            std::ofstream outputFile(threadFilename, std::ios::binary | std::ios::trunc);
-            if (!outputFile) {
-                closesocket(sockfd);
-                throw std::runtime_error("Cannot create output file: " + threadFilename);
-            }
-
-            // Write any data we already received
-            if (!headerBuffer.empty()) {
-                outputFile.write(headerBuffer.data(), headerBuffer.size());
-            }
-            
-            // Track total received
-            size_t totalReceived = headerBuffer.size();
-            
-            // Receive file data
-            bool transferComplete = false;
-            
-            while (!transferComplete && totalReceived < expectedSize) {
-                int bytesToReceive = std::min(sizeof(buffer), expectedSize - totalReceived);
-                int bytesReceived = recv(sockfd, buffer, bytesToReceive, 0);
-                
-                if (bytesReceived > 0) {
-                    outputFile.write(buffer, bytesReceived);
-                    totalReceived += bytesReceived;
-                    
-                    // Update progress
-                    int progress = static_cast<int>((totalReceived * 100) / expectedSize);
-                    std::cout << "\rThread " << threadId << ": " << progress << "%" << std::flush;
-                } 
-                else if (bytesReceived == 0) {
-                    // Normal closure
-                    transferComplete = true;
-                }
-                else {
-                    int error = WSAGetLastError();
-                    if (error == WSAETIMEDOUT) {
-                        std::cerr << "\nThread " << threadId << " timeout, retrying..." << std::endl;
-                        continue;
-                    }
-                    throw std::system_error(error, std::system_category(), "Transfer error");
-                }
-            }
-
-            // Verify complete transfer
-            if (totalReceived != expectedSize) {
-                outputFile.close();
-                closesocket(sockfd);
-                throw std::runtime_error("Incomplete transfer: received " + 
-                                       std::to_string(totalReceived) + " of " + 
-                                       std::to_string(expectedSize) + " bytes");
-            }
-
-            std::cout << "\nThread " << threadId << " completed. Received " 
-                      << totalReceived << "/" << expectedSize << " bytes\n";
-
-            // Cleanup
-            outputFile.close();
-            shutdown(sockfd, SD_SEND);
-            closesocket(sockfd);
-
-        } catch (const std::exception& e) {
-            std::cerr << "Thread " << threadId << " error: " << e.what() << std::endl;
-        }
-    }
-
-public:
-    DownloadClient(const std::string& ip, int threads, const std::string& file)
-        : ipAddress(ip), threadCount(threads), filename(file), outputDir("downloads") {}
-
-    void start() {
-        system("cls");
-        
-        std::vector<std::thread> threads;
-        threads.reserve(threadCount);
-
-        // Create threads with staggered startup
-        for (int i = 0; i < threadCount; ++i) {
-            threads.emplace_back(&DownloadClient::handleConnection, this, i);
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-
-        // Join threads
-        for (auto& t : threads) {
-            if (t.joinable()) {
-                t.join();
-            }
-        }
-        
-        // After all threads are done, merge the parts
-        mergeFiles();
-    }
-    
-    void mergeFiles() {
-        std::cout << "\nMerging file parts..." << std::endl;
-        
-        // Extract base filename from the path
-        std::string baseFilename = fs::path(filename).filename().string();
-        std::string outputFilePath = outputDir + "/" + baseFilename;
-        
-        try {
-            // Open output file
-            std::ofstream output(outputFilePath, std::ios::binary);
-            if (!output) {
-                throw std::runtime_error("Cannot create output file: " + outputFilePath);
-            }
-            
-            // Read and append each part
-            for (int i = 0; i < threadCount; ++i) {
-                std::string partFilename = outputDir + "/" + baseFilename + ".part" + std::to_string(i);
-                
-                if (!fs::exists(partFilename)) {
-                    throw std::runtime_error("Missing part file: " + partFilename);
-                }
-                
-                std::ifstream partFile(partFilename, std::ios::binary);
-                if (!partFile) {
-                    throw std::runtime_error("Cannot open part file: " + partFilename);
-                }
-                
-                output << partFile.rdbuf();
-                partFile.close();
-                
-                // Delete part file
-                fs::remove(partFilename);
-            }
-            
-            output.close();
-            std::cout << "File successfully downloaded and merged: " << outputFilePath << std::endl;
-            
-        } catch (const std::exception& e) {
-            std::cerr << "Error merging files: " << e.what() << std::endl;
-        }
-    }
-};
-
-int main(int argc, char* argv[]) {
-    // Initialize Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "WSAStartup failed: " << WSAGetLastError() << std::endl;
-        return 1;
-    }
-
-    if (argc < 4) {
-        std::cerr << "Usage: " << argv[0] << " <IP> <thread_count> <filename>" << std::endl;
-        WSACleanup();
-        return 1;
-    }
-
-    try {
-        DownloadClient client(argv[1], std::stoi(argv[2]), argv[3]);
-        client.start();
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        WSACleanup();
-        return 1;
-    }
-
-    WSACleanup();
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iomanip>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <unordered_map>
+#include <system_error>
+#include <chrono>
+#include <filesystem>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "net.h"
+#include "chunk_scheduler.h"
+#include "progress_journal.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include "compression.h"
+#include "io_uring.h"
+#include "transfer_stats.h"
+#include "stream_tuner.h"
+#include "delta.h"
+#include "buffer_pool.h"
+#include "part_merger.h"
+#include "phase_trace.h"
+
+namespace fs = std::filesystem;
+
+// A decoded response frame: header and metadata payload. Any data bytes
+// the header announces are still on the connection, to be read with
+// readData.
+struct Response {
+    protocol::FrameHeader header;
+    std::string payload;
+
+    // Bytes of file data the response stands for, once decompressed or
+    // rebuilt.
+    uint64_t dataLength() const {
+        if (!(header.flags & protocol::flagCompress) && header.op != protocol::Op::Delta) {
+            return header.length;
+        }
+        protocol::PayloadReader reader(payload);
+        return reader.getU64();
+    }
+};
+
+// An ERROR the server marked busy (flagBusy): the request waited too long
+// for a transfer slot and was not served. Retrying later may succeed.
+struct ServerBusy : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// A server that keeps the connection open but has sent nothing for
+// ServerConnection::maxTimeouts receive timeouts in a row.
+struct ServerStalled : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// A persistent connection to the server. Received bytes are buffered, so
+// bytes that arrive ahead of the current response (pipelined responses)
+// are kept for the next read instead of being lost. Requests are numbered
+// as they are sent and responses are checked to come back in that order.
+class ServerConnection {
+private:
+    socket_t sockfd;
+    std::string ip;
+    int port;
+    int threadId;
+    BufferPool::Buffer buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    uint32_t nextRequestId = 1;
+    uint32_t nextResponseId = 1;
+    std::vector<char> compressedBlock;
+    std::vector<char> rawBlock;
+
+    static constexpr int timeoutMs = 5000;
+    // Consecutive receive timeouts before the server counts as stalled.
+    // Longer than the server's default queue timeout (10 s), so a request
+    // waiting for a transfer slot gets its busy answer first
+    static constexpr int maxTimeouts = 3;
+
+    void fill() {
+        if (begin == end) {
+            begin = end = 0;
+        } else if (end == buffer.size()) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+
+        int timeouts = 0;
+        while (true) {
+            ssize_t bytesReceived = recv(sockfd, buffer.data() + end, buffer.size() - end, 0);
+            if (bytesReceived > 0) {
+                end += static_cast<size_t>(bytesReceived);
+                return;
+            }
+            if (bytesReceived == 0) {
+                throw std::runtime_error("Connection closed by server");
+            }
+            int error = net::lastError();
+            // io_uring completions pending on a ring thread interrupt its
+            // blocking calls; that is not a timeout
+            if (error == EINTR) {
+                continue;
+            }
+            if (net::wouldBlock(error)) {
+                if (++timeouts >= maxTimeouts) {
+                    throw ServerStalled("No data from " + server() + " for " +
+                                        std::to_string(maxTimeouts * timeoutMs / 1000) + " s");
+                }
+                std::cerr << "\nThread " << threadId << " timeout, retrying..." << std::endl;
+                continue;
+            }
+            throw std::system_error(error, std::system_category(), "Transfer error");
+        }
+    }
+
+public:
+    ServerConnection(const std::string& ip, int port, int threadId, BufferPool& buffers)
+        : sockfd(INVALID_SOCKET_FD), ip(ip), port(port), threadId(threadId), buffer(buffers.acquire()) {
+        // Connection with retries. A refused connect fails within one round
+        // trip, so the backoff is short: 50 ms, then 200 ms
+        int retries = 3;
+        std::chrono::milliseconds backoff(50);
+        while (true) {
+            try {
+                sockfd = net::connectTo(ip, port);
+                break;
+            } catch (const std::system_error& e) {
+                if (--retries == 0) {
+                    throw std::system_error(e.code(), "Connection failed after retries");
+                }
+            }
+            std::this_thread::sleep_for(backoff);
+            backoff *= 4;
+        }
+
+        net::setTimeouts(sockfd, timeoutMs);
+        // Pipelined requests are small frames that must not wait for ACKs
+        net::setNoDelay(sockfd);
+    }
+
+    ~ServerConnection() {
+        net::closeSocket(sockfd);
+    }
+
+    ServerConnection(const ServerConnection&) = delete;
+    ServerConnection& operator=(const ServerConnection&) = delete;
+
+    // Sends one request frame; returns the request id it was given.
+    uint32_t send(protocol::FrameHeader header, const std::string& payload = std::string()) {
+        header.requestId = nextRequestId++;
+        std::string frame = protocol::encodeFrame(header, payload);
+        try {
+            net::sendAll(sockfd, frame.data(), frame.size());
+        } catch (const std::system_error& e) {
+            throw std::system_error(e.code(), "Request failed");
+        }
+        return header.requestId;
+    }
+
+    // Reads the next response header and payload. ERROR frames are returned
+    // as-is so callers can treat a failed request as a per-request result.
+    Response readResponse() {
+        char headerBytes[protocol::headerSize];
+        readInto(headerBytes, protocol::headerSize);
+
+        Response response;
+        response.header = protocol::decodeHeader(headerBytes);
+        if (response.header.requestId != nextResponseId++) {
+            throw std::runtime_error("Response out of order");
+        }
+        response.payload.reserve(response.header.payloadLength);
+        readExact(response.header.payloadLength, [&](const char* data, size_t size) {
+            response.payload.append(data, size);
+        });
+        return response;
+    }
+
+    // readResponse for requests that must succeed.
+    Response expectResponse() {
+        Response response = readResponse();
+        if (response.header.op == protocol::Op::Error) {
+            if (response.header.flags & protocol::flagBusy) {
+                throw ServerBusy("Server busy: " + response.payload);
+            }
+            throw std::runtime_error("Server error: " + response.payload);
+        }
+        return response;
+    }
+
+    // Hands exactly length bytes to sink(data, size), in order.
+    template <typename Sink>
+    void readExact(uint64_t length, Sink&& sink) {
+        while (length > 0) {
+            if (begin == end) {
+                fill();
+            }
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(end - begin, length));
+            sink(buffer.data() + begin, chunk);
+            begin += chunk;
+            length -= chunk;
+        }
+    }
+
+    void readInto(char* out, size_t length) {
+        readExact(length, [&](const char* data, size_t size) {
+            std::memcpy(out, data, size);
+            out += size;
+        });
+    }
+
+    // Hands the data section of a response to sink(data, size) as file
+    // bytes, decompressing it block by block if the server compressed it.
+    template <typename Sink>
+    void readData(const Response& response, Sink&& sink) {
+        if (!(response.header.flags & protocol::flagCompress)) {
+            readExact(response.header.length, sink);
+            return;
+        }
+
+        uint64_t rawLeft = response.dataLength();
+        uint64_t wireLeft = response.header.length;
+        while (wireLeft > 0) {
+            char header[compression::blockHeaderSize];
+            if (wireLeft < sizeof(header)) {
+                throw std::runtime_error("Truncated compressed data");
+            }
+            readInto(header, sizeof(header));
+            size_t rawLength = 0;
+            size_t storedLength = 0;
+            compression::decodeBlockHeader(header, rawLength, storedLength);
+            wireLeft -= sizeof(header);
+            if (storedLength > wireLeft || rawLength > rawLeft) {
+                throw std::runtime_error("Compressed data overruns the response");
+            }
+
+            if (storedLength == rawLength) {
+                readExact(storedLength, sink);
+            } else {
+                compressedBlock.resize(storedLength);
+                rawBlock.resize(rawLength);
+                readInto(compressedBlock.data(), storedLength);
+                lz4::decompress(compressedBlock.data(), storedLength, rawBlock.data(), rawLength);
+                sink(rawBlock.data(), rawLength);
+            }
+            wireLeft -= storedLength;
+            rawLeft -= rawLength;
+        }
+        if (rawLeft != 0) {
+            throw std::runtime_error("Compressed data is shorter than announced");
+        }
+    }
+
+    socket_t socket() const {
+        return sockfd;
+    }
+
+    // Received bytes not yet consumed by a read.
+    size_t buffered() const {
+        return end - begin;
+    }
+
+    // Tells the server no more requests are coming.
+    void finish() {
+        shutdown(sockfd, SHUT_WR);
+    }
+
+    // "host:port" of the server, the key of the connection pool.
+    std::string server() const {
+        return ip + ":" + std::to_string(port);
+    }
+
+    // Hands the connection to another stream (used in messages).
+    void setThreadId(int id) {
+        threadId = id;
+    }
+
+    // Marks every request sent so far as answered, for responses that were
+    // read off the socket without readResponse (the io_uring path).
+    void catchUp() {
+        nextResponseId = nextRequestId;
+    }
+
+    // Every request has been answered and nothing more is buffered, so the
+    // next user starts on a clean stream.
+    bool settled() const {
+        return nextResponseId == nextRequestId && begin == end;
+    }
+
+    // Whether the server has closed (or reset) a connection that should be
+    // idle. Data arriving unasked counts as closed too: it cannot be used.
+    bool closedByPeer() const {
+        char probe;
+        ssize_t result = recv(sockfd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        return result >= 0 || !net::wouldBlock(net::lastError());
+    }
+};
+
+// Idle connections kept open for reuse, keyed by server. A small download
+// is mostly round trips, and a connect is one of them: the STAT connection
+// carries a stream's requests afterwards, and a finished stream's connection
+// carries the closing DIGEST. Only settled connections are taken back, and
+// one that has sat longer than maxIdle (kept below the server's keep-alive
+// timeout) or was closed by the server is dropped instead of handed out.
+class ConnectionPool {
+private:
+    struct Idle {
+        std::unique_ptr<ServerConnection> connection;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    static constexpr size_t maxPerServer = 4;
+    static constexpr std::chrono::seconds maxIdle{10};
+
+    std::mutex poolMutex;
+    std::unordered_map<std::string, std::vector<Idle>> idle;
+
+public:
+    // An idle connection to ip:port for threadId, or null if there is none.
+    std::unique_ptr<ServerConnection> take(const std::string& ip, int port, int threadId) {
+        std::string key = ip + ":" + std::to_string(port);
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(poolMutex);
+        auto it = idle.find(key);
+        if (it == idle.end()) {
+            return nullptr;
+        }
+        while (!it->second.empty()) {
+            Idle entry = std::move(it->second.back());
+            it->second.pop_back();
+            if (now - entry.since < maxIdle && !entry.connection->closedByPeer()) {
+                entry.connection->setThreadId(threadId);
+                return std::move(entry.connection);
+            }
+        }
+        return nullptr;
+    }
+
+    // Keeps a connection for reuse. Unsettled connections, and those past
+    // maxPerServer for their server, are closed.
+    void put(std::unique_ptr<ServerConnection> connection) {
+        if (!connection || !connection->settled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(poolMutex);
+        std::vector<Idle>& entries = idle[connection->server()];
+        if (entries.size() >= maxPerServer) {
+            connection->finish();
+            return;
+        }
+        entries.push_back(Idle{std::move(connection), std::chrono::steady_clock::now()});
+    }
+};
+
+class DownloadClient {
+public:
+    // Direct preallocates the final file and writes every range in place
+    // with pwrite; Parts keeps the .partN files and merges them at the end.
+    enum class WriteMode {
+        Direct,
+        Parts
+    };
+
+private:
+    // Where received bytes for the current request go: the range's part
+    // file, or the shared output file at the request's offset. With
+    // O_DIRECT (directFd set) the bytes are staged in an aligned buffer at
+    // the same offset within a block as in the file, so whole blocks can be
+    // written through directFd; the partial blocks at the edges of a
+    // request go through fd. flush() must be called at the end of every
+    // request.
+    struct RangeTarget {
+        std::ofstream* partFile = nullptr;
+        int fd = -1;
+        int directFd = -1;
+        uint64_t offset = 0;      // File offset of the next byte to write or stage
+        char* staging = nullptr;
+        size_t stagingSize = 0;
+        size_t staged = 0;        // Bytes staged, ending at offset
+
+        static void writeAt(int fd, const char* data, size_t length, uint64_t offset) {
+            while (length > 0) {
+                ssize_t written = pwrite(fd, data, length, static_cast<off_t>(offset));
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "Write failed");
+                }
+                data += written;
+                length -= static_cast<size_t>(written);
+                offset += static_cast<uint64_t>(written);
+            }
+        }
+
+        void write(const char* data, size_t length) {
+            if (partFile != nullptr) {
+                partFile->write(data, length);
+                if (!*partFile) {
+                    throw std::runtime_error("Write failed");
+                }
+                return;
+            }
+            if (directFd < 0) {
+                writeAt(fd, data, length, offset);
+                offset += length;
+                return;
+            }
+            while (length > 0) {
+                size_t end = (offset - staged) % BufferPool::alignment + staged;
+                size_t chunk = std::min(stagingSize - end, length);
+                std::memcpy(staging + end, data, chunk);
+                staged += chunk;
+                offset += chunk;
+                data += chunk;
+                length -= chunk;
+                if (end + chunk == stagingSize) {
+                    flush();
+                }
+            }
+        }
+
+        void flush() {
+            if (staged == 0) {
+                return;
+            }
+            uint64_t base = offset - staged;
+            size_t lead = base % BufferPool::alignment;
+            size_t end = lead + staged;
+            size_t bodyStart = lead > 0 ? std::min(end, BufferPool::alignment) : 0;
+            size_t bodyEnd = std::max(bodyStart, BufferPool::roundDown(end));
+            base -= lead;
+            writeAt(fd, staging + lead, bodyStart - lead, base + lead);
+            writeAt(directFd, staging + bodyStart, bodyEnd - bodyStart, base + bodyStart);
+            writeAt(fd, staging + bodyEnd, end - bodyEnd, base + bodyEnd);
+            staged = 0;
+        }
+    };
+
+    static constexpr uint64_t rangeSize = 8 * 1024 * 1024;   // Unit of work in the shared queue
+    static constexpr uint64_t minRequestSize = 4 * 1024;             // Bounds for --request-size
+    static constexpr uint64_t maxRequestSize = 16 * 1024 * 1024;
+    static constexpr uint32_t fileId = 1;                     // Handle of the file on every connection
+    static constexpr uint64_t minStealSize = 256 * 1024;     // Smallest tail worth stealing
+
+    // A server holding the file. With several, the streams are spread over
+    // them and a stream moves on to the next one after a failure.
+    struct Source {
+        std::string host;
+        int port = 8000;
+        std::string version;             // The file's version on this server
+        std::atomic<bool> down{false};   // Unreachable, or holds other contents
+        std::atomic<uint64_t> bytes{0};  // Received from this server
+
+        std::string name() const {
+            return host + ":" + std::to_string(port);
+        }
+    };
+
+    std::deque<Source> sources;  // The first one that answers is the reference
+    std::string filename;
+    int threadCount;
+    std::string outputDir;
+    std::string baseFilename;
+    WriteMode writeMode;
+    bool verify;                               // CRC32C per chunk and for the whole file
+    bool compress;                             // Let the server compress READ data
+    bool useUring;                             // Direct mode through io_uring rings
+    uint64_t requestSize;                      // Bytes asked for per READ request
+    uint64_t fileSize = 0;
+    std::string fileVersion;                   // Server-side version reported by STAT
+    std::atomic<bool> versionMismatch{false};  // Set when a range came from a different version
+    std::unique_ptr<ChunkScheduler> scheduler;
+    int outputFd = -1;                         // Final file
+    bool directIo;                             // Write Direct mode output with O_DIRECT
+    int directFd = -1;                         // outputFd reopened with O_DIRECT
+    BufferPool buffers;                        // Receive, staging and merge buffers
+    ConnectionPool connections;                // Idle connections, reused across phases
+    std::unique_ptr<ProgressJournal> journal;  // Durable ranges of outputFd
+    std::unique_ptr<PartMerger> merger;        // Places finished parts in outputFd
+    StatsReporter::Options reportOptions;
+    std::unique_ptr<TransferStats> stats;      // One counter block per connection
+    PhaseTimer phases;                         // Stream n is track n; then main, merge
+    bool autoStreams;                          // Tune the stream count; threadCount is the bound
+    std::atomic<int> streamTarget{0};          // Streams below this index fetch
+    std::atomic<int> workingStreams{0};        // Streams currently between waits
+    std::atomic<bool> drained{false};          // Idle streams should exit
+    std::mutex streamMutex;
+    std::condition_variable streamChanged;     // streamTarget or drained changed
+    bool deltaMode;                            // Fetch changes against an earlier copy
+    bool checkMirrors;                         // Compare mirrors' digests before downloading
+    int basisFd = -1;                          // The earlier copy, if there is one
+    uint64_t basisSize = 0;
+    uint32_t basisBlockSize = 0;
+    std::string basisSignature;                // SIGNATURE payload sent on every connection
+    std::atomic<uint64_t> copiedBytes{0};      // Rebuilt from the basis
+    std::atomic<uint64_t> literalBytes{0};     // Rebuilt from literal data
+
+    // Trace tracks after the streams' for work outside them
+    uint64_t mainTrack() const {
+        return static_cast<uint64_t>(threadCount);
+    }
+
+    uint64_t mergeTrack() const {
+        return static_cast<uint64_t>(threadCount) + 1;
+    }
+
+    std::string partFilename(int rangeId) const {
+        return outputDir + "/" + baseFilename + ".part" + std::to_string(rangeId);
+    }
+
+    // Asks the servers for the file size and version before splitting, in
+    // parallel: the first that answers is the reference, and a server whose
+    // size differs from it, or that cannot be reached, is left out. Versions
+    // are per server (they include the inode and mtime), so they cannot be
+    // compared across servers. With checkMirrors, several servers are asked
+    // for their whole-file digests instead and must agree on the contents
+    // too; that makes every server read the whole file before any data
+    // moves, so by default a mirror with other contents of the same size is
+    // only caught by the final digest check.
+    void fetchFileInfo() {
+        bool digests = checkMirrors && sources.size() > 1;
+        std::vector<Response> answers(sources.size());
+        std::vector<std::string> errors(sources.size());
+        auto ask = [&](size_t i) {
+            std::unique_ptr<ServerConnection> connection = acquireConnection(sources[i], 0);
+            protocol::FrameHeader request;
+            request.op = digests ? protocol::Op::Digest : protocol::Op::Stat;
+            connection->send(request, filename);
+            answers[i] = connection->expectResponse();
+            connections.put(std::move(connection));
+        };
+        if (sources.size() == 1) {
+            ask(0);
+        } else {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                threads.emplace_back([&, i] {
+                    try {
+                        ask(i);
+                    } catch (const std::exception& e) {
+                        errors[i] = e.what();
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+
+        const Response* reference = nullptr;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            Source& source = sources[i];
+            if (!errors[i].empty()) {
+                source.down = true;
+                std::cerr << "Skipping " << source.name() << ": " << errors[i] << std::endl;
+                continue;
+            }
+            const Response& answer = answers[i];
+            if (!reference) {
+                reference = &answer;
+                fileSize = answer.header.length;
+                fileVersion = answer.payload;
+            } else if (answer.header.length != fileSize ||
+                       (digests && answer.header.checksum != reference->header.checksum)) {
+                source.down = true;
+                std::cerr << "Skipping " << source.name() << ": its copy of " << filename
+                          << " differs (" << answer.header.length << " bytes)" << std::endl;
+                continue;
+            }
+            source.version = answer.payload;
+        }
+        if (!reference) {
+            throw std::runtime_error("No server could provide " + filename);
+        }
+    }
+
+    // A connection to source for stream threadId: an idle one from the
+    // pool if there is one, or a new one.
+    std::unique_ptr<ServerConnection> acquireConnection(Source& source, int threadId) {
+        std::unique_ptr<ServerConnection> connection = connections.take(source.host, source.port, threadId);
+        if (!connection) {
+            connection = std::make_unique<ServerConnection>(source.host, source.port, threadId, buffers);
+        }
+        return connection;
+    }
+
+    // Opens the file on a connection to source. The handle pins the
+    // version the server has now, so it only has to be compared once per
+    // connection. A server whose file changed is not used again. The file
+    // id is the client's choice, so requests for it can be pipelined right
+    // behind the OPEN; confirmOpen reads its answers.
+    void requestOpen(ServerConnection& connection) {
+        protocol::FrameHeader request;
+        request.op = protocol::Op::Open;
+        request.fileId = fileId;
+        connection.send(request, filename);
+        if (basisFd >= 0) {
+            request.op = protocol::Op::Signature;
+            connection.send(request, basisSignature);
+        }
+    }
+
+    void confirmOpen(ServerConnection& connection, Source& source) {
+        Response response = connection.expectResponse();
+        if (response.payload != source.version || response.header.length != fileSize) {
+            source.down = true;
+            if (!anySourceUp()) {
+                versionMismatch = true;
+            }
+            throw std::runtime_error("File changed on " + source.name() + " during download (version " +
+                                     response.payload + ", expected " + source.version + ")");
+        }
+        if (basisFd >= 0) {
+            connection.expectResponse();
+        }
+    }
+
+    // A source that accepted the connection and then went silent is not
+    // used again while there are others; its ranges go to them.
+    void dropStalled(Source* source) {
+        if (source && sources.size() > 1 && !source->down.exchange(true)) {
+            std::cerr << source->name() << " stopped sending, trying the next server" << std::endl;
+        }
+    }
+
+    bool anySourceUp() const {
+        for (const Source& source : sources) {
+            if (!source.down) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Connects stream threadId and opens the file. Streams start on
+    // sources threadId % n, so they are spread evenly; after each failure
+    // the stream moves one source along, skipping those that are down.
+    // With several sources, one that cannot be reached is marked down and
+    // the next is tried. Unless confirm is set, the OPEN is only sent and
+    // the caller must confirmOpen before it reads any other answer.
+    std::unique_ptr<ServerConnection> connectStream(int threadId, int failures, Source*& source,
+                                                    bool confirm = true) {
+        for (size_t k = 0; k < sources.size(); ++k) {
+            Source& candidate = sources[(static_cast<size_t>(threadId + failures) + k) % sources.size()];
+            if (candidate.down) {
+                continue;
+            }
+            std::unique_ptr<ServerConnection> connection;
+            auto begin = phases.now();
+            try {
+                connection = acquireConnection(candidate, threadId);
+                phases.record(Phase::Connect, threadId, begin);
+            } catch (const std::system_error& e) {
+                if (sources.size() == 1) {
+                    throw;
+                }
+                candidate.down = true;
+                std::cerr << "Thread " << threadId << ": " << candidate.name() << " is down (" << e.what()
+                          << "), trying the next server" << std::endl;
+                continue;
+            }
+            source = &candidate;
+            begin = phases.now();
+            requestOpen(*connection);
+            if (confirm) {
+                confirmOpen(*connection, candidate);
+                phases.record(Phase::Open, threadId, begin);
+            }
+            return connection;
+        }
+        throw std::runtime_error("No server left for " + filename);
+    }
+
+    std::string basisPath() const {
+        return outputDir + "/" + baseFilename + ".basis";
+    }
+
+    void readBasis(char* out, uint64_t offset, size_t length) {
+        while (length > 0) {
+            ssize_t bytesRead = pread(basisFd, out, length, static_cast<off_t>(offset));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "Cannot read " + basisPath());
+            }
+            if (bytesRead == 0) {
+                throw std::runtime_error(basisPath() + " changed during the download");
+            }
+            out += bytesRead;
+            offset += static_cast<uint64_t>(bytesRead);
+            length -= static_cast<size_t>(bytesRead);
+        }
+    }
+
+    // Signs every whole block of the basis, with the blocks split into
+    // contiguous slices over the cores.
+    void signBasis() {
+        uint64_t blocks = basisSize / basisBlockSize;
+        std::vector<delta::BlockSignature> signatures(static_cast<size_t>(blocks));
+        uint64_t slices = std::max<uint64_t>(1, std::min<uint64_t>(blocks, std::thread::hardware_concurrency()));
+        uint64_t sliceBlocks = (blocks + slices - 1) / slices;
+        std::vector<std::exception_ptr> errors(slices);
+
+        std::vector<std::thread> threads;
+        for (uint64_t i = 0; i < slices; ++i) {
+            threads.emplace_back([&, i] {
+                try {
+                    // Read several blocks at a time, about 4 MB
+                    uint64_t perRead = std::max<uint64_t>(1, 4 * 1024 * 1024 / basisBlockSize);
+                    std::vector<char> buffer(perRead * basisBlockSize);
+                    uint64_t last = std::min(blocks, (i + 1) * sliceBlocks);
+                    for (uint64_t block = i * sliceBlocks; block < last; block += perRead) {
+                        uint64_t count = std::min(perRead, last - block);
+                        readBasis(buffer.data(), block * basisBlockSize, count * basisBlockSize);
+                        for (uint64_t j = 0; j < count; ++j) {
+                            signatures[block + j] =
+                                delta::signBlock(buffer.data() + j * basisBlockSize, basisBlockSize);
+                        }
+                    }
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (const std::exception_ptr& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        basisSignature = delta::encodeSignature(basisBlockSize, signatures);
+    }
+
+    // Delta mode: moves a complete earlier copy of the file aside as the
+    // basis and signs it. The basis is kept until the new file is complete
+    // and verified, so an interrupted delta download, or one whose digest
+    // did not match, is retried against the same basis.
+    void prepareBasis() {
+        std::string outputFilePath = outputDir + "/" + baseFilename;
+        std::error_code ec;
+        if (!fs::exists(basisPath(), ec) && !fs::exists(outputFilePath + ".progress", ec) &&
+            fs::is_regular_file(outputFilePath, ec)) {
+            fs::rename(outputFilePath, basisPath());
+        }
+
+        basisFd = open(basisPath().c_str(), O_RDONLY | O_CLOEXEC);
+        if (basisFd < 0) {
+            std::cout << "No earlier copy of " << filename << " in " << outputDir << "; fetching it in full"
+                      << std::endl;
+            return;
+        }
+        struct stat st;
+        if (fstat(basisFd, &st) != 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot stat " + basisPath());
+        }
+        basisSize = static_cast<uint64_t>(st.st_size);
+        basisBlockSize = delta::blockSizeFor(basisSize);
+
+        auto started = std::chrono::steady_clock::now();
+        signBasis();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "Signed " << basisSize / basisBlockSize << " blocks of " << basisBlockSize << " bytes in "
+                  << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+    }
+
+    // Once the new file is complete the basis is no longer needed.
+    void removeBasis() {
+        if (basisFd < 0) {
+            return;
+        }
+        close(basisFd);
+        basisFd = -1;
+        fs::remove(basisPath());
+        std::cout << std::fixed << std::setprecision(1) << "Delta: " << copiedBytes / 1048576.0
+                  << " MB reused from the earlier copy, " << literalBytes / 1048576.0 << " MB fetched" << std::endl;
+    }
+
+    // Fetches [offset, offset + length) as DELTA instructions against the
+    // basis. Returns false, with the target rewound, when the rebuilt bytes
+    // do not match the server's checksum; the caller then reads the range
+    // in full.
+    bool fetchDelta(ServerConnection& connection, RangeTarget& target, int threadId, uint64_t offset,
+                    uint64_t length) {
+        protocol::FrameHeader request;
+        request.op = protocol::Op::Delta;
+        request.fileId = fileId;
+        request.offset = offset;
+        request.length = length;
+        request.flags = protocol::flagChecksum;
+        auto begin = phases.now();
+        connection.send(request);
+
+        Response response = connection.expectResponse();
+        phases.record(Phase::Request, threadId, begin);
+        begin = phases.now();
+        if (response.header.offset != offset || response.dataLength() != length) {
+            throw std::runtime_error("Server returned a delta of " + std::to_string(response.dataLength()) +
+                                     " bytes for a " + std::to_string(length) + " byte range");
+        }
+
+        RangeTarget start = target;
+        std::streampos partPosition = target.partFile ? target.partFile->tellp() : std::streampos(0);
+        uint32_t crc = 0;
+        uint64_t rebuilt = 0;
+        uint64_t copied = 0;
+        auto emit = [&](const char* data, size_t size) {
+            if (size > length - rebuilt) {
+                throw std::runtime_error("Delta overruns its range");
+            }
+            crc = crc32c::extend(crc, data, size);
+            target.write(data, size);
+            rebuilt += size;
+        };
+
+        std::vector<char> block;
+        uint64_t left = response.header.length;
+        while (left > 0) {
+            char instruction[9];
+            if (left < sizeof(instruction) - 4) {
+                throw std::runtime_error("Truncated delta");
+            }
+            connection.readInto(instruction, 5);
+            uint32_t valueBE;
+            std::memcpy(&valueBE, instruction + 1, 4);
+            uint32_t value = be32toh(valueBE);
+            left -= 5;
+
+            if (instruction[0] == delta::opLiteral) {
+                if (value > left) {
+                    throw std::runtime_error("Truncated delta");
+                }
+                connection.readExact(value, emit);
+                left -= value;
+            } else if (instruction[0] == delta::opCopy && left >= 4) {
+                connection.readInto(instruction + 5, 4);
+                std::memcpy(&valueBE, instruction + 5, 4);
+                uint64_t count = be32toh(valueBE);
+                left -= 4;
+                if (value + count > basisSize / basisBlockSize) {
+                    throw std::runtime_error("Delta copies past the end of the earlier copy");
+                }
+                block.resize(basisBlockSize);
+                for (uint64_t i = 0; i < count; ++i) {
+                    readBasis(block.data(), (value + i) * basisBlockSize, basisBlockSize);
+                    emit(block.data(), basisBlockSize);
+                }
+                copied += count * basisBlockSize;
+            } else {
+                throw std::runtime_error("Corrupt delta instruction");
+            }
+        }
+
+        if (rebuilt != length || !(response.header.flags & protocol::flagChecksum) ||
+            crc != response.header.checksum) {
+            target = start;
+            if (target.partFile) {
+                target.partFile->seekp(partPosition);
+            }
+            std::cerr << "Delta at offset " << offset << " did not rebuild; reading it in full" << std::endl;
+            return false;
+        }
+        phases.record(Phase::Receive, threadId, begin, length);
+        stats->stream(threadId).addBytes(length);
+        copiedBytes += copied;
+        literalBytes += length - copied;
+        return true;
+    }
+
+    // A READ sent on the blocking path whose answer has not been read yet.
+    struct PendingRead {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        PhaseTimer::Clock::time_point sentAt;
+    };
+
+    // READs the blocking path keeps in flight per connection. With two, the
+    // server already has the next request when it finishes a response, so
+    // the round trip between them is hidden.
+    static constexpr size_t pipelineDepth = 2;
+
+    PendingRead sendRead(ServerConnection& connection, uint64_t offset, uint64_t length) {
+        protocol::FrameHeader request;
+        request.op = protocol::Op::Read;
+        request.fileId = fileId;
+        request.offset = offset;
+        request.length = length;
+        request.flags = (verify ? protocol::flagChecksum : 0) | (compress ? protocol::flagCompress : 0);
+        PendingRead read{offset, length, phases.now()};
+        connection.send(request);
+        return read;
+    }
+
+    // Fetches one sub-request [offset, offset + length) into target over an
+    // already open connection.
+    void fetchRange(ServerConnection& connection, RangeTarget& target, int threadId, uint64_t offset,
+                    uint64_t length) {
+        if (basisFd >= 0 && fetchDelta(connection, target, threadId, offset, length)) {
+            return;
+        }
+        receiveRead(connection, target, threadId, sendRead(connection, offset, length));
+    }
+
+    // Reads the answer to read, the oldest READ in flight, into target.
+    void receiveRead(ServerConnection& connection, RangeTarget& target, int threadId, const PendingRead& read) {
+        uint64_t offset = read.offset;
+        uint64_t length = read.length;
+        Response response = connection.expectResponse();
+        phases.record(Phase::Request, threadId, read.sentAt);
+        if (response.header.offset != offset || response.dataLength() != length) {
+            throw std::runtime_error("Server returned " + std::to_string(response.dataLength()) +
+                                     " bytes for a " + std::to_string(length) + " byte range");
+        }
+
+        auto begin = phases.now();
+        StreamCounters& counters = stats->stream(threadId);
+        uint32_t crc = 0;
+        connection.readData(response, [&](const char* data, size_t size) {
+            if (verify) {
+                crc = crc32c::extend(crc, data, size);
+            }
+            auto writeBegin = phases.now();
+            target.write(data, size);
+            phases.record(Phase::Write, threadId, writeBegin, size);
+            counters.addBytes(size);
+        });
+        phases.record(Phase::Receive, threadId, begin, length);
+
+        // The range is not marked received, so a mismatch refetches it
+        if (verify && (!(response.header.flags & protocol::flagChecksum) || crc != response.header.checksum)) {
+            throw std::runtime_error("Checksum mismatch for " + std::to_string(length) +
+                                     " bytes at offset " + std::to_string(offset));
+        }
+    }
+
+    // Makes the written part of a range durable and journals it.
+    void recordDurable(int rangeId) {
+        if (writeMode != WriteMode::Direct) {
+            return;
+        }
+        ChunkScheduler::Range range = scheduler->range(rangeId);
+        if (range.received > range.offset) {
+            fdatasync(outputFd);
+            journal->record(range.offset, range.received);
+        }
+    }
+
+    // Parts mode: hands the finished (or abandoned) range's part to the
+    // merge stage, which places the bytes it received at its offset.
+    void mergePart(int rangeId) {
+        if (writeMode != WriteMode::Parts) {
+            return;
+        }
+        ChunkScheduler::Range range = scheduler->range(rangeId);
+        merger->submit(partFilename(rangeId), range.offset, range.received - range.offset);
+    }
+
+    // CRC32C of the assembled file, computed by threadCount threads over
+    // contiguous slices and joined with crc32c::combine.
+    uint32_t localDigest(int fd) {
+        size_t slices = static_cast<size_t>(std::max(1, threadCount));
+        uint64_t sliceSize = std::max<uint64_t>(1, (fileSize + slices - 1) / slices);
+        std::vector<uint32_t> crcs(slices);
+        std::vector<uint64_t> lengths(slices);
+        std::vector<std::exception_ptr> errors(slices);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < slices; ++i) {
+            uint64_t offset = std::min(fileSize, i * sliceSize);
+            lengths[i] = std::min(sliceSize, fileSize - offset);
+            threads.emplace_back([&, i, offset] {
+                try {
+                    crcs[i] = crc32c::ofFile(fd, offset, lengths[i]);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        uint32_t crc = 0;
+        for (size_t i = 0; i < slices; ++i) {
+            if (errors[i]) {
+                std::rethrow_exception(errors[i]);
+            }
+            crc = crc32c::combine(crc, crcs[i], lengths[i]);
+        }
+        return crc;
+    }
+
+    // Compares crc, the CRC32C of the assembled file, with the whole-file
+    // digest of the first server still up.
+    void verifyDigest(const std::string& path, uint32_t crc) {
+        Source* source = &sources.front();
+        for (Source& candidate : sources) {
+            if (!candidate.down) {
+                source = &candidate;
+                break;
+            }
+        }
+        std::unique_ptr<ServerConnection> connection = acquireConnection(*source, 0);
+        protocol::FrameHeader request;
+        request.op = protocol::Op::Digest;
+        connection->send(request, filename);
+        Response response = connection->expectResponse();
+        connections.put(std::move(connection));
+        if (response.payload != source->version) {
+            throw std::runtime_error(filename + " changed on " + source->name() + "; cannot verify " + path);
+        }
+
+        char hex[9];
+        std::snprintf(hex, sizeof(hex), "%08x", crc);
+        if (crc != response.header.checksum) {
+            std::string hint = sources.size() > 1 && !checkMirrors
+                                   ? "; a mirror may hold other contents, --check-mirrors compares them first"
+                                   : "";
+            throw std::runtime_error("Digest mismatch for " + path + " (CRC32C " + hex + ")" + hint);
+        }
+        std::cout << "Verified " << path << " (CRC32C " << hex << ")" << std::endl;
+    }
+
+    // Stream count control. Streams with an index below streamTarget fetch;
+    // the rest wait idle. In auto mode the tuner moves the target, and a
+    // stream above it stops at the next request boundary: the rest of its
+    // range goes back to the queue and its connection is closed.
+    bool streamWanted(int threadId) const {
+        return threadId < streamTarget.load(std::memory_order_relaxed);
+    }
+
+    // Set once a stream finds nothing left to claim, or the last working
+    // stream has given up; idle streams then exit instead of waiting.
+    void markDrained() {
+        {
+            std::lock_guard<std::mutex> lock(streamMutex);
+            drained = true;
+        }
+        streamChanged.notify_all();
+    }
+
+    // Blocks while the stream is idle. Returns false once drained.
+    bool waitForTurn(int threadId) {
+        std::unique_lock<std::mutex> lock(streamMutex);
+        streamChanged.wait(lock, [&] { return drained || streamWanted(threadId); });
+        return !drained;
+    }
+
+    // Called when a stream gives up after repeated failures. Nobody would
+    // pick up the remaining ranges if it was the last one working.
+    void streamGaveUp() {
+        if (workingStreams.load() == 0) {
+            markDrained();
+        }
+    }
+
+    // Claims ranges from the scheduler over one persistent connection until
+    // there is nothing left to fetch or steal, or the stream is retired. The
+    // connection is opened on the first claim, to the source connectStream
+    // picks after this stream's earlier failures; rangeId holds the range
+    // in progress and source the server, so the caller can requeue the
+    // range if the connection fails. READs are pipelined pipelineDepth deep
+    // (DELTAs go one at a time, as a failed one is retried as a READ), and
+    // the first ones go out right behind the OPEN.
+    void fetchRanges(std::unique_ptr<ServerConnection>& connection, Source*& source, int threadId, int failures,
+                     int& rangeId, uint64_t& connectionBytes, int& rangesFetched) {
+        BufferPool::Buffer staging;  // O_DIRECT staging for this stream
+        bool openPending = false;
+        PhaseTimer::Clock::time_point openedAt;
+        size_t depth = basisFd >= 0 ? 1 : pipelineDepth;
+        while (streamWanted(threadId)) {
+            if (!scheduler->claim(rangeId)) {
+                markDrained();
+                return;
+            }
+            if (!connection) {
+                connection = connectStream(threadId, failures, source, basisFd >= 0);
+                openPending = basisFd < 0;
+                openedAt = phases.now();
+            }
+
+            // Open output file for this range's part
+            RangeTarget target;
+            std::ofstream outputFile;
+            if (writeMode == WriteMode::Parts) {
+                std::string threadFilename = partFilename(rangeId);
+                outputFile.open(threadFilename, std::ios::binary | std::ios::trunc);
+                if (!outputFile) {
+                    throw std::runtime_error("Cannot create output file: " + threadFilename);
+                }
+                target.partFile = &outputFile;
+            } else {
+                target.fd = outputFd;
+                if (directFd >= 0) {
+                    if (staging.empty()) {
+                        staging = buffers.acquire();
+                    }
+                    target.directFd = directFd;
+                    target.staging = staging.data();
+                    target.stagingSize = staging.size();
+                }
+            }
+
+            std::deque<PendingRead> reads;
+            bool retired = false;
+            bool requesting = true;
+            while (true) {
+                while (requesting && reads.size() < depth) {
+                    PendingRead read;
+                    if ((retired = !streamWanted(threadId)) ||
+                        (read.length = scheduler->nextRequest(rangeId, requestSize, read.offset)) == 0) {
+                        requesting = false;
+                    } else if (basisFd >= 0) {
+                        reads.push_back(read);  // Sent by fetchRange
+                    } else {
+                        reads.push_back(sendRead(*connection, read.offset, read.length));
+                    }
+                }
+                if (reads.empty()) {
+                    break;
+                }
+                if (openPending) {
+                    confirmOpen(*connection, *source);
+                    phases.record(Phase::Open, threadId, openedAt);
+                    openPending = false;
+                }
+
+                PendingRead read = reads.front();
+                reads.pop_front();
+                uint64_t length = read.length;
+                target.offset = read.offset;
+                if (basisFd >= 0) {
+                    fetchRange(*connection, target, threadId, read.offset, length);
+                } else {
+                    receiveRead(*connection, target, threadId, read);
+                }
+                auto flushBegin = phases.now();
+                target.flush();
+                if (target.directFd >= 0) {
+                    phases.record(Phase::Write, threadId, flushBegin, length);
+                }
+                scheduler->markReceived(rangeId, length);
+                stats->stream(threadId).addChunk();
+                connectionBytes += length;
+                source->bytes += length;
+            }
+
+            outputFile.close();
+            recordDurable(rangeId);
+            if (retired) {
+                scheduler->abandon(rangeId);
+            } else {
+                scheduler->complete(rangeId);
+                rangesFetched++;
+            }
+            mergePart(rangeId);
+            rangeId = -1;
+        }
+    }
+
+    static constexpr int maxReconnects = 2;
+    // A busy server has already kept the request queued for its queue
+    // timeout, so busy answers are retried right away and counted apart
+    static constexpr int maxBusyRetries = 5;
+    static constexpr int initialAutoStreams = 2;
+    static constexpr std::chrono::milliseconds tuneInterval{500};
+
+    // Auto mode: measures the aggregate goodput every tuneInterval and lets
+    // a StreamTuner move streamTarget between 1 and threadCount.
+    void tuneStreams() {
+        StreamTuner tuner(streamTarget, threadCount);
+        uint64_t lastBytes = stats->totalBytes();
+        auto lastSample = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(streamMutex);
+        while (!streamChanged.wait_for(lock, tuneInterval, [this] { return drained.load(); })) {
+            auto now = std::chrono::steady_clock::now();
+            uint64_t bytes = stats->totalBytes();
+            double rate = (bytes - lastBytes) / std::chrono::duration<double>(now - lastSample).count();
+            lastBytes = bytes;
+            lastSample = now;
+
+            int before = tuner.streams();
+            int after = tuner.update(rate);
+            if (after != before) {
+                streamTarget = after;
+                streamChanged.notify_all();
+                if (reportOptions.console) {
+                    std::cout << "Streams " << before << " -> " << after << " at " << std::fixed
+                              << std::setprecision(1) << rate / 1048576.0 << " MB/s ("
+                              << rate / before / 1048576.0 << " MB/s per stream)" << std::endl;
+                }
+            }
+        }
+    }
+
+    // One stream. After a failure the unfinished part of the range is
+    // requeued and the thread reconnects, up to maxReconnects times (and
+    // maxBusyRetries times more for busy answers).
+    void handleConnection(int threadId) {
+        uint64_t connectionBytes = 0;
+        int rangesFetched = 0;
+        StreamCounters& counters = stats->stream(threadId);
+
+        int attempt = 0;
+        int busyRetries = 0;
+        // After a failure the stream goes on even if the others have drained
+        // meanwhile: nobody else would pick up the range it requeued
+        bool requeued = false;
+        while ((requeued && streamWanted(threadId)) || waitForTurn(threadId)) {
+            requeued = false;
+            std::unique_ptr<ServerConnection> connection;
+            Source* source = nullptr;
+            int rangeId = -1;
+            counters.active = true;
+            workingStreams++;
+            try {
+                fetchRanges(connection, source, threadId, attempt + busyRetries, rangeId, connectionBytes,
+                            rangesFetched);
+
+                // Keep the connection for later requests (the digest
+                // check, or this stream once it is wanted again)
+                connections.put(std::move(connection));
+                workingStreams--;
+                counters.active = false;
+            } catch (const std::exception& e) {
+                if (rangeId >= 0) {
+                    recordDurable(rangeId);
+                    scheduler->abandon(rangeId);
+                    mergePart(rangeId);
+                    requeued = true;
+                }
+                workingStreams--;
+                counters.active = false;
+                counters.addRetry();
+                std::cerr << "Thread " << threadId << " error: " << e.what() << std::endl;
+                if (dynamic_cast<const ServerStalled*>(&e) != nullptr) {
+                    dropStalled(source);
+                }
+                bool busy = dynamic_cast<const ServerBusy*>(&e) != nullptr;
+                if ((busy ? ++busyRetries > maxBusyRetries : ++attempt > maxReconnects) || versionMismatch) {
+                    streamGaveUp();
+                    break;
+                }
+            }
+        }
+
+        std::cout << "Thread " << threadId << " completed. Received "
+                  << connectionBytes << " bytes in " << rangesFetched << " range(s)\n";
+    }
+
+    // io_uring engine for Direct mode. One ring per core drives several
+    // connections. A READ's data is received into registered buffers by a
+    // single chain of linked RECV(MSG_WAITALL) -> WRITE_FIXED pairs, so
+    // each piece lands at its file offset without returning to user space
+    // in between; the checksum is computed when a RECV completes. Requests
+    // are pipelined ringPipelineDepth deep per connection. A failure on one
+    // connection cancels the rest of its chain; once its last operation
+    // has completed the range is abandoned and the connection reopened,
+    // as on the blocking path. A stream the tuner has idled is parked: its
+    // connection is closed, and the ring timer checks for it to be wanted
+    // again.
+    static constexpr size_t ringPieceSize = 256 * 1024;
+    static constexpr size_t ringPipelineDepth = 2;
+    static constexpr int ringStallSeconds = 5;
+    static constexpr long ringTickNanoseconds = 250 * 1000 * 1000;
+
+    enum class RingOp : uint64_t {
+        Header = 1,
+        Recv,
+        Write,
+        Timer
+    };
+
+    struct RingRequest {
+        uint32_t requestId = 0;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        PhaseTimer::Clock::time_point sentAt;
+    };
+
+    struct RingConnection {
+        int threadId = 0;
+        std::unique_ptr<ServerConnection> connection;
+        Source* source = nullptr;          // Where connection goes
+        int rangeId = -1;
+        int attempts = 0;
+        int busyRetries = 0;
+        bool busy = false;                 // Failed on a busy answer
+        std::deque<RingRequest> requests;  // READs sent, oldest first
+        char header[protocol::headerSize];
+        uint32_t crc = 0;
+        uint32_t expectedCrc = 0;
+        int piecesPending = 0;
+        int opsPending = 0;                // Submitted and not yet completed
+        bool failed = false;
+        bool done = false;
+        bool parked = false;               // Idle until the stream is wanted again
+        bool working = false;
+        bool retiring = false;             // Stop requesting; requeue the rest of the range
+        uint64_t bytes = 0;
+        int rangesFetched = 0;
+        std::chrono::steady_clock::time_point lastProgress;
+        PhaseTimer::Clock::time_point receiveStart;  // Header of the response in progress arrived
+    };
+
+    static uint64_t ringTag(size_t connection, RingOp op, int buffer = 0) {
+        return static_cast<uint64_t>(connection) << 32 | static_cast<uint64_t>(op) << 24 |
+               static_cast<uint64_t>(buffer);
+    }
+
+    static bool uringSupported() {
+        try {
+            IoUring probe(4);
+            return true;
+        } catch (const std::system_error&) {
+            return false;
+        }
+    }
+
+    void ringSetWorking(RingConnection& c, bool working) {
+        if (c.working != working) {
+            c.working = working;
+            workingStreams += working ? 1 : -1;
+            stats->stream(c.threadId).active = working;
+        }
+    }
+
+    // Idles a stream whose requests have all been answered; its connection
+    // goes back to the pool.
+    void ringPark(RingConnection& c) {
+        if (c.connection) {
+            c.connection->catchUp();
+            connections.put(std::move(c.connection));
+        }
+        c.parked = true;
+        ringSetWorking(c, false);
+    }
+
+    void ringFillPipeline(RingConnection& c) {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        while (c.requests.size() < ringPipelineDepth) {
+            if (!streamWanted(c.threadId)) {
+                c.retiring = true;
+                return;
+            }
+            if ((length = scheduler->nextRequest(c.rangeId, requestSize, offset)) == 0) {
+                return;
+            }
+            protocol::FrameHeader request;
+            request.op = protocol::Op::Read;
+            request.fileId = fileId;
+            request.offset = offset;
+            request.length = length;
+            request.flags = verify ? protocol::flagChecksum : 0;
+            auto sentAt = phases.now();
+            c.requests.push_back({c.connection->send(request), offset, length, sentAt});
+        }
+    }
+
+    // Posts the receive of the next response header, or moves on to the
+    // next range once every request of this one has been answered.
+    void ringNext(IoUring& ring, size_t index, RingConnection& c) {
+        while (c.requests.empty()) {
+            if (c.rangeId >= 0) {
+                recordDurable(c.rangeId);
+                if (c.retiring) {
+                    scheduler->abandon(c.rangeId);
+                } else {
+                    scheduler->complete(c.rangeId);
+                    c.rangesFetched++;
+                }
+                c.rangeId = -1;
+                c.retiring = false;
+            }
+            if (!streamWanted(c.threadId)) {
+                ringPark(c);
+                return;
+            }
+            if (!scheduler->claim(c.rangeId)) {
+                c.rangeId = -1;
+                ringPark(c);
+                c.done = true;
+                markDrained();
+                return;
+            }
+            if (!c.connection) {
+                c.connection = connectStream(c.threadId, c.attempts + c.busyRetries, c.source);
+                if (c.connection->buffered() != 0) {
+                    throw std::runtime_error("Unexpected data after OPEN");
+                }
+            }
+            ringFillPipeline(c);
+        }
+
+        io_uring_sqe* sqe = ring.prepare();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c.connection->socket();
+        sqe->addr = reinterpret_cast<uint64_t>(c.header);
+        sqe->len = protocol::headerSize;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->user_data = ringTag(index, RingOp::Header);
+        c.opsPending++;
+    }
+
+    // Checks a response header and chains the receive and write of its data.
+    void ringOnHeader(IoUring& ring, RegisteredBufferPool& pool, size_t index, RingConnection& c) {
+        protocol::FrameHeader response = protocol::decodeHeader(c.header);
+        const RingRequest& request = c.requests.front();
+        if (response.op == protocol::Op::Error && (response.flags & protocol::flagBusy)) {
+            c.busy = true;
+            throw std::runtime_error("Server busy");
+        }
+        if (response.op != protocol::Op::Read || response.requestId != request.requestId ||
+            response.payloadLength != 0 || (response.flags & protocol::flagCompress)) {
+            throw std::runtime_error("Unexpected response to READ");
+        }
+        if (response.offset != request.offset || response.length != request.length) {
+            throw std::runtime_error("Server returned " + std::to_string(response.length) +
+                                     " bytes for a " + std::to_string(request.length) + " byte range");
+        }
+        if (verify && !(response.flags & protocol::flagChecksum)) {
+            throw std::runtime_error("Response is missing its checksum");
+        }
+        c.crc = 0;
+        c.expectedCrc = response.checksum;
+        phases.record(Phase::Request, static_cast<uint64_t>(c.threadId), request.sentAt);
+        c.receiveStart = phases.now();
+
+        // Keep the server busy while this response is being received
+        ringFillPipeline(c);
+
+        uint64_t offset = request.offset;
+        uint64_t remaining = request.length;
+        while (remaining > 0) {
+            int buffer = pool.acquire();
+            if (buffer < 0) {
+                throw std::runtime_error("Registered buffer pool exhausted");
+            }
+            uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(pool.size(), remaining));
+            remaining -= length;
+
+            io_uring_sqe* recv = ring.prepare();
+            recv->opcode = IORING_OP_RECV;
+            recv->fd = c.connection->socket();
+            recv->addr = reinterpret_cast<uint64_t>(pool.data(buffer));
+            recv->len = length;
+            recv->msg_flags = MSG_WAITALL;
+            recv->flags = IOSQE_IO_LINK;
+            recv->user_data = ringTag(index, RingOp::Recv, buffer);
+
+            io_uring_sqe* write = ring.prepare();
+            write->opcode = IORING_OP_WRITE_FIXED;
+            write->fd = outputFd;
+            write->addr = reinterpret_cast<uint64_t>(pool.data(buffer));
+            write->len = length;
+            write->off = offset;
+            write->buf_index = static_cast<uint16_t>(buffer);
+            write->flags = remaining > 0 ? IOSQE_IO_LINK : 0;
+            write->user_data = ringTag(index, RingOp::Write, buffer);
+
+            offset += length;
+            c.piecesPending++;
+            c.opsPending += 2;
+        }
+    }
+
+    void ringOnComplete(IoUring& ring, RegisteredBufferPool& pool, size_t index, RingConnection& c,
+                        RingOp op, int buffer, int result) {
+        c.opsPending--;
+        if (op == RingOp::Write) {
+            pool.release(buffer);
+            c.piecesPending--;
+        }
+        if (c.failed) {
+            return;
+        }
+
+        if (op == RingOp::Header) {
+            if (result != static_cast<int>(protocol::headerSize)) {
+                throw std::runtime_error(result < 0 ? std::strerror(-result) : "Connection closed by server");
+            }
+            c.lastProgress = std::chrono::steady_clock::now();
+            ringOnHeader(ring, pool, index, c);
+            if (c.requests.front().length == 0) {
+                c.requests.pop_front();
+                ringNext(ring, index, c);
+            }
+            return;
+        }
+
+        if (op == RingOp::Recv) {
+            if (result < 0 || static_cast<size_t>(result) == 0) {
+                throw std::runtime_error(result < 0 ? std::strerror(-result) : "Connection closed by server");
+            }
+            c.lastProgress = std::chrono::steady_clock::now();
+            if (verify) {
+                c.crc = crc32c::extend(c.crc, pool.data(buffer), static_cast<size_t>(result));
+            }
+            stats->stream(c.threadId).addBytes(static_cast<uint64_t>(result));
+            return;
+        }
+
+        // Write
+        if (result < 0) {
+            throw std::system_error(-result, std::system_category(), "Write failed");
+        }
+        if (c.piecesPending > 0) {
+            return;
+        }
+
+        RingRequest request = c.requests.front();
+        if (verify && c.crc != c.expectedCrc) {
+            throw std::runtime_error("Checksum mismatch for " + std::to_string(request.length) +
+                                     " bytes at offset " + std::to_string(request.offset));
+        }
+        c.requests.pop_front();
+        phases.record(Phase::Receive, static_cast<uint64_t>(c.threadId), c.receiveStart, request.length);
+        scheduler->markReceived(c.rangeId, request.length);
+        stats->stream(c.threadId).addChunk();
+        c.bytes += request.length;
+        c.source->bytes += request.length;
+        ringNext(ring, index, c);
+    }
+
+    // Stops a connection after an error. Its outstanding operations are
+    // cancelled by shutting the socket down; the connection is restarted
+    // once they have all completed.
+    void ringFail(RingConnection& c, const std::string& reason) {
+        if (!c.failed) {
+            std::cerr << "Thread " << c.threadId << " error: " << reason << std::endl;
+            stats->stream(c.threadId).addRetry();
+            c.failed = true;
+        }
+        if (c.connection) {
+            shutdown(c.connection->socket(), SHUT_RDWR);
+        }
+    }
+
+    // Requeues the connection's range and reconnects, up to maxReconnects
+    // times (and maxBusyRetries times more for busy answers).
+    void ringRestart(IoUring& ring, size_t index, RingConnection& c) {
+        while (c.failed && c.opsPending == 0) {
+            if (c.rangeId >= 0) {
+                recordDurable(c.rangeId);
+                scheduler->abandon(c.rangeId);
+                c.rangeId = -1;
+            }
+            c.connection.reset();
+            c.requests.clear();
+            c.retiring = false;
+            bool busy = c.busy;
+            c.busy = false;
+            if ((busy ? ++c.busyRetries > maxBusyRetries : ++c.attempts > maxReconnects) || versionMismatch) {
+                c.done = true;
+                ringSetWorking(c, false);
+                streamGaveUp();
+                return;
+            }
+            c.failed = false;
+            try {
+                ringNext(ring, index, c);
+            } catch (const std::exception& e) {
+                ringFail(c, e.what());
+            }
+        }
+    }
+
+    // Starts a stream that is wanted, or keeps it parked.
+    void ringLaunch(IoUring& ring, size_t index, RingConnection& c) {
+        if (!streamWanted(c.threadId)) {
+            c.parked = true;
+            return;
+        }
+        c.parked = false;
+        c.lastProgress = std::chrono::steady_clock::now();
+        ringSetWorking(c, true);
+        try {
+            ringNext(ring, index, c);
+        } catch (const std::exception& e) {
+            ringFail(c, e.what());
+        }
+        ringRestart(ring, index, c);
+    }
+
+    // Drives streams ringIndex, ringIndex + ringCount, ... so that the
+    // streams the tuner starts first are spread over the rings.
+    void runRing(int ringIndex, int ringCount) {
+        int connectionCount = (threadCount - ringIndex + ringCount - 1) / ringCount;
+        size_t pieceSize = static_cast<size_t>(std::min<uint64_t>(ringPieceSize, requestSize));
+        size_t piecesPerRequest = static_cast<size_t>((requestSize + pieceSize - 1) / pieceSize);
+        IoUring ring(static_cast<unsigned>(connectionCount * (2 * piecesPerRequest + 4)));
+        RegisteredBufferPool pool(ring, connectionCount * piecesPerRequest, pieceSize);
+        std::vector<RingConnection> connections(connectionCount);
+
+        for (size_t i = 0; i < connections.size(); ++i) {
+            connections[i].threadId = ringIndex + static_cast<int>(i) * ringCount;
+            ringLaunch(ring, i, connections[i]);
+        }
+
+        __kernel_timespec tick{0, ringTickNanoseconds};
+        bool timerArmed = false;
+        auto active = [&] {
+            for (const RingConnection& c : connections) {
+                if (!c.done) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        while (active()) {
+            if (!timerArmed) {
+                io_uring_sqe* sqe = ring.prepare();
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = reinterpret_cast<uint64_t>(&tick);
+                sqe->len = 1;
+                sqe->user_data = ringTag(0, RingOp::Timer);
+                timerArmed = true;
+            }
+            ring.submit(1);
+
+            io_uring_cqe completion;
+            while (ring.next(completion)) {
+                RingOp op = static_cast<RingOp>((completion.user_data >> 24) & 0xFF);
+                if (op == RingOp::Timer) {
+                    timerArmed = false;
+                    auto now = std::chrono::steady_clock::now();
+                    for (RingConnection& c : connections) {
+                        if (c.opsPending > 0 && !c.failed &&
+                            now - c.lastProgress > std::chrono::seconds(ringStallSeconds)) {
+                            ringFail(c, "Timed out");
+                            dropStalled(c.source);
+                        }
+                    }
+                    continue;
+                }
+
+                size_t index = static_cast<size_t>(completion.user_data >> 32);
+                int buffer = static_cast<int>(completion.user_data & 0xFFFFFF);
+                RingConnection& c = connections[index];
+                try {
+                    ringOnComplete(ring, pool, index, c, op, buffer, completion.res);
+                } catch (const std::exception& e) {
+                    ringFail(c, e.what());
+                }
+                ringRestart(ring, index, c);
+            }
+
+            for (size_t i = 0; i < connections.size(); ++i) {
+                RingConnection& c = connections[i];
+                if (c.parked && !c.done) {
+                    if (drained) {
+                        c.done = true;
+                    } else if (streamWanted(c.threadId)) {
+                        ringLaunch(ring, i, c);
+                    }
+                }
+            }
+        }
+
+        for (const RingConnection& c : connections) {
+            std::cout << "Thread " << c.threadId << " completed. Received "
+                      << c.bytes << " bytes in " << c.rangesFetched << " range(s)\n";
+        }
+    }
+
+public:
+    static constexpr uint64_t defaultRequestSize = 1024 * 1024;
+
+    DownloadClient(const std::string& hosts, int threads, const std::string& file, int port = 8000,
+                   WriteMode writeMode = WriteMode::Direct, bool verify = true, bool compress = false,
+                   bool useUring = true, uint64_t requestSize = defaultRequestSize,
+                   const StatsReporter::Options& reportOptions = StatsReporter::Options(),
+                   bool autoStreams = false, bool deltaMode = false, bool directIo = false,
+                   size_t bufferSize = BufferPool::defaultBufferSize,
+                   const PhaseTimer::Options& timing = PhaseTimer::Options(), bool checkMirrors = false)
+        : filename(file), threadCount(threads), outputDir("downloads"),
+          baseFilename(fs::path(file).filename().string()), writeMode(writeMode), verify(verify),
+          compress(compress), useUring(useUring),
+          requestSize(std::min(maxRequestSize, std::max(minRequestSize, requestSize))), directIo(directIo),
+          buffers(bufferSize), reportOptions(reportOptions), phases(timing), autoStreams(autoStreams),
+          deltaMode(deltaMode), checkMirrors(checkMirrors) {
+        // hosts is "host[:port],host[:port],..."; port is the default
+        std::stringstream list(hosts);
+        std::string entry;
+        while (std::getline(list, entry, ',')) {
+            if (entry.empty()) {
+                continue;
+            }
+            Source& source = sources.emplace_back();
+            size_t colon = entry.rfind(':');
+            source.host = colon == std::string::npos ? entry : entry.substr(0, colon);
+            source.port = colon == std::string::npos ? port : std::stoi(entry.substr(colon + 1));
+        }
+        if (sources.empty()) {
+            throw std::runtime_error("No server given");
+        }
+    }
+
+    ~DownloadClient() {
+        merger.reset();  // Still writes to outputFd until it stops
+        if (outputFd >= 0) {
+            close(outputFd);
+        }
+        if (directFd >= 0) {
+            close(directFd);
+        }
+        if (basisFd >= 0) {
+            close(basisFd);
+        }
+    }
+
+    // Creates the final file at full size up front so every connection can
+    // pwrite its ranges in place. fallocate reserves the blocks where the
+    // file system supports it; otherwise the file is extended sparsely.
+    // If an earlier run of the same file version left a journal behind, the
+    // ranges it lists are kept and only the gaps are returned for fetching.
+    std::vector<std::pair<uint64_t, uint64_t>> prepareOutputFile() {
+        std::string outputFilePath = outputDir + "/" + baseFilename;
+        std::string journalPath = outputFilePath + ".progress";
+
+        std::vector<ProgressJournal::ByteRange> durable;
+        std::error_code ec;
+        bool resuming = fs::file_size(outputFilePath, ec) == fileSize && !ec &&
+                        ProgressJournal::load(journalPath, fileSize, fileVersion, durable);
+        if (!resuming) {
+            durable.clear();
+        }
+
+        outputFd = open(outputFilePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (outputFd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot create output file: " + outputFilePath);
+        }
+
+        if (ftruncate(outputFd, static_cast<off_t>(fileSize)) != 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot size output file: " + outputFilePath);
+        }
+        if (fileSize > 0 && fallocate(outputFd, 0, 0, static_cast<off_t>(fileSize)) != 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+            throw std::system_error(errno, std::system_category(), "Cannot preallocate output file: " + outputFilePath);
+        }
+
+        if (directIo) {
+            directFd = open(outputFilePath.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+            if (directFd < 0) {
+                std::cout << "O_DIRECT unsupported for " << outputFilePath << ", using buffered writes" << std::endl;
+            }
+        }
+
+        journal = std::make_unique<ProgressJournal>(journalPath, fileSize, fileVersion, durable);
+
+        std::vector<std::pair<uint64_t, uint64_t>> spans;
+        uint64_t missingBytes = 0;
+        for (const ProgressJournal::ByteRange& gap : ProgressJournal::missing(durable, fileSize)) {
+            spans.emplace_back(gap.begin, gap.end);
+            missingBytes += gap.end - gap.begin;
+        }
+        if (resuming) {
+            std::cout << "Resuming " << outputFilePath << ": " << (fileSize - missingBytes) << "/"
+                      << fileSize << " bytes already on disk" << std::endl;
+        }
+        return spans;
+    }
+
+    // Parts mode: creates the final file at full size and starts the merge
+    // stage, so each part can be placed as soon as its range is done.
+    void prepareMergeTarget() {
+        std::string outputFilePath = outputDir + "/" + baseFilename;
+        outputFd = open(outputFilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (outputFd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot create output file: " + outputFilePath);
+        }
+        if (ftruncate(outputFd, static_cast<off_t>(fileSize)) != 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot size output file: " + outputFilePath);
+        }
+        merger = std::make_unique<PartMerger>(outputFd, verify, buffers, phases, mergeTrack());
+    }
+
+    // Returns false, with the reason reported, when the file could not be
+    // completed.
+    bool start() {
+        fetchFileInfo();
+
+        // Create output directory if it doesn't exist
+        if (!fs::exists(outputDir)) {
+            fs::create_directories(outputDir);
+        }
+
+        if (deltaMode) {
+            prepareBasis();
+        }
+
+        std::vector<std::pair<uint64_t, uint64_t>> spans{{0, fileSize}};
+        if (writeMode == WriteMode::Direct) {
+            spans = prepareOutputFile();
+        } else {
+            prepareMergeTarget();
+        }
+
+        // Ranges of rangeSize bytes, but small enough that every
+        // connection gets at least one
+        uint64_t spanBytes = 0;
+        for (const auto& span : spans) {
+            spanBytes += span.second - span.first;
+        }
+        uint64_t perThread = (spanBytes + threadCount - 1) / std::max(1, threadCount);
+        uint64_t chunkSize = std::max<uint64_t>(minStealSize, std::min(rangeSize, perThread));
+        scheduler = std::make_unique<ChunkScheduler>(spans, chunkSize, minStealSize);
+        stats = std::make_unique<TransferStats>(static_cast<size_t>(std::max(1, threadCount)));
+        streamTarget = autoStreams ? std::min(initialAutoStreams, threadCount) : threadCount;
+
+        std::vector<std::thread> threads;
+        threads.reserve(threadCount);
+
+        StatsReporter reporter(*stats, reportOptions, spanBytes);
+        for (int i = 0; i < threadCount; ++i) {
+            phases.nameTrack(static_cast<uint64_t>(i), "stream " + std::to_string(i));
+        }
+        phases.nameTrack(mainTrack(), "main");
+        phases.nameTrack(mergeTrack(), "merge");
+
+        // Compressed responses and deltas are decoded, and O_DIRECT writes
+        // staged, on the blocking path
+        bool rings = useUring && writeMode == WriteMode::Direct && !compress && basisFd < 0 && directFd < 0;
+        if (rings && !uringSupported()) {
+            std::cout << "io_uring unavailable, using blocking I/O" << std::endl;
+            rings = false;
+        }
+
+        if (rings) {
+            // One ring per core, each driving its share of the connections
+            int ringCount = std::min(threadCount, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+            for (int i = 0; i < ringCount; ++i) {
+                threads.emplace_back(&DownloadClient::runRing, this, i, ringCount);
+            }
+        } else {
+            // Connections open lazily on their first claim, so there is no
+            // need to stagger startup
+            for (int i = 0; i < threadCount; ++i) {
+                threads.emplace_back(&DownloadClient::handleConnection, this, i);
+            }
+        }
+
+        std::thread tuner;
+        if (autoStreams) {
+            tuner = std::thread(&DownloadClient::tuneStreams, this);
+        }
+
+        // Join threads
+        for (auto& t : threads) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+        markDrained();
+        if (tuner.joinable()) {
+            tuner.join();
+        }
+        reporter.stop();
+
+        if (sources.size() > 1) {
+            uint64_t total = 0;
+            for (const Source& source : sources) {
+                total += source.bytes;
+            }
+            for (const Source& source : sources) {
+                std::cout << "Source " << source.name() << ": " << source.bytes << " bytes ("
+                          << std::fixed << std::setprecision(1)
+                          << (total > 0 ? 100.0 * source.bytes / total : 0.0) << "%)"
+                          << (source.down ? ", down" : "") << std::endl;
+            }
+        }
+
+        // After all threads are done, merge the parts
+        bool complete = mergeFiles();
+        phases.report(std::cout);
+        phases.writeTrace();
+        return complete;
+    }
+
+    bool mergeFiles() {
+        std::string outputFilePath = outputDir + "/" + baseFilename;
+
+        if (writeMode == WriteMode::Direct) {
+            // Every range is already in place; only the journal is left
+            if (versionMismatch) {
+                std::cerr << "Ranges came from different versions of " << filename << "; download again" << std::endl;
+                return false;
+            } else if (!scheduler->finished()) {
+                std::cerr << "Download incomplete; written ranges are listed in "
+                          << outputFilePath << ".progress" << std::endl;
+                return false;
+            } else {
+                if (fsync(outputFd) != 0) {
+                    throw std::system_error(errno, std::system_category(), "Write failed: " + outputFilePath);
+                }
+                if (verify) {
+                    auto begin = phases.now();
+                    verifyDigest(outputFilePath, localDigest(outputFd));
+                    phases.record(Phase::Verify, mainTrack(), begin, fileSize);
+                }
+                if (directFd >= 0) {
+                    // Verification read the file through the page cache
+                    posix_fadvise(outputFd, 0, 0, POSIX_FADV_DONTNEED);
+                }
+                // Only a verified file retires the journal and replaces the
+                // basis; on a mismatch both stay for the next attempt
+                journal->remove();
+                removeBasis();
+                std::cout << "\nFile successfully downloaded: " << outputFilePath << std::endl;
+            }
+            return true;
+        }
+
+        try {
+            // Parts were merged as their ranges finished; wait for the last
+            merger->finish();
+            if (versionMismatch || !scheduler->finished()) {
+                fs::remove(outputFilePath);
+                throw std::runtime_error(versionMismatch
+                                             ? "Ranges came from different versions of " + filename + "; download again"
+                                             : std::string("Download incomplete; download again"));
+            }
+            if (fsync(outputFd) != 0) {
+                throw std::system_error(errno, std::system_category(), "Write failed: " + outputFilePath);
+            }
+
+            // Delete part files left empty by a steal
+            for (int id = 0; id < scheduler->rangeCount(); ++id) {
+                fs::remove(partFilename(id));
+            }
+
+            // Every merged piece was hashed as it was placed
+            if (verify) {
+                auto begin = phases.now();
+                verifyDigest(outputFilePath, merger->digest(fileSize));
+                phases.record(Phase::Verify, mainTrack(), begin, fileSize);
+            }
+            removeBasis();
+            std::cout << "File successfully downloaded and merged"
+                      << (merger->usedCopyFileRange() ? " (copy_file_range)" : "") << ": " << outputFilePath
+                      << std::endl;
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error merging files: " << e.what() << std::endl;
+            return false;
+        }
+    }
+};
+
+// Transfers many files over a fixed pool of persistent connections. The
+// file list comes from the server (LIST of a directory, recursive) or from a
+// local manifest with one remote path per line. Small files are coalesced
+// into BATCH requests, large ones are fetched as READ requests written in
+// place, and each connection keeps several requests in flight so the
+// per-file cost is not a round trip. The LIST or STAT connection is pooled
+// and carries the first worker's requests.
+class BatchDownloadClient {
+private:
+    struct RemoteFile {
+        std::string remotePath;
+        std::string localPath;
+        uint64_t size = 0;
+        std::string version;
+        int fd = -1;  // Preallocated output for files fetched as ranges
+    };
+
+    // One request: either a coalesced set of small files or one range of a
+    // large file. A range may be preceded on the wire by a CLOSE of the
+    // connection's previous file and an OPEN of its own; the flags say which
+    // extra responses come before the data.
+    struct WorkItem {
+        std::vector<size_t> files;
+        size_t file = 0;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        bool isRange = false;
+        bool closesPrevious = false;
+        bool opensFile = false;
+    };
+
+    // Per-connection state: the large file currently open on it, if any.
+    // Ranges of one file are queued together, so a connection usually
+    // opens each file once.
+    struct OpenState {
+        bool open = false;
+        size_t file = 0;
+    };
+
+    static constexpr uint64_t smallFileLimit = 1024 * 1024;    // Larger files go by range
+    static constexpr uint64_t batchBytes = 4 * 1024 * 1024;    // Payload per coalesced request
+    static constexpr size_t batchFiles = 256;                  // Files per coalesced request
+    static constexpr uint64_t rangeSize = 8 * 1024 * 1024;     // Bytes per READ request
+    static constexpr size_t pipelineDepth = 4;                 // Requests in flight per connection
+    static constexpr int maxReconnects = 2;
+
+    std::string ipAddress;
+    int port;
+    int threadCount;
+    bool verify;
+    bool compress;
+    std::string outputDir;
+    BufferPool buffers;           // Receive buffers
+    ConnectionPool connections;   // Idle connections, reused across phases
+    std::vector<RemoteFile> files;
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;  // Items requeued, or none left in flight
+    std::deque<WorkItem> queue;
+    size_t itemsInFlight = 0;              // Taken from the queue and not yet done
+    std::atomic<uint64_t> bytesReceived{0};
+    std::atomic<size_t> filesFailed{0};
+    StatsReporter::Options reportOptions;
+    std::unique_ptr<TransferStats> stats;
+
+    // Keeps downloads inside outputDir whatever the remote path looks like.
+    std::string localPathFor(const std::string& relativePath) const {
+        fs::path path = fs::path(relativePath).relative_path().lexically_normal();
+        if (path.empty() || *path.begin() == "..") {
+            path = fs::path(relativePath).filename();
+        }
+        return (fs::path(outputDir) / path).string();
+    }
+
+    // An idle connection from the pool if there is one, or a new one.
+    std::unique_ptr<ServerConnection> acquireConnection(int threadId) {
+        std::unique_ptr<ServerConnection> connection = connections.take(ipAddress, port, threadId);
+        if (!connection) {
+            connection = std::make_unique<ServerConnection>(ipAddress, port, threadId, buffers);
+        }
+        return connection;
+    }
+
+    void listRemoteDirectory(const std::string& directory) {
+        std::unique_ptr<ServerConnection> connection = acquireConnection(0);
+        protocol::FrameHeader request;
+        request.op = protocol::Op::List;
+        connection->send(request, directory);
+        Response response = connection->expectResponse();
+        connections.put(std::move(connection));
+
+        for (protocol::Entry& entry : protocol::getEntries(response.payload)) {
+            RemoteFile file;
+            file.size = entry.size;
+            file.version = std::move(entry.version);
+            file.remotePath = (fs::path(directory) / entry.name).string();
+            file.localPath = localPathFor(entry.name);
+            files.push_back(std::move(file));
+        }
+    }
+
+    // Looks up size and version of every manifest entry with pipelined STAT
+    // requests on one connection.
+    void statManifest(const std::string& manifestPath) {
+        std::ifstream manifest(manifestPath);
+        if (!manifest) {
+            throw std::runtime_error("Cannot open manifest: " + manifestPath);
+        }
+
+        std::string line;
+        while (std::getline(manifest, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                continue;
+            }
+            RemoteFile file;
+            file.remotePath = line;
+            file.localPath = localPathFor(line);
+            files.push_back(std::move(file));
+        }
+
+        std::unique_ptr<ServerConnection> connection = acquireConnection(0);
+        protocol::FrameHeader request;
+        request.op = protocol::Op::Stat;
+        size_t sent = 0;
+        for (size_t received = 0; received < files.size(); ++received) {
+            while (sent < files.size() && sent - received < pipelineDepth * 16) {
+                connection->send(request, files[sent++].remotePath);
+            }
+            // A missing file comes back as ERROR and keeps an empty version
+            Response response = connection->readResponse();
+            if (response.header.op != protocol::Op::Error) {
+                files[received].size = response.header.length;
+                files[received].version = response.payload;
+            }
+        }
+        connections.put(std::move(connection));
+    }
+
+    // Creates the output of a large file at full size so its ranges can be
+    // written in place from any connection.
+    void preallocate(RemoteFile& file) {
+        fs::create_directories(fs::path(file.localPath).parent_path());
+        file.fd = open(file.localPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file.fd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot create output file: " + file.localPath);
+        }
+        if (ftruncate(file.fd, static_cast<off_t>(file.size)) != 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot size output file: " + file.localPath);
+        }
+        if (fallocate(file.fd, 0, 0, static_cast<off_t>(file.size)) != 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+            throw std::system_error(errno, std::system_category(), "Cannot preallocate output file: " + file.localPath);
+        }
+    }
+
+    void buildQueue() {
+        WorkItem batch;
+        uint64_t batchPayload = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            RemoteFile& file = files[i];
+            if (file.version.empty()) {
+                std::cerr << "Missing on server: " << file.remotePath << std::endl;
+                filesFailed++;
+                continue;
+            }
+            if (file.size <= smallFileLimit) {
+                if (!batch.files.empty() &&
+                    (batch.files.size() == batchFiles || batchPayload + file.size > batchBytes)) {
+                    queue.push_back(std::move(batch));
+                    batch = WorkItem();
+                    batchPayload = 0;
+                }
+                batch.files.push_back(i);
+                batchPayload += file.size;
+                continue;
+            }
+
+            preallocate(file);
+            for (uint64_t offset = 0; offset < file.size; offset += rangeSize) {
+                WorkItem range;
+                range.isRange = true;
+                range.file = i;
+                range.offset = offset;
+                range.length = std::min(rangeSize, file.size - offset);
+                queue.push_back(range);
+            }
+        }
+        if (!batch.files.empty()) {
+            queue.push_back(std::move(batch));
+        }
+    }
+
+    // Takes the next queued item. With wait set (the caller has nothing in
+    // flight), an empty queue is waited on while other connections still
+    // have requests out: one of them may fail and requeue its items, and
+    // a connection that had already left would leave them undone.
+    bool nextItem(WorkItem& item, bool wait) {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if (wait) {
+            queueChanged.wait(lock, [this] { return !queue.empty() || itemsInFlight == 0; });
+        }
+        if (queue.empty()) {
+            return false;
+        }
+        item = std::move(queue.front());
+        queue.pop_front();
+        itemsInFlight++;
+        return true;
+    }
+
+    void finishItem() {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (--itemsInFlight == 0) {
+            queueChanged.notify_all();
+        }
+    }
+
+    void requeue(std::deque<WorkItem>& items) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            for (WorkItem& item : items) {
+                queue.push_back(std::move(item));
+            }
+            itemsInFlight -= items.size();
+            items.clear();
+        }
+        queueChanged.notify_all();
+    }
+
+    // Handles are the file's index plus one, so they never collide.
+    static uint32_t handleFor(size_t file) {
+        return static_cast<uint32_t>(file + 1);
+    }
+
+    void sendRequest(ServerConnection& connection, OpenState& state, WorkItem& item) {
+        protocol::FrameHeader request;
+        uint16_t flags = verify ? protocol::flagChecksum : 0;
+        if (item.isRange) {
+            item.closesPrevious = state.open && state.file != item.file;
+            item.opensFile = !state.open || state.file != item.file;
+            if (item.closesPrevious) {
+                request.op = protocol::Op::Close;
+                request.fileId = handleFor(state.file);
+                connection.send(request);
+            }
+            if (item.opensFile) {
+                request.op = protocol::Op::Open;
+                request.fileId = handleFor(item.file);
+                connection.send(request, files[item.file].remotePath);
+                state.open = true;
+                state.file = item.file;
+            }
+
+            request.op = protocol::Op::Read;
+            request.flags = flags | (compress ? protocol::flagCompress : 0);
+            request.fileId = handleFor(item.file);
+            request.offset = item.offset;
+            request.length = item.length;
+            connection.send(request);
+            return;
+        }
+
+        protocol::PayloadWriter writer;
+        writer.putU32(static_cast<uint32_t>(item.files.size()));
+        for (size_t index : item.files) {
+            writer.putString(files[index].remotePath);
+        }
+        request.op = protocol::Op::Batch;
+        request.flags = flags;
+        connection.send(request, writer.str());
+    }
+
+    void receiveRange(ServerConnection& connection, StreamCounters& counters, const WorkItem& item) {
+        RemoteFile& file = files[item.file];
+        if (item.closesPrevious) {
+            connection.expectResponse();
+        }
+        if (item.opensFile) {
+            Response opened = connection.expectResponse();
+            if (opened.payload != file.version || opened.header.length != file.size) {
+                throw std::runtime_error(file.remotePath + " changed on server during download");
+            }
+        }
+
+        Response response = connection.expectResponse();
+        if (response.dataLength() != item.length) {
+            throw std::runtime_error("Short range for " + file.remotePath);
+        }
+
+        uint64_t offset = item.offset;
+        uint32_t crc = 0;
+        connection.readData(response, [&](const char* data, size_t size) {
+            if (verify) {
+                crc = crc32c::extend(crc, data, size);
+            }
+            while (size > 0) {
+                ssize_t written = pwrite(file.fd, data, size, static_cast<off_t>(offset));
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "Write failed: " + file.localPath);
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+                offset += static_cast<uint64_t>(written);
+                counters.addBytes(static_cast<uint64_t>(written));
+            }
+        });
+        if (verify && (!(response.header.flags & protocol::flagChecksum) || crc != response.header.checksum)) {
+            throw std::runtime_error("Checksum mismatch in " + file.remotePath);
+        }
+        bytesReceived += item.length;
+    }
+
+    // Unpacks a BATCH response: the payload lists each file's size, version
+    // and checksum, and the files follow back to back. Files missing on the
+    // server are reported and skipped; the rest are written whole, at the
+    // version the server sent even if it changed since the listing. A
+    // checksum mismatch fails the whole batch so it is fetched again; its
+    // files and bytes are only counted once the whole batch is through.
+    void receiveBatch(ServerConnection& connection, StreamCounters& counters, const WorkItem& item) {
+        Response response = connection.expectResponse();
+        std::vector<protocol::Entry> entries = protocol::getEntries(response.payload);
+        uint64_t total = 0;
+        for (const protocol::Entry& entry : entries) {
+            total += entry.size;
+        }
+        if (entries.size() != item.files.size() || total != response.header.length) {
+            throw std::runtime_error("Malformed batch response");
+        }
+
+        uint64_t received = 0;
+        size_t failed = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const protocol::Entry& entry = entries[i];
+            RemoteFile& file = files[item.files[i]];
+            if (entry.version.empty()) {
+                std::cerr << "Missing on server: " << file.remotePath << std::endl;
+                failed++;
+                continue;
+            }
+            if (entry.version != file.version) {
+                // The whole file comes from this one response, so it is the
+                // new version throughout; record that instead of the listing's
+                std::cerr << "Changed on server since listing, fetching the current version: " << file.remotePath
+                          << std::endl;
+                file.version = entry.version;
+                file.size = entry.size;
+            }
+
+            fs::create_directories(fs::path(file.localPath).parent_path());
+            std::ofstream output(file.localPath, std::ios::binary | std::ios::trunc);
+            uint32_t crc = 0;
+            connection.readExact(entry.size, [&](const char* data, size_t length) {
+                if (verify) {
+                    crc = crc32c::extend(crc, data, length);
+                }
+                output.write(data, length);
+                counters.addBytes(length);
+            });
+            if (verify && (!(response.header.flags & protocol::flagChecksum) || crc != entry.checksum)) {
+                throw std::runtime_error("Checksum mismatch in " + file.remotePath);
+            }
+            if (!output) {
+                std::cerr << "Write failed: " << file.localPath << std::endl;
+                failed++;
+            }
+            received += entry.size;
+        }
+        bytesReceived += received;
+        filesFailed += failed;
+    }
+
+    // One pooled connection: keeps up to pipelineDepth requests outstanding
+    // and reads the in-order responses. On failure everything in flight is
+    // requeued and the connection is reopened.
+    void handleConnection(int threadId) {
+        StreamCounters& counters = stats->stream(threadId);
+        counters.active = true;
+        for (int attempt = 0; attempt <= maxReconnects; ++attempt) {
+            std::deque<WorkItem> inFlight;
+            try {
+                std::unique_ptr<ServerConnection> connection;
+                OpenState state;
+                while (true) {
+                    WorkItem item;
+                    while (inFlight.size() < pipelineDepth && nextItem(item, inFlight.empty())) {
+                        // In flight before it is sent, so a failed send requeues it
+                        inFlight.push_back(std::move(item));
+                        if (!connection) {
+                            connection = acquireConnection(threadId);
+                        }
+                        sendRequest(*connection, state, inFlight.back());
+                    }
+                    if (inFlight.empty()) {
+                        break;
+                    }
+
+                    const WorkItem& front = inFlight.front();
+                    if (front.isRange) {
+                        receiveRange(*connection, counters, front);
+                    } else {
+                        receiveBatch(*connection, counters, front);
+                    }
+                    counters.addChunk();
+                    inFlight.pop_front();
+                    finishItem();
+                }
+
+                if (connection) {
+                    // Handles are per connection; close ours before pooling it
+                    if (state.open) {
+                        protocol::FrameHeader request;
+                        request.op = protocol::Op::Close;
+                        request.fileId = handleFor(state.file);
+                        connection->send(request);
+                        connection->expectResponse();
+                    }
+                    connections.put(std::move(connection));
+                }
+                break;
+            } catch (const std::exception& e) {
+                requeue(inFlight);
+                counters.addRetry();
+                std::cerr << "Thread " << threadId << " error: " << e.what() << std::endl;
+            }
+        }
+        counters.active = false;
+    }
+
+public:
+    BatchDownloadClient(const std::string& ip, int threads, int port = 8000, bool verify = true, bool compress = false,
+                        const StatsReporter::Options& reportOptions = StatsReporter::Options(),
+                        size_t bufferSize = BufferPool::defaultBufferSize)
+        : ipAddress(ip), port(port), threadCount(std::max(1, threads)), verify(verify), compress(compress),
+          outputDir("downloads"), buffers(bufferSize), reportOptions(reportOptions) {}
+
+    ~BatchDownloadClient() {
+        for (RemoteFile& file : files) {
+            if (file.fd >= 0) {
+                close(file.fd);
+            }
+        }
+    }
+
+    // source is a remote directory when fromManifest is false, otherwise a
+    // local manifest file. Returns false if any file failed.
+    bool start(const std::string& source, bool fromManifest) {
+        auto startTime = std::chrono::steady_clock::now();
+        if (fromManifest) {
+            statManifest(source);
+        } else {
+            listRemoteDirectory(source);
+        }
+
+        fs::create_directories(outputDir);
+        buildQueue();
+        std::cout << "Fetching " << files.size() << " file(s) in " << queue.size()
+                  << " request(s) over " << threadCount << " connection(s)" << std::endl;
+
+        uint64_t expectedBytes = 0;
+        for (const RemoteFile& file : files) {
+            expectedBytes += file.size;
+        }
+        stats = std::make_unique<TransferStats>(static_cast<size_t>(threadCount));
+        StatsReporter reporter(*stats, reportOptions, expectedBytes);
+
+        std::vector<std::thread> threads;
+        threads.reserve(threadCount);
+        for (int i = 0; i < threadCount; ++i) {
+            threads.emplace_back(&BatchDownloadClient::handleConnection, this, i);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        reporter.stop();
+
+        for (RemoteFile& file : files) {
+            if (file.fd >= 0) {
+                fsync(file.fd);
+            }
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        if (!queue.empty()) {
+            // Every connection gave up; the files these requests were for
+            // are incomplete
+            std::vector<bool> incomplete(files.size(), false);
+            for (const WorkItem& item : queue) {
+                if (item.isRange) {
+                    incomplete[item.file] = true;
+                }
+                for (size_t index : item.files) {
+                    incomplete[index] = true;
+                }
+            }
+            filesFailed += static_cast<size_t>(std::count(incomplete.begin(), incomplete.end(), true));
+            std::cerr << queue.size() << " request(s) could not be completed" << std::endl;
+        }
+        std::cout << "Batch complete: " << (files.size() - filesFailed) << "/" << files.size()
+                  << " file(s), " << bytesReceived << " bytes in " << seconds << " s" << std::endl;
+        return filesFailed == 0;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    DownloadClient::WriteMode writeMode = DownloadClient::WriteMode::Direct;
+    bool verify = true;
+    bool compress = false;
+    bool useUring = true;
+    bool delta = false;
+    bool directIo = false;
+    size_t bufferSize = BufferPool::defaultBufferSize;
+    uint64_t requestSize = DownloadClient::defaultRequestSize;
+    int maxStreams = 16;
+    StatsReporter::Options reportOptions;
+    PhaseTimer::Options timing;
+    bool checkMirrors = false;
+    std::string batchDirectory;
+    std::string manifestPath;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--parts") {
+            writeMode = DownloadClient::WriteMode::Parts;
+        } else if (arg == "--no-verify") {
+            verify = false;
+        } else if (arg == "--compress") {
+            compress = true;
+        } else if (arg == "--no-uring") {
+            useUring = false;
+        } else if (arg == "--delta") {
+            delta = true;
+        } else if (arg == "--direct-io") {
+            directIo = true;
+        } else if (arg == "--buffer-size" && i + 1 < argc) {
+            bufferSize = std::stoull(argv[++i]);
+        } else if (arg == "--request-size" && i + 1 < argc) {
+            requestSize = std::stoull(argv[++i]);
+        } else if (arg == "--max-streams" && i + 1 < argc) {
+            maxStreams = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            reportOptions.jsonPath = argv[++i];
+        } else if (arg == "--stats-prom" && i + 1 < argc) {
+            reportOptions.prometheusPath = argv[++i];
+        } else if (arg == "--stats-interval" && i + 1 < argc) {
+            reportOptions.interval = std::chrono::milliseconds(std::max(1, std::stoi(argv[++i])));
+        } else if (arg == "--quiet") {
+            reportOptions.console = false;
+        } else if (arg == "--check-mirrors") {
+            checkMirrors = true;
+        } else if (arg == "--latency") {
+            timing.histograms = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            timing.tracePath = argv[++i];
+        } else if (arg == "--dir" && i + 1 < argc) {
+            batchDirectory = argv[++i];
+        } else if (arg == "--manifest" && i + 1 < argc) {
+            manifestPath = argv[++i];
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    bool batchMode = !batchDirectory.empty() || !manifestPath.empty();
+    if (positional.size() < (batchMode ? 2u : 3u)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [options] [--parts] [--no-uring] [--delta] [--direct-io] [--request-size <bytes>]\n"
+                  << "       " << std::string(std::strlen(argv[0]), ' ')
+                  << " [--max-streams <n>] [--check-mirrors] <IP[:port][,IP[:port]...]>"
+                     " <thread_count | auto> <filename> [port]\n"
+                  << "       " << argv[0]
+                  << " [options] (--dir <remote_dir> | --manifest <file>) <IP> <thread_count> [port]\n"
+                  << "Options: --no-verify --compress --quiet --stats-interval <ms>\n"
+                  << "         --stats-json <file> --stats-prom <file> --buffer-size <bytes>\n"
+                  << "         --latency --trace <file>" << std::endl;
+        return 1;
+    }
+
+    try {
+        if (batchMode) {
+            if (positional[0].find(',') != std::string::npos) {
+                throw std::runtime_error("Batch mode downloads from a single server");
+            }
+            if (timing.histograms || !timing.tracePath.empty()) {
+                throw std::runtime_error("--latency and --trace apply to single-file downloads");
+            }
+            int port = positional.size() > 2 ? std::stoi(positional[2]) : 8000;
+            BatchDownloadClient client(positional[0], std::stoi(positional[1]), port, verify, compress, reportOptions,
+                                       bufferSize);
+            return client.start(manifestPath.empty() ? batchDirectory : manifestPath, !manifestPath.empty()) ? 0 : 1;
+        }
+
+        int port = positional.size() > 3 ? std::stoi(positional[3]) : 8000;
+        bool autoStreams = positional[1] == "auto";
+        int threads = autoStreams ? maxStreams : std::stoi(positional[1]);
+        DownloadClient client(positional[0], threads, positional[2], port, writeMode, verify, compress, useUring,
+                              requestSize, reportOptions, autoStreams, delta, directIo, bufferSize, timing,
+                              checkMirrors);
+        if (!client.start()) {
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
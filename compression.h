@@ -0,0 +1,85 @@
+#pragma once
+
+// Per-chunk compression of READ data. A compressed data section is a run of
+// blocks, each "rawLength storedLength" (u32, network byte order) followed
+// by storedLength bytes: an LZ4 block, or the raw bytes when compressing
+// the block did not make it smaller (storedLength == rawLength).
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <endian.h>
+#include "lz4_block.h"
+
+namespace compression {
+
+constexpr size_t blockSize = 64 * 1024;
+constexpr size_t blockHeaderSize = 8;
+
+// Appends the compressed data section for [data, data + length) to out.
+inline void encode(const char* data, size_t length, std::string& out) {
+    for (size_t offset = 0; offset < length; offset += blockSize) {
+        size_t rawLength = std::min(blockSize, length - offset);
+        size_t headerAt = out.size();
+        out.append(blockHeaderSize, '\0');
+        lz4::compress(data + offset, rawLength, out);
+
+        size_t storedLength = out.size() - headerAt - blockHeaderSize;
+        if (storedLength >= rawLength) {
+            out.resize(headerAt + blockHeaderSize);
+            out.append(data + offset, rawLength);
+            storedLength = rawLength;
+        }
+
+        uint32_t rawBE = htobe32(static_cast<uint32_t>(rawLength));
+        uint32_t storedBE = htobe32(static_cast<uint32_t>(storedLength));
+        std::memcpy(&out[headerAt], &rawBE, 4);
+        std::memcpy(&out[headerAt + 4], &storedBE, 4);
+    }
+}
+
+inline void decodeBlockHeader(const char* header, size_t& rawLength, size_t& storedLength) {
+    uint32_t rawBE;
+    uint32_t storedBE;
+    std::memcpy(&rawBE, header, 4);
+    std::memcpy(&storedBE, header + 4, 4);
+    rawLength = be32toh(rawBE);
+    storedLength = be32toh(storedBE);
+    if (rawLength == 0 || rawLength > blockSize || storedLength > rawLength) {
+        throw std::runtime_error("Corrupt compressed block header");
+    }
+}
+
+// Decides, per file version, whether compressing its chunks pays off. The
+// first sampleChunks chunks are always compressed; after that a chunk is
+// only compressed while the samples saved at least a tenth of their size,
+// except every resampleInterval-th chunk, which is compressed again so data
+// that becomes compressible later in the file is noticed.
+class Sampler {
+private:
+    static constexpr uint32_t sampleChunks = 4;
+    static constexpr uint32_t resampleInterval = 32;
+
+    std::atomic<uint32_t> chunks{0};
+    std::atomic<uint64_t> rawBytes{0};
+    std::atomic<uint64_t> storedBytes{0};
+
+public:
+    bool shouldCompress() {
+        uint32_t chunk = chunks.fetch_add(1, std::memory_order_relaxed);
+        if (chunk < sampleChunks || chunk % resampleInterval == 0) {
+            return true;
+        }
+        return storedBytes.load(std::memory_order_relaxed) * 10 < rawBytes.load(std::memory_order_relaxed) * 9;
+    }
+
+    void record(uint64_t raw, uint64_t stored) {
+        rawBytes.fetch_add(raw, std::memory_order_relaxed);
+        storedBytes.fetch_add(stored, std::memory_order_relaxed);
+    }
+};
+
+} // namespace compression
@@ -0,0 +1,221 @@
+#pragma once
+
+// CRC32C (Castagnoli) used to check every chunk on the wire and whole files
+// after assembly. On x86-64 CPUs with SSE4.2 the crc32 instruction is used,
+// running three independent streams so its latency is hidden; elsewhere a
+// slicing-by-8 table implementation is used. Both produce the same values.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace crc32c {
+namespace detail {
+
+constexpr uint32_t polynomial = 0x82F63B78;  // Reflected Castagnoli polynomial
+constexpr size_t stripeSize = 8192;          // Bytes per stream in the hardware loop
+
+struct Tables {
+    uint32_t table[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (polynomial & (0u - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+inline const Tables& tables() {
+    static const Tables instance;
+    return instance;
+}
+
+// Works on the raw register (no pre/post inversion).
+inline uint32_t software(uint32_t state, const uint8_t* data, size_t length) {
+    const auto& t = tables().table;
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        std::memcpy(&low, data, 4);
+        std::memcpy(&high, data + 4, 4);
+        low ^= state;
+        state = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+                t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        state = (state >> 8) ^ t[0][(state ^ *data++) & 0xFF];
+    }
+    return state;
+}
+
+// Linear operator over GF(2) that advances a CRC register past a run of
+// zero bytes, stored as the images of the 32 basis vectors. Appending B to
+// A gives register(A || B) = zeros(|B|)(register(A)) ^ register(B from 0),
+// which is how independently computed pieces are joined.
+class ZeroOperator {
+private:
+    uint32_t columns[32];
+
+    static uint32_t times(const uint32_t* matrix, uint32_t vector) {
+        uint32_t result = 0;
+        for (int bit = 0; vector != 0; ++bit, vector >>= 1) {
+            if (vector & 1) {
+                result ^= matrix[bit];
+            }
+        }
+        return result;
+    }
+
+    static void compose(uint32_t* result, const uint32_t* outer, const uint32_t* inner) {
+        uint32_t composed[32];
+        for (int bit = 0; bit < 32; ++bit) {
+            composed[bit] = times(outer, inner[bit]);
+        }
+        std::memcpy(result, composed, sizeof(composed));
+    }
+
+public:
+    explicit ZeroOperator(uint64_t length) {
+        // One zero bit, squared three times: one zero byte
+        uint32_t power[32];
+        power[0] = polynomial;
+        for (int bit = 1; bit < 32; ++bit) {
+            power[bit] = 1u << (bit - 1);
+        }
+        for (int i = 0; i < 3; ++i) {
+            compose(power, power, power);
+        }
+
+        for (int bit = 0; bit < 32; ++bit) {
+            columns[bit] = 1u << bit;
+        }
+        for (; length != 0; length >>= 1) {
+            if (length & 1) {
+                compose(columns, power, columns);
+            }
+            compose(power, power, power);
+        }
+    }
+
+    uint32_t apply(uint32_t state) const {
+        return times(columns, state);
+    }
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t hardware(uint32_t state, const uint8_t* data, size_t length) {
+    static const ZeroOperator stripeShift(stripeSize);
+    while (length >= 3 * stripeSize) {
+        uint64_t a = state;
+        uint64_t b = 0;
+        uint64_t c = 0;
+        for (size_t i = 0; i < stripeSize; i += 8) {
+            uint64_t wordA;
+            uint64_t wordB;
+            uint64_t wordC;
+            std::memcpy(&wordA, data + i, 8);
+            std::memcpy(&wordB, data + stripeSize + i, 8);
+            std::memcpy(&wordC, data + 2 * stripeSize + i, 8);
+            a = _mm_crc32_u64(a, wordA);
+            b = _mm_crc32_u64(b, wordB);
+            c = _mm_crc32_u64(c, wordC);
+        }
+        state = stripeShift.apply(stripeShift.apply(static_cast<uint32_t>(a)) ^ static_cast<uint32_t>(b)) ^
+                static_cast<uint32_t>(c);
+        data += 3 * stripeSize;
+        length -= 3 * stripeSize;
+    }
+
+    uint64_t wide = state;
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+    }
+    state = static_cast<uint32_t>(wide);
+    while (length-- > 0) {
+        state = _mm_crc32_u8(state, *data++);
+    }
+    return state;
+}
+
+inline bool hardwareAvailable() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+#else
+inline uint32_t hardware(uint32_t state, const uint8_t* data, size_t length) {
+    return software(state, data, length);
+}
+
+inline bool hardwareAvailable() {
+    return false;
+}
+#endif
+
+} // namespace detail
+
+// Continues crc (0 for a fresh checksum) over length more bytes.
+inline uint32_t extend(uint32_t crc, const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t state = ~crc;
+    state = detail::hardwareAvailable() ? detail::hardware(state, bytes, length)
+                                        : detail::software(state, bytes, length);
+    return ~state;
+}
+
+inline uint32_t compute(const void* data, size_t length) {
+    return extend(0, data, length);
+}
+
+// Checksum of A followed by B, from the checksums of A and B and B's length.
+inline uint32_t combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) {
+    return detail::ZeroOperator(lengthB).apply(crcA) ^ crcB;
+}
+
+// Checksum of [offset, offset + length) of an open file.
+inline uint32_t ofFile(int fd, uint64_t offset, uint64_t length) {
+    std::vector<char> buffer(static_cast<size_t>(std::min<uint64_t>(length, 1024 * 1024)));
+    uint32_t crc = 0;
+    while (length > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length));
+        ssize_t bytesRead = pread(fd, buffer.data(), chunk, static_cast<off_t>(offset));
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::system_category(), "Checksum read failed");
+        }
+        if (bytesRead == 0) {
+            throw std::runtime_error("End of file reached while checksumming");
+        }
+        crc = extend(crc, buffer.data(), static_cast<size_t>(bytesRead));
+        offset += static_cast<uint64_t>(bytesRead);
+        length -= static_cast<uint64_t>(bytesRead);
+    }
+    return crc;
+}
+
+} // namespace crc32c
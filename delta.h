@@ -0,0 +1,268 @@
+#pragma once
+
+// rsync-style delta transfer. The client splits its existing copy of a file
+// (the basis) into fixed-size blocks and sends one signature per whole
+// block: a rolling checksum and a 64-bit strong hash. For a DELTA request
+// the server slides a block-sized window over the requested range of its
+// current file. Wherever the rolling checksum and then the strong hash
+// match a basis block, it emits a copy instruction; the bytes in between go
+// out as literals. Matches never cross the end of the requested range, so
+// ranges are independent and can be fetched in parallel like READs.
+//
+// A DELTA data section is a run of instructions:
+//   'C' block u32, count u32     count basis blocks starting at block
+//   'L' length u32, bytes        literal data
+// The strong hash is not cryptographic. The response checksum covers the
+// rebuilt bytes, so a false match is caught and that range is read in full.
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <endian.h>
+
+namespace delta {
+
+constexpr uint32_t minBlockSize = 2 * 1024;
+constexpr uint32_t maxBlockSize = 1024 * 1024;
+constexpr uint64_t targetBlocks = 64 * 1024;   // Keeps a signature under 1 MB
+constexpr size_t signatureEntrySize = 12;      // weak u32 + strong u64
+constexpr char opCopy = 'C';
+constexpr char opLiteral = 'L';
+
+struct BlockSignature {
+    uint32_t weak = 0;
+    uint64_t strong = 0;
+};
+
+// Power-of-two block size giving about targetBlocks blocks for the file.
+inline uint32_t blockSizeFor(uint64_t fileSize) {
+    uint32_t size = minBlockSize;
+    while (size < maxBlockSize && static_cast<uint64_t>(size) * targetBlocks < fileSize) {
+        size *= 2;
+    }
+    return size;
+}
+
+// rsync's rolling checksum: a is the byte sum and b the sum of the running
+// a values, both kept to 16 bits. Moving the window by one byte is O(1).
+class RollingChecksum {
+private:
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t length = 0;
+
+public:
+    void reset(const char* data, size_t size) {
+        a = b = 0;
+        length = static_cast<uint32_t>(size);
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            a += bytes[i];
+            b += a;
+        }
+    }
+
+    void roll(char outgoing, char incoming) {
+        uint32_t out = static_cast<unsigned char>(outgoing);
+        a += static_cast<unsigned char>(incoming) - out;
+        b += a - length * out;
+    }
+
+    uint32_t value() const {
+        return (a & 0xFFFF) | (b << 16);
+    }
+};
+
+// 64-bit multiply-xorshift hash over 8-byte words.
+inline uint64_t strongHash(const char* data, size_t size) {
+    constexpr uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = size * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+inline BlockSignature signBlock(const char* data, size_t size) {
+    RollingChecksum rolling;
+    rolling.reset(data, size);
+    return BlockSignature{rolling.value(), strongHash(data, size)};
+}
+
+// Signature payload: block size u32, block count u32, then per block weak
+// u32 and strong u64, all in network byte order.
+inline std::string encodeSignature(uint32_t blockSize, const std::vector<BlockSignature>& blocks) {
+    std::string out(8 + blocks.size() * signatureEntrySize, '\0');
+    uint32_t blockSizeBE = htobe32(blockSize);
+    uint32_t countBE = htobe32(static_cast<uint32_t>(blocks.size()));
+    std::memcpy(&out[0], &blockSizeBE, 4);
+    std::memcpy(&out[4], &countBE, 4);
+    char* entry = &out[8];
+    for (const BlockSignature& block : blocks) {
+        uint32_t weakBE = htobe32(block.weak);
+        uint64_t strongBE = htobe64(block.strong);
+        std::memcpy(entry, &weakBE, 4);
+        std::memcpy(entry + 4, &strongBE, 8);
+        entry += signatureEntrySize;
+    }
+    return out;
+}
+
+// A decoded signature with a lookup table on the weak checksum.
+class SignatureIndex {
+private:
+    uint32_t size = 0;
+    std::vector<BlockSignature> blocks;
+    std::unordered_map<uint32_t, uint32_t> firstByWeak;  // Weak checksum -> first block
+    std::vector<uint32_t> nextByWeak;                     // Next block with the same weak checksum
+    std::vector<uint64_t> filter;                         // One bit per folded weak checksum
+
+    static constexpr uint32_t none = UINT32_MAX;
+    static constexpr unsigned filterBits = 20;
+
+    static uint32_t fold(uint32_t weak) {
+        return (weak ^ (weak >> filterBits)) & ((1u << filterBits) - 1);
+    }
+
+public:
+    explicit SignatureIndex(const std::string& payload) {
+        if (payload.size() < 8) {
+            throw std::runtime_error("Truncated signature");
+        }
+        uint32_t blockSizeBE;
+        uint32_t countBE;
+        std::memcpy(&blockSizeBE, payload.data(), 4);
+        std::memcpy(&countBE, payload.data() + 4, 4);
+        size = be32toh(blockSizeBE);
+        uint32_t count = be32toh(countBE);
+        if (size < minBlockSize || size > maxBlockSize || (size & (size - 1)) != 0) {
+            throw std::runtime_error("Bad signature block size " + std::to_string(size));
+        }
+        if (payload.size() != 8 + static_cast<uint64_t>(count) * signatureEntrySize) {
+            throw std::runtime_error("Signature length does not match its block count");
+        }
+
+        blocks.resize(count);
+        nextByWeak.assign(count, none);
+        filter.assign((1u << filterBits) / 64, 0);
+        firstByWeak.reserve(count);
+        const char* entry = payload.data() + 8;
+        // Walk backwards so each chain lists blocks in file order
+        for (uint32_t i = count; i-- > 0;) {
+            uint32_t weakBE;
+            uint64_t strongBE;
+            std::memcpy(&weakBE, entry + i * signatureEntrySize, 4);
+            std::memcpy(&strongBE, entry + i * signatureEntrySize + 4, 8);
+            blocks[i].weak = be32toh(weakBE);
+            blocks[i].strong = be64toh(strongBE);
+            filter[fold(blocks[i].weak) / 64] |= 1ull << (fold(blocks[i].weak) % 64);
+            auto inserted = firstByWeak.emplace(blocks[i].weak, i);
+            if (!inserted.second) {
+                nextByWeak[i] = inserted.first->second;
+                inserted.first->second = i;
+            }
+        }
+    }
+
+    uint32_t blockSize() const {
+        return size;
+    }
+
+    // Basis block whose contents match the block-sized window at data with
+    // rolling checksum weak, or -1. preferred (the block after the previous
+    // match) wins among equal blocks so consecutive copies merge.
+    int64_t find(uint32_t weak, const char* data, uint32_t preferred) const {
+        // Most windows match nothing; a bit test rules them out cheaply
+        if (!(filter[fold(weak) / 64] & (1ull << (fold(weak) % 64)))) {
+            return -1;
+        }
+        auto it = firstByWeak.find(weak);
+        if (it == firstByWeak.end()) {
+            return -1;
+        }
+        uint64_t strong = strongHash(data, size);
+        int64_t found = -1;
+        for (uint32_t block = it->second; block != none; block = nextByWeak[block]) {
+            if (blocks[block].strong == strong) {
+                if (block == preferred) {
+                    return block;
+                }
+                if (found < 0) {
+                    found = block;
+                }
+            }
+        }
+        return found;
+    }
+};
+
+// Appends to out the instructions that rebuild [data, data + length).
+inline void encode(const SignatureIndex& index, const char* data, size_t length, std::string& out) {
+    auto putU32 = [&out](uint32_t value) {
+        uint32_t valueBE = htobe32(value);
+        out.append(reinterpret_cast<const char*>(&valueBE), 4);
+    };
+    auto putLiteral = [&](size_t begin, size_t end) {
+        if (end > begin) {
+            out += opLiteral;
+            putU32(static_cast<uint32_t>(end - begin));
+            out.append(data + begin, end - begin);
+        }
+    };
+
+    size_t blockSize = index.blockSize();
+    size_t literalStart = 0;
+    size_t position = 0;
+    size_t copyAt = std::string::npos;  // Offset in out of the last copy's count
+    uint32_t nextBlock = 0;             // Block after the last match
+    RollingChecksum rolling;
+    if (length >= blockSize) {
+        rolling.reset(data, blockSize);
+    }
+
+    while (position + blockSize <= length) {
+        int64_t block = index.find(rolling.value(), data + position, nextBlock);
+        if (block < 0) {
+            if (position + blockSize < length) {
+                rolling.roll(data[position], data[position + blockSize]);
+            }
+            position++;
+            continue;
+        }
+
+        if (copyAt != std::string::npos && literalStart == position && static_cast<uint32_t>(block) == nextBlock) {
+            // Extends the previous copy
+            uint32_t countBE;
+            std::memcpy(&countBE, &out[copyAt], 4);
+            countBE = htobe32(be32toh(countBE) + 1);
+            std::memcpy(&out[copyAt], &countBE, 4);
+        } else {
+            putLiteral(literalStart, position);
+            out += opCopy;
+            putU32(static_cast<uint32_t>(block));
+            copyAt = out.size();
+            putU32(1);
+        }
+        nextBlock = static_cast<uint32_t>(block) + 1;
+        position += blockSize;
+        literalStart = position;
+        if (position + blockSize <= length) {
+            rolling.reset(data + position, blockSize);
+        }
+    }
+    putLiteral(literalStart, length);
+}
+
+} // namespace delta
@@ -0,0 +1,84 @@
+#pragma once
+
+// Whole-file digests off the worker loops. The first DIGEST (or checksummed
+// BATCH) for a file version has to read the whole file, which would stall
+// every other connection on that worker loop for as long as the read takes.
+// Instead, the request stays buffered while a helper thread computes the
+// digest, and the connection is resumed once it is cached. Files are
+// digested one at a time, in the order they were asked for.
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include "file_cache.h"
+#include "admission.h"
+
+class DigestWorker {
+public:
+    // Called on the helper thread once the digest for ticket's request is
+    // cached (or failed; the request then reports the error itself).
+    using Done = std::function<void(const AdmissionControl::Ticket&)>;
+
+private:
+    struct Job {
+        std::shared_ptr<const CachedFile> file;
+        AdmissionControl::Ticket ticket;
+    };
+
+    bool dropCache;
+    Done done;
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::thread thread;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        while (true) {
+            jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            try {
+                job.file->digest(dropCache);
+            } catch (const std::exception&) {
+                // Retried, and reported, when the request is answered
+            }
+            done(job.ticket);
+            job.file.reset();
+            lock.lock();
+        }
+    }
+
+public:
+    DigestWorker(bool dropCache, Done done)
+        : dropCache(dropCache), done(std::move(done)), thread(&DigestWorker::run, this) {}
+
+    // Waits for the digest in progress; queued ones are dropped.
+    ~DigestWorker() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobReady.notify_one();
+        thread.join();
+    }
+
+    DigestWorker(const DigestWorker&) = delete;
+    DigestWorker& operator=(const DigestWorker&) = delete;
+
+    void submit(std::shared_ptr<const CachedFile> file, const AdmissionControl::Ticket& ticket) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobs.push_back(Job{std::move(file), ticket});
+        }
+        jobReady.notify_one();
+    }
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "crc32c.h"
+#include "compression.h"
+
+// An open, read-only file pinned at one on-disk version. Connections hold a
+// shared_ptr for the lifetime of a transfer, so evicting or invalidating the
+// cache entry never closes a descriptor that is still being sent from.
+struct CachedFile {
+    std::string path;
+    int fd = -1;
+    uint64_t size = 0;
+    dev_t device = 0;
+    ino_t inode = 0;
+    int64_t mtimeNs = 0;
+
+    mutable std::once_flag digestOnce;
+    mutable uint32_t digestValue = 0;
+    mutable std::atomic<bool> digestDone{false};
+    mutable compression::Sampler compression;  // Whether this version's chunks compress
+
+    mutable std::once_flag mapOnce;
+    mutable const char* mapping = nullptr;
+
+    mutable std::once_flag directOnce;
+    mutable int directFd = -1;
+
+    ~CachedFile() {
+        if (mapping) {
+            munmap(const_cast<char*>(mapping), size);
+        }
+        if (directFd >= 0) {
+            close(directFd);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Identifies this version of the file; sent to clients so they can tell
+    // whether two segments were read from the same contents.
+    std::string version() const {
+        return versionString(inode, size, mtimeNs);
+    }
+
+    // CRC32C of the whole file, computed on first use and then kept for as
+    // long as this version stays cached. With dropCache the pages read for
+    // it are evicted again afterwards. The first call reads the whole file;
+    // the server makes it on a DigestWorker thread, never on a worker loop.
+    uint32_t digest(bool dropCache = false) const {
+        std::call_once(digestOnce, [this, dropCache] {
+            digestValue = crc32c::ofFile(fd, 0, size);
+            if (dropCache) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+            digestDone.store(true, std::memory_order_release);
+        });
+        return digestValue;
+    }
+
+    // Whether digest() would return at once.
+    bool hasDigest() const {
+        return digestDone.load(std::memory_order_acquire);
+    }
+
+    // The whole file mapped read-only, created on first use and shared by
+    // every connection sending this version. nullptr if it cannot be mapped.
+    const char* mapped() const {
+        std::call_once(mapOnce, [this] {
+            if (size == 0) {
+                return;
+            }
+            void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (address != MAP_FAILED) {
+                mapping = static_cast<const char*>(address);
+            }
+        });
+        return mapping;
+    }
+
+    // A second descriptor for this version opened with O_DIRECT, so reads
+    // bypass the page cache; opened on first use. Reopened through
+    // /proc/self/fd because the path may name a newer version by now. -1 if
+    // the file system does not support O_DIRECT. Reads through it need
+    // aligned buffers, offsets and lengths (BufferPool::alignment).
+    int direct() const {
+        std::call_once(directOnce, [this] {
+            std::string self = "/proc/self/fd/" + std::to_string(fd);
+            directFd = open(self.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+        });
+        return directFd;
+    }
+
+    // Starts reading [position, position + length) into the page cache
+    // without waiting for it. Every connection shares this descriptor and
+    // therefore its readahead state, so the kernel's sequential heuristics
+    // see interleaved offsets from many connections and give up; an
+    // explicit hint per window keeps the next reads resident.
+    void prefetch(uint64_t position, uint64_t length) const {
+        length = std::min(length, size - std::min(position, size));
+        if (length == 0) {
+            return;
+        }
+        if (mapping) {
+            uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            uint64_t start = position / page * page;
+            madvise(const_cast<char*>(mapping) + start, position + length - start, MADV_WILLNEED);
+        } else {
+            posix_fadvise(fd, static_cast<off_t>(position), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+        }
+    }
+
+    bool matches(const struct stat& st) const {
+        return st.st_dev == device && st.st_ino == inode &&
+               static_cast<uint64_t>(st.st_size) == size && mtimeOf(st) == mtimeNs;
+    }
+
+    static int64_t mtimeOf(const struct stat& st) {
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    // The version a file with these attributes gets once opened, for
+    // listings that only stat it.
+    static std::string versionOf(const struct stat& st) {
+        return versionString(st.st_ino, static_cast<uint64_t>(st.st_size), mtimeOf(st));
+    }
+
+    static std::string versionString(ino_t inode, uint64_t size, int64_t mtimeNs) {
+        return std::to_string(inode) + "-" + std::to_string(size) + "-" + std::to_string(mtimeNs);
+    }
+};
+
+// Refcounted cache of open descriptors and metadata keyed by filename, with
+// LRU eviction once more than maxOpenFiles entries are cached. Every lookup
+// revalidates with a single stat(); a changed inode, size or mtime replaces
+// the entry so new transfers see the new version while transfers already in
+// flight keep reading the version they started with.
+class FileCache {
+private:
+    struct Entry {
+        std::shared_ptr<const CachedFile> file;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    std::mutex cacheMutex;
+    size_t maxOpenFiles;
+    std::list<std::string> lru;  // Most recently used first
+    std::unordered_map<std::string, Entry> entries;
+
+    static std::shared_ptr<const CachedFile> openFile(const std::string& path) {
+        auto file = std::make_shared<CachedFile>();
+        file->path = path;
+        file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file->fd < 0) {
+            throw std::runtime_error("Requested file not found: " + path);
+        }
+
+        struct stat st;
+        if (fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            throw std::runtime_error("Requested path is not a regular file: " + path);
+        }
+
+        file->size = static_cast<uint64_t>(st.st_size);
+        file->device = st.st_dev;
+        file->inode = st.st_ino;
+        file->mtimeNs = CachedFile::mtimeOf(st);
+        return file;
+    }
+
+    void evictExcess() {
+        while (entries.size() > maxOpenFiles && !lru.empty()) {
+            entries.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+public:
+    explicit FileCache(size_t maxOpenFiles = 256) : maxOpenFiles(maxOpenFiles > 0 ? maxOpenFiles : 1) {}
+
+    std::shared_ptr<const CachedFile> acquire(const std::string& path) {
+        struct stat st;
+        bool exists = stat(path.c_str(), &st) == 0;
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            if (exists && it->second.file->matches(st)) {
+                lru.splice(lru.begin(), lru, it->second.lruPosition);
+                return it->second.file;
+            }
+            lru.erase(it->second.lruPosition);
+            entries.erase(it);
+        }
+
+        if (!exists) {
+            throw std::runtime_error("Requested file not found: " + path);
+        }
+
+        auto file = openFile(path);
+        lru.push_front(path);
+        entries.emplace(path, Entry{file, lru.begin()});
+        evictExcess();
+        return file;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        return entries.size();
+    }
+};
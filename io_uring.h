@@ -0,0 +1,233 @@
+#pragma once
+
+// Thin io_uring wrapper over the raw system calls (no liburing): ring setup
+// and mapping, submission/completion queue access, and a pool of buffers
+// registered with the ring so file writes can use IORING_OP_WRITE_FIXED.
+// Creating a ring throws std::system_error on kernels without io_uring,
+// which callers take as the signal to use their blocking path.
+
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+class IoUring {
+private:
+    int ringFd = -1;
+
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    unsigned localTail = 0;  // SQEs prepared but not yet published
+    unsigned unsubmitted = 0;
+
+    template <typename T>
+    static T* at(void* base, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    void unmap() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0) {
+            close(ringFd);
+        }
+    }
+
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CLAMP;
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd < 0) {
+            throw std::system_error(errno, std::system_category(), "io_uring_setup failed");
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                      IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            int error = errno;
+            unmap();
+            throw std::system_error(error, std::system_category(), "io_uring SQ mmap failed");
+        }
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                               ringFd, IORING_OFF_SQES));
+        if (cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            int error = errno;
+            unmap();
+            throw std::system_error(error, std::system_category(), "io_uring mmap failed");
+        }
+
+        sqHead = at<unsigned>(sqRing, params.sq_off.head);
+        sqTail = at<unsigned>(sqRing, params.sq_off.tail);
+        sqMask = *at<unsigned>(sqRing, params.sq_off.ring_mask);
+        sqEntries = *at<unsigned>(sqRing, params.sq_off.ring_entries);
+        sqArray = at<unsigned>(sqRing, params.sq_off.array);
+        cqHead = at<unsigned>(cqRing, params.cq_off.head);
+        cqTail = at<unsigned>(cqRing, params.cq_off.tail);
+        cqMask = *at<unsigned>(cqRing, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cqRing, params.cq_off.cqes);
+        localTail = *sqTail;
+    }
+
+    ~IoUring() {
+        unmap();
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Next free submission entry, zeroed; submits what is queued first if
+    // the ring is full.
+    io_uring_sqe* prepare() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (localTail - head >= sqEntries) {
+            submit(0);
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (localTail - head >= sqEntries) {
+                throw std::runtime_error("io_uring submission queue full");
+            }
+        }
+        unsigned index = localTail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        localTail++;
+        unsubmitted++;
+        return sqe;
+    }
+
+    // Publishes prepared entries and, if waitFor > 0, blocks until that
+    // many completions are available.
+    void submit(unsigned waitFor) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (true) {
+            long result = syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor, flags, nullptr, 0);
+            if (result >= 0) {
+                unsubmitted -= static_cast<unsigned>(result);
+                return;
+            }
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::system_category(), "io_uring_enter failed");
+            }
+        }
+    }
+
+    // Takes the next completion if there is one.
+    bool next(io_uring_cqe& completion) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        completion = cqes[head & cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void registerBuffers(const std::vector<iovec>& buffers) {
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, buffers.data(),
+                    static_cast<unsigned>(buffers.size())) != 0) {
+            throw std::system_error(errno, std::system_category(), "io_uring buffer registration failed");
+        }
+    }
+};
+
+// Fixed-size, page-aligned buffers carved from one allocation and
+// registered with a ring; a buffer's index is its registered index.
+class RegisteredBufferPool {
+private:
+    char* memory = nullptr;
+    size_t bufferSize;
+    std::vector<int> freeList;
+
+public:
+    RegisteredBufferPool(IoUring& ring, size_t count, size_t bufferSize) : bufferSize(bufferSize) {
+        if (posix_memalign(reinterpret_cast<void**>(&memory), 4096, count * bufferSize) != 0) {
+            throw std::bad_alloc();
+        }
+        std::vector<iovec> buffers(count);
+        for (size_t i = 0; i < count; ++i) {
+            buffers[i].iov_base = memory + i * bufferSize;
+            buffers[i].iov_len = bufferSize;
+            freeList.push_back(static_cast<int>(count - 1 - i));
+        }
+        try {
+            ring.registerBuffers(buffers);
+        } catch (...) {
+            std::free(memory);
+            throw;
+        }
+    }
+
+    ~RegisteredBufferPool() {
+        std::free(memory);
+    }
+
+    RegisteredBufferPool(const RegisteredBufferPool&) = delete;
+    RegisteredBufferPool& operator=(const RegisteredBufferPool&) = delete;
+
+    // Returns -1 when every buffer is in use.
+    int acquire() {
+        if (freeList.empty()) {
+            return -1;
+        }
+        int index = freeList.back();
+        freeList.pop_back();
+        return index;
+    }
+
+    void release(int index) {
+        freeList.push_back(index);
+    }
+
+    char* data(int index) {
+        return memory + static_cast<size_t>(index) * bufferSize;
+    }
+
+    size_t size() const {
+        return bufferSize;
+    }
+};
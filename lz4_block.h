@@ -0,0 +1,200 @@
+#pragma once
+
+// Minimal codec for the LZ4 block format, used to compress chunks on the
+// wire. Output is readable by any LZ4 block decoder; the decoder here
+// checks every length and offset, since its input comes off the network.
+// The compressor is the classic single-probe hash search: fast rather than
+// thorough, which is what a per-chunk link compressor wants.
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace lz4 {
+namespace detail {
+
+constexpr int hashLog = 12;
+constexpr size_t minMatch = 4;
+constexpr size_t lastLiterals = 5;    // The block always ends with literals
+constexpr size_t matchSearchEnd = 12; // No match may start this close to the end
+constexpr size_t maxOffset = 65535;
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, 4);
+    return value;
+}
+
+inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - hashLog);
+}
+
+inline void putLength(std::string& out, size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline void putSequence(std::string& out, const uint8_t* literals, size_t literalLength,
+                        size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength - minMatch;
+    uint8_t token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4 |
+                                         (matchCode < 15 ? matchCode : 15));
+    out.push_back(static_cast<char>(token));
+    if (literalLength >= 15) {
+        putLength(out, literalLength - 15);
+    }
+    out.append(reinterpret_cast<const char*>(literals), literalLength);
+    out.push_back(static_cast<char>(offset & 0xFF));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15) {
+        putLength(out, matchCode - 15);
+    }
+}
+
+inline void putLastLiterals(std::string& out, const uint8_t* literals, size_t literalLength) {
+    out.push_back(static_cast<char>((literalLength < 15 ? literalLength : 15) << 4));
+    if (literalLength >= 15) {
+        putLength(out, literalLength - 15);
+    }
+    out.append(reinterpret_cast<const char*>(literals), literalLength);
+}
+
+} // namespace detail
+
+// Largest block compress() can produce for length input bytes.
+inline size_t bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+// Appends the compressed form of [data, data + length) to out.
+inline void compress(const char* data, size_t length, std::string& out) {
+    using namespace detail;
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+    out.reserve(out.size() + bound(length));
+
+    size_t anchor = 0;
+    if (length > matchSearchEnd) {
+        uint32_t table[1 << hashLog];
+        std::memset(table, 0, sizeof(table));
+
+        size_t limit = length - matchSearchEnd;
+        size_t matchEnd = length - lastLiterals;
+        size_t position = 1;
+        table[hash(read32(src))] = 0;
+        while (position < limit) {
+            uint32_t sequence = read32(src + position);
+            uint32_t slot = hash(sequence);
+            size_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(position);
+
+            if (candidate >= position || position - candidate > maxOffset || read32(src + candidate) != sequence) {
+                // Step faster through data that keeps missing
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+
+            while (position > anchor && candidate > 0 && src[position - 1] == src[candidate - 1]) {
+                --position;
+                --candidate;
+            }
+            size_t matchLength = minMatch;
+            while (position + matchLength + 8 <= matchEnd) {
+                uint64_t ahead;
+                uint64_t behind;
+                std::memcpy(&ahead, src + position + matchLength, 8);
+                std::memcpy(&behind, src + candidate + matchLength, 8);
+                if (ahead != behind) {
+                    matchLength += static_cast<size_t>(__builtin_ctzll(ahead ^ behind)) / 8;
+                    break;
+                }
+                matchLength += 8;
+            }
+            while (position + matchLength < matchEnd && src[position + matchLength] == src[candidate + matchLength]) {
+                ++matchLength;
+            }
+
+            putSequence(out, src + anchor, position - anchor, position - candidate, matchLength);
+            position += matchLength;
+            anchor = position;
+            if (position < limit) {
+                table[hash(read32(src + position - 2))] = static_cast<uint32_t>(position - 2);
+            }
+        }
+    }
+    putLastLiterals(out, src + anchor, length - anchor);
+}
+
+// Decompresses a block that must expand to exactly rawLength bytes into
+// out (which must have room for them). Throws on malformed input.
+inline void decompress(const char* data, size_t length, char* out, size_t rawLength) {
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* inEnd = in + length;
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+    uint8_t* dstEnd = dst + rawLength;
+
+    auto readLength = [&](size_t value) {
+        if (value != 15) {
+            return value;
+        }
+        uint8_t next;
+        do {
+            if (in == inEnd) {
+                throw std::runtime_error("Truncated compressed block");
+            }
+            next = *in++;
+            value += next;
+        } while (next == 255);
+        return value;
+    };
+
+    while (true) {
+        if (in == inEnd) {
+            throw std::runtime_error("Truncated compressed block");
+        }
+        uint8_t token = *in++;
+
+        size_t literalLength = readLength(token >> 4);
+        if (literalLength > static_cast<size_t>(inEnd - in) || literalLength > static_cast<size_t>(dstEnd - dst)) {
+            throw std::runtime_error("Corrupt compressed block (literals)");
+        }
+        std::memcpy(dst, in, literalLength);
+        in += literalLength;
+        dst += literalLength;
+        if (in == inEnd) {
+            break;  // Final sequence has no match
+        }
+
+        if (inEnd - in < 2) {
+            throw std::runtime_error("Truncated compressed block");
+        }
+        size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        size_t matchLength = readLength(token & 0x0F) + detail::minMatch;
+        if (offset == 0 || offset > static_cast<size_t>(dst - reinterpret_cast<uint8_t*>(out)) ||
+            matchLength > static_cast<size_t>(dstEnd - dst)) {
+            throw std::runtime_error("Corrupt compressed block (match)");
+        }
+
+        const uint8_t* match = dst - offset;
+        if (offset >= matchLength) {
+            std::memcpy(dst, match, matchLength);
+            dst += matchLength;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < matchLength; ++i) {
+                *dst++ = *match++;
+            }
+        }
+    }
+
+    if (dst != dstEnd) {
+        throw std::runtime_error("Compressed block has the wrong length");
+    }
+}
+
+} // namespace lz4
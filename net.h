@@ -0,0 +1,138 @@
+#pragma once
+
+// POSIX socket layer shared by the server and the client.
+
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using socket_t = int;
+constexpr socket_t INVALID_SOCKET_FD = -1;
+
+namespace net {
+
+inline int lastError() {
+    return errno;
+}
+
+inline std::system_error socketError(const char* what) {
+    return std::system_error(lastError(), std::system_category(), what);
+}
+
+inline bool wouldBlock(int error) {
+    return error == EAGAIN || error == EWOULDBLOCK;
+}
+
+inline void closeSocket(socket_t fd) {
+    if (fd != INVALID_SOCKET_FD) {
+        ::close(fd);
+    }
+}
+
+inline void setNonBlocking(socket_t fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw socketError("fcntl(O_NONBLOCK) failed");
+    }
+}
+
+inline void setNoDelay(socket_t fd) {
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+inline void setTimeouts(socket_t fd, int milliseconds) {
+    timeval tv;
+    tv.tv_sec = milliseconds / 1000;
+    tv.tv_usec = (milliseconds % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Creates a non-blocking listening socket. With reusePort set, every caller
+// gets its own socket on the same port and the kernel balances accepts
+// between them; returns INVALID_SOCKET_FD if SO_REUSEPORT is unavailable.
+inline socket_t listenOn(int port, bool reusePort) {
+    socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == INVALID_SOCKET_FD) {
+        throw socketError("Socket creation failed");
+    }
+
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
+        closeSocket(fd);
+        return INVALID_SOCKET_FD;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int error = lastError();
+        closeSocket(fd);
+        throw std::system_error(error, std::system_category(), "Bind failed");
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        int error = lastError();
+        closeSocket(fd);
+        throw std::system_error(error, std::system_category(), "Listen failed");
+    }
+
+    return fd;
+}
+
+// Opens a blocking TCP connection to ip:port.
+inline socket_t connectTo(const std::string& ip, int port) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
+        throw std::runtime_error("Invalid address: " + ip);
+    }
+
+    socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == INVALID_SOCKET_FD) {
+        throw socketError("Could not create socket");
+    }
+
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int error = lastError();
+        closeSocket(fd);
+        throw std::system_error(error, std::system_category(), "Connection failed");
+    }
+
+    return fd;
+}
+
+// Sends the whole buffer on a blocking socket.
+inline void sendAll(socket_t fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (lastError() == EINTR) {
+                continue;
+            }
+            throw socketError("Send failed");
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+}
+
+} // namespace net
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <system_error>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "buffer_pool.h"
+#include "phase_trace.h"
+
+// Background merge stage for --parts downloads. A part is handed over as
+// soon as its range is finished and is placed at its offset in the output
+// file while the other ranges are still downloading. The copy uses
+// copy_file_range, so the bytes stay in the kernel (and file systems with
+// reflinks share the extents instead of copying them); where it is not
+// supported the stage falls back to pread/pwrite through a pooled buffer.
+// With verify set, each merged piece of the output is hashed right after
+// it is placed, and digest() joins the pieces' CRCs into the whole file's
+// without reading it again.
+class PartMerger {
+public:
+    struct Piece {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        uint32_t crc = 0;
+    };
+
+private:
+    struct Job {
+        std::string path;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+    };
+
+    int outputFd;
+    bool verify;
+    BufferPool& buffers;
+    PhaseTimer& phases;
+    uint64_t track;  // Trace track of the merge stage
+
+    std::mutex mergeMutex;
+    std::condition_variable jobReady;
+    std::deque<Job> jobs;
+    bool closing = false;
+    std::exception_ptr error;
+    std::vector<Piece> pieces;
+    uint64_t mergedBytes = 0;
+    bool copyFileRange = true;  // Cleared once the kernel or file system refuses it
+    std::thread worker;
+
+    // Copies with copy_file_range; returns the bytes copied before it was
+    // refused, or throws on a real I/O error.
+    uint64_t copyInKernel(int partFd, uint64_t offset, uint64_t length) {
+        loff_t in = 0;
+        loff_t out = static_cast<loff_t>(offset);
+        while (static_cast<uint64_t>(in) < length) {
+            ssize_t copied = copy_file_range(partFd, &in, outputFd, &out, length - static_cast<uint64_t>(in), 0);
+            if (copied < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                    copyFileRange = false;
+                    break;
+                }
+                throw std::system_error(errno, std::system_category(), "copy_file_range failed");
+            }
+            if (copied == 0) {
+                throw std::runtime_error("Part file ended early");
+            }
+        }
+        return static_cast<uint64_t>(in);
+    }
+
+    void copyThroughBuffer(int partFd, uint64_t done, uint64_t offset, uint64_t length) {
+        BufferPool::Buffer buffer = buffers.acquire();
+        while (done < length) {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length - done));
+            ssize_t bytesRead = pread(partFd, buffer.data(), chunk, static_cast<off_t>(done));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "Part read failed");
+            }
+            if (bytesRead == 0) {
+                throw std::runtime_error("Part file ended early");
+            }
+            size_t written = 0;
+            while (written < static_cast<size_t>(bytesRead)) {
+                ssize_t result = pwrite(outputFd, buffer.data() + written, static_cast<size_t>(bytesRead) - written,
+                                        static_cast<off_t>(offset + done + written));
+                if (result < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "Merge write failed");
+                }
+                written += static_cast<size_t>(result);
+            }
+            done += static_cast<uint64_t>(bytesRead);
+        }
+    }
+
+    void merge(const Job& job) {
+        auto begin = phases.now();
+        int partFd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (partFd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot open part file: " + job.path);
+        }
+        try {
+            uint64_t done = copyFileRange ? copyInKernel(partFd, job.offset, job.length) : 0;
+            copyThroughBuffer(partFd, done, job.offset, job.length);
+        } catch (...) {
+            close(partFd);
+            throw;
+        }
+        close(partFd);
+
+        Piece piece{job.offset, job.length, 0};
+        if (verify) {
+            piece.crc = crc32c::ofFile(outputFd, job.offset, job.length);
+        }
+        std::remove(job.path.c_str());
+        phases.record(Phase::Merge, track, begin, job.length);
+
+        std::lock_guard<std::mutex> lock(mergeMutex);
+        pieces.push_back(piece);
+        mergedBytes += job.length;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mergeMutex);
+        while (true) {
+            jobReady.wait(lock, [this] { return closing || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            if (error) {
+                continue;  // Leaves the part file for inspection
+            }
+            lock.unlock();
+            try {
+                merge(job);
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                continue;
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    PartMerger(int outputFd, bool verify, BufferPool& buffers, PhaseTimer& phases, uint64_t track)
+        : outputFd(outputFd), verify(verify), buffers(buffers), phases(phases), track(track),
+          worker(&PartMerger::run, this) {}
+
+    ~PartMerger() {
+        try {
+            finish();
+        } catch (const std::exception&) {
+            // Reported by the caller's own finish()
+        }
+    }
+
+    PartMerger(const PartMerger&) = delete;
+    PartMerger& operator=(const PartMerger&) = delete;
+
+    // Queues [0, length) of the part file for offset in the output. The
+    // part is deleted once it has been merged. Empty parts are only deleted.
+    void submit(const std::string& path, uint64_t offset, uint64_t length) {
+        if (length == 0) {
+            std::remove(path.c_str());
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            jobs.push_back(Job{path, offset, length});
+        }
+        jobReady.notify_one();
+    }
+
+    // Waits for the queued parts and stops the stage. Rethrows the first
+    // merge error.
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            closing = true;
+        }
+        jobReady.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        if (error) {
+            std::exception_ptr first = error;
+            error = nullptr;
+            std::rethrow_exception(first);
+        }
+    }
+
+    uint64_t merged() {
+        std::lock_guard<std::mutex> lock(mergeMutex);
+        return mergedBytes;
+    }
+
+    // Whether every part went through copy_file_range. Call after finish().
+    bool usedCopyFileRange() const {
+        return copyFileRange;
+    }
+
+    // CRC32C of [0, fileSize) from the merged pieces. Call after finish();
+    // throws if the pieces leave a gap.
+    uint32_t digest(uint64_t fileSize) {
+        std::sort(pieces.begin(), pieces.end(), [](const Piece& a, const Piece& b) { return a.offset < b.offset; });
+        uint32_t crc = 0;
+        uint64_t position = 0;
+        for (const Piece& piece : pieces) {
+            if (piece.offset != position) {
+                throw std::runtime_error("Merged parts leave a gap at byte " + std::to_string(position));
+            }
+            crc = crc32c::combine(crc, piece.crc, piece.length);
+            position += piece.length;
+        }
+        if (position != fileSize) {
+            throw std::runtime_error("Merged parts end at byte " + std::to_string(position));
+        }
+        return crc;
+    }
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+// Where the time of a transfer goes, on either side. Each phase (connect,
+// request round trip, disk read, socket stall, merge, ...) has a latency
+// histogram, and every timed interval can also go to a Chrome trace file
+// (chrome://tracing or ui.perfetto.dev) with one row per connection, which
+// makes stragglers and stalls easy to spot. Instrumentation is off unless
+// asked for: a disabled PhaseTimer costs one branch per call site and never
+// reads the clock.
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+enum class Phase {
+    Connect,   // Client: TCP connect, including retries
+    Open,      // Client: OPEN round trip on a new connection
+    Request,   // Client: READ sent until its response header arrives
+    Receive,   // Client: response data received and written
+    Write,     // Client: one write of received data to disk
+    Merge,     // Client: one part placed in the output file and hashed
+    Verify,    // Client: whole-file digest check
+    Queue,     // Server: request waiting for a transfer slot
+    Prepare,   // Server: request parsed and its response built
+    Read,      // Server: one disk read into a send buffer
+    Send,      // Server: response from its first to its last byte
+    Stall,     // Server: response waiting for socket buffer space
+    Throttle,  // Server: response held back by the bandwidth limits
+    Count
+};
+
+inline const char* phaseName(Phase phase) {
+    static const char* const names[] = {"connect", "open", "request", "receive", "write", "merge", "verify",
+                                        "queue", "prepare", "read", "send", "stall", "throttle"};
+    return names[static_cast<int>(phase)];
+}
+
+// Log-linear histogram of nanosecond values in the style of HdrHistogram:
+// every power of two is split into 32 linear sub-buckets, so a recorded
+// value is known to within about 3% from 1 ns to about 18 minutes (larger
+// values land in the last bucket). Recording is a few relaxed atomic adds.
+class LatencyHistogram {
+private:
+    static constexpr unsigned subBits = 5;
+    static constexpr uint64_t subBuckets = 1u << subBits;
+    static constexpr unsigned maxMagnitude = 40;
+    static constexpr size_t bucketCount = (maxMagnitude - subBits + 2) * subBuckets;
+
+    std::atomic<uint64_t> counts[bucketCount] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> maximum{0};
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < subBuckets) {
+            return static_cast<size_t>(value);
+        }
+        unsigned magnitude = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        if (magnitude > maxMagnitude) {
+            return bucketCount - 1;
+        }
+        unsigned shift = magnitude - subBits;
+        return (magnitude - subBits + 1) * subBuckets + static_cast<size_t>((value >> shift) - subBuckets);
+    }
+
+    // Largest value that falls in the bucket
+    static uint64_t highestIn(size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+        unsigned shift = static_cast<unsigned>(bucket / subBuckets) - 1;
+        uint64_t lowest = (subBuckets + bucket % subBuckets) << shift;
+        return lowest + (1ull << shift) - 1;
+    }
+
+public:
+    void record(uint64_t nanoseconds) {
+        counts[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+        uint64_t previous = maximum.load(std::memory_order_relaxed);
+        while (nanoseconds > previous &&
+               !maximum.compare_exchange_weak(previous, nanoseconds, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return maximum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t mean() const {
+        uint64_t n = count();
+        return n > 0 ? sum.load(std::memory_order_relaxed) / n : 0;
+    }
+
+    // Smallest value at or above the given fraction of the recorded values
+    uint64_t percentile(double fraction) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * n + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(highestIn(i), max());
+            }
+        }
+        return max();
+    }
+};
+
+class PhaseTimer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        bool histograms = false;  // Keep histograms and print them in report()
+        std::string tracePath;    // Also write a Chrome trace here
+    };
+
+private:
+    struct Event {
+        Phase phase;
+        uint64_t track;
+        int64_t beginNs;
+        int64_t durationNs;
+        uint64_t bytes;
+    };
+
+    static constexpr size_t maxTraceEvents = 2 * 1024 * 1024;
+
+    bool enabledFlag;
+    Options options;
+    Clock::time_point origin = Clock::now();
+    LatencyHistogram histograms[static_cast<int>(Phase::Count)];
+
+    std::mutex traceMutex;
+    std::vector<Event> events;
+    std::vector<std::pair<uint64_t, std::string>> trackNames;
+    uint64_t dropped = 0;
+
+    static std::string escape(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out;
+    }
+
+public:
+    PhaseTimer() : PhaseTimer(Options()) {}
+
+    explicit PhaseTimer(const Options& options)
+        : enabledFlag(options.histograms || !options.tracePath.empty()), options(options) {}
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    bool enabled() const {
+        return enabledFlag;
+    }
+
+    bool tracing() const {
+        return !options.tracePath.empty();
+    }
+
+    // Start of an interval; the epoch when disabled, so callers can time
+    // unconditionally and let record() drop it.
+    Clock::time_point now() const {
+        return enabledFlag ? Clock::now() : Clock::time_point();
+    }
+
+    // Records [begin, now) for phase on the given track (a connection or
+    // stream). bytes, if known, is shown with the trace event.
+    void record(Phase phase, uint64_t track, Clock::time_point begin, uint64_t bytes = 0) {
+        if (!enabledFlag) {
+            return;
+        }
+        auto end = Clock::now();
+        int64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        histograms[static_cast<int>(phase)].record(static_cast<uint64_t>(std::max<int64_t>(0, duration)));
+        if (!tracing()) {
+            return;
+        }
+        int64_t beginNs = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - origin).count();
+        std::lock_guard<std::mutex> lock(traceMutex);
+        if (events.size() >= maxTraceEvents) {
+            dropped++;
+            return;
+        }
+        events.push_back(Event{phase, track, beginNs, duration, bytes});
+    }
+
+    // Labels a track in the trace, e.g. "stream 3" or "connection 17".
+    void nameTrack(uint64_t track, const std::string& name) {
+        if (!tracing()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(traceMutex);
+        trackNames.emplace_back(track, name);
+    }
+
+    // One line per phase that was timed: count and latency percentiles.
+    void report(std::ostream& out) const {
+        if (!options.histograms) {
+            return;
+        }
+        auto micros = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+        out << "Phase latency (us)     count        p50        p90        p99        max       mean\n";
+        for (int i = 0; i < static_cast<int>(Phase::Count); ++i) {
+            const LatencyHistogram& h = histograms[i];
+            if (h.count() == 0) {
+                continue;
+            }
+            out << std::left << std::setw(18) << phaseName(static_cast<Phase>(i)) << std::right
+                << std::setw(10) << h.count() << std::fixed << std::setprecision(1)
+                << std::setw(11) << micros(h.percentile(0.50)) << std::setw(11) << micros(h.percentile(0.90))
+                << std::setw(11) << micros(h.percentile(0.99)) << std::setw(11) << micros(h.max())
+                << std::setw(11) << micros(h.mean()) << "\n";
+        }
+        out << std::flush;
+    }
+
+    // Writes the trace in Chrome's JSON trace event format: one complete
+    // ("X") event per interval, timestamps in microseconds since start.
+    void writeTrace() {
+        if (!tracing()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(traceMutex);
+        std::ofstream out(options.tracePath, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write trace " + options.tracePath);
+        }
+        long pid = static_cast<long>(getpid());
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for (const auto& track : trackNames) {
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                << ",\"tid\":" << track.first << ",\"args\":{\"name\":\"" << escape(track.second) << "\"}}";
+            first = false;
+        }
+        char timing[64];
+        for (const Event& event : events) {
+            std::snprintf(timing, sizeof(timing), "\"ts\":%.3f,\"dur\":%.3f", event.beginNs / 1000.0,
+                          event.durationNs / 1000.0);
+            out << (first ? "" : ",\n") << "{\"name\":\"" << phaseName(event.phase) << "\",\"ph\":\"X\",\"pid\":"
+                << pid << ",\"tid\":" << event.track << "," << timing;
+            if (event.bytes > 0) {
+                out << ",\"args\":{\"bytes\":" << event.bytes << "}";
+            }
+            out << "}";
+            first = false;
+        }
+        out << "\n]}\n";
+        if (!out) {
+            throw std::runtime_error("Cannot write trace " + options.tracePath);
+        }
+        std::cout << "Trace of " << events.size() << " interval(s) written to " << options.tracePath;
+        if (dropped > 0) {
+            std::cout << " (" << dropped << " dropped past the first " << maxTraceEvents << ")";
+        }
+        std::cout << std::endl;
+    }
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+// Response preparation off the worker loops. A checksummed, compressed or
+// DELTA response has to read and process its whole range (up to 16 MB)
+// before its header can go out, which would stall every other connection
+// on the worker loop meanwhile. Such requests are built by a fixed set of
+// helper threads instead, and the connection is resumed with the finished
+// response. Jobs run in the order they were submitted.
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+class PreparePool {
+public:
+    using Job = std::function<void()>;
+
+private:
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        while (true) {
+            jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            job = nullptr;
+            lock.lock();
+        }
+    }
+
+public:
+    // threadCount <= 0 starts one thread per core.
+    explicit PreparePool(int threadCount) {
+        if (threadCount <= 0) {
+            threadCount = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        for (int i = 0; i < threadCount; ++i) {
+            threads.emplace_back(&PreparePool::run, this);
+        }
+    }
+
+    // Waits for the jobs in progress; queued ones are dropped.
+    ~PreparePool() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    PreparePool(const PreparePool&) = delete;
+    PreparePool& operator=(const PreparePool&) = delete;
+
+    // The job must not throw.
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobs.push_back(std::move(job));
+        }
+        jobReady.notify_one();
+    }
+};
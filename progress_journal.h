@@ -0,0 +1,168 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Sidecar file next to a direct-write download recording which byte ranges
+// of the output are known to be on disk. The first line is the fingerprint
+// ("FILE <size> <server version>"); every following line is "begin end". A
+// range is only appended after the data it covers has been flushed, so an
+// interrupted download says exactly which bytes are usable, and a restarted
+// client with the same fingerprint only fetches what is missing.
+class ProgressJournal {
+public:
+    struct ByteRange {
+        uint64_t begin = 0;
+        uint64_t end = 0;
+    };
+
+private:
+    std::mutex journalMutex;
+    std::string path;
+    int fd = -1;
+
+    static void writeAll(int fd, const std::string& line) {
+        const char* data = line.data();
+        size_t length = line.size();
+        while (length > 0) {
+            ssize_t written = write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "Journal write failed");
+            }
+            data += written;
+            length -= static_cast<size_t>(written);
+        }
+    }
+
+    static std::string fingerprint(uint64_t fileSize, const std::string& version) {
+        return "FILE " + std::to_string(fileSize) + " " + version;
+    }
+
+public:
+    // Starts a journal holding the given durable ranges. The compacted
+    // contents go to a temporary file that is renamed over the old journal,
+    // so a crash here leaves either the old or the new journal intact.
+    ProgressJournal(const std::string& path, uint64_t fileSize, const std::string& version,
+                    const std::vector<ByteRange>& durable = {})
+        : path(path) {
+        std::string contents = fingerprint(fileSize, version) + "\n";
+        for (const ByteRange& range : durable) {
+            contents += std::to_string(range.begin) + " " + std::to_string(range.end) + "\n";
+        }
+
+        std::string tempPath = path + ".tmp";
+        int tempFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (tempFd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot create journal " + tempPath);
+        }
+        try {
+            writeAll(tempFd, contents);
+        } catch (...) {
+            close(tempFd);
+            throw;
+        }
+        fdatasync(tempFd);
+        close(tempFd);
+
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot replace journal " + path);
+        }
+
+        fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category(), "Cannot open journal " + path);
+        }
+    }
+
+    ~ProgressJournal() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    ProgressJournal(const ProgressJournal&) = delete;
+    ProgressJournal& operator=(const ProgressJournal&) = delete;
+
+    // Reads the durable ranges of an earlier run, merged and sorted. Returns
+    // false when there is no journal or it was written for a different file
+    // size or server version. A torn final line is ignored.
+    static bool load(const std::string& path, uint64_t fileSize, const std::string& version,
+                     std::vector<ByteRange>& durable) {
+        std::ifstream input(path);
+        std::string line;
+        if (!input || !std::getline(input, line) || line != fingerprint(fileSize, version)) {
+            return false;
+        }
+
+        std::vector<ByteRange> ranges;
+        while (std::getline(input, line)) {
+            if (input.eof()) {
+                break;  // No trailing newline: the write was cut short
+            }
+            std::istringstream fields(line);
+            ByteRange range;
+            if (fields >> range.begin >> range.end && range.begin < range.end && range.end <= fileSize) {
+                ranges.push_back(range);
+            }
+        }
+
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const ByteRange& a, const ByteRange& b) { return a.begin < b.begin; });
+        durable.clear();
+        for (const ByteRange& range : ranges) {
+            if (!durable.empty() && range.begin <= durable.back().end) {
+                durable.back().end = std::max(durable.back().end, range.end);
+            } else {
+                durable.push_back(range);
+            }
+        }
+        return true;
+    }
+
+    // Complement of sorted, merged durable ranges within [0, fileSize).
+    static std::vector<ByteRange> missing(const std::vector<ByteRange>& durable, uint64_t fileSize) {
+        std::vector<ByteRange> gaps;
+        uint64_t position = 0;
+        for (const ByteRange& range : durable) {
+            if (range.begin > position) {
+                gaps.push_back({position, range.begin});
+            }
+            position = std::max(position, range.end);
+        }
+        if (position < fileSize) {
+            gaps.push_back({position, fileSize});
+        }
+        return gaps;
+    }
+
+    void record(uint64_t begin, uint64_t end) {
+        if (begin >= end) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(journalMutex);
+        writeAll(fd, std::to_string(begin) + " " + std::to_string(end) + "\n");
+        fdatasync(fd);
+    }
+
+    // Drops the journal once the download is complete.
+    void remove() {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        unlink(path.c_str());
+    }
+};
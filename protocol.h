@@ -0,0 +1,262 @@
+#pragma once
+
+// Binary framed protocol shared by the server and the client.
+//
+// Every request and response starts with a fixed 40-byte header in network
+// byte order, followed by payloadLength bytes of metadata (paths, versions,
+// manifests) and, on responses that carry file contents, length bytes of
+// data. A connection carries any number of frames; responses come back in
+// request order and echo the request id, so requests can be pipelined.
+//
+//   0  magic          u32   "TFTP"
+//   4  version        u8
+//   5  op             u8
+//   6  flags          u16
+//   8  requestId      u32
+//   12 fileId         u32   client-chosen handle (OPEN, READ, CLOSE)
+//   16 offset         u64
+//   24 length         u64   file size (STAT, OPEN) or data bytes (READ, BATCH)
+//   32 payloadLength  u32
+//   36 checksum       u32   CRC32C of the data section (with flagChecksum)
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <endian.h>
+
+namespace protocol {
+
+constexpr uint32_t magic = 0x54465450;  // "TFTP"
+constexpr uint8_t version = 1;
+constexpr size_t headerSize = 40;
+constexpr uint32_t maxPayload = 16 * 1024 * 1024;
+
+// Request flag: asks for CRC32C checksums of the data. The server sets it on
+// responses whose checksum field (READ) or entry checksums (BATCH) are valid.
+constexpr uint16_t flagChecksum = 0x0001;
+
+// Request flag: READ data may be compressed (see compression.h). The server
+// sets it on a response whose data section is compressed; length is then
+// the compressed size and the payload holds the raw length (u64).
+constexpr uint16_t flagCompress = 0x0002;
+
+// Response flag on ERROR: the request was not served because the server is
+// overloaded (it waited too long for a transfer slot). Retrying later may
+// succeed.
+constexpr uint16_t flagBusy = 0x0004;
+
+// DELTA responses (see delta.h) also carry the rebuilt length (u64) in the
+// payload; length is the size of the instruction stream. The checksum, with
+// flagChecksum, covers the rebuilt bytes.
+
+enum class Op : uint8_t {
+    Stat = 1,   // payload: path            -> length: size, payload: version
+    Open = 2,   // fileId, payload: path    -> length: size, payload: version
+    Read = 3,   // fileId, offset, length   -> offset, length, then length data bytes
+    Close = 4,  // fileId                   -> empty
+    List = 5,   // payload: directory       -> payload: entries (relative paths)
+    Batch = 6,  // payload: path list       -> payload: entries, then length data bytes
+    Error = 7,  // response only            -> payload: message
+    Digest = 8,     // payload: path            -> length: size, payload: version, checksum: CRC32C of the file
+    Signature = 9,  // fileId, payload: block signatures of the client's copy -> empty
+    Delta = 10      // fileId, offset, length   -> offset, length, payload: rebuilt length, then instructions
+};
+
+struct FrameHeader {
+    uint8_t version = protocol::version;
+    Op op = Op::Error;
+    uint16_t flags = 0;
+    uint32_t requestId = 0;
+    uint32_t fileId = 0;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint32_t payloadLength = 0;
+    uint32_t checksum = 0;
+};
+
+inline void encodeHeader(const FrameHeader& header, char* out) {
+    uint32_t magicBE = htobe32(magic);
+    uint16_t flagsBE = htobe16(header.flags);
+    uint32_t requestIdBE = htobe32(header.requestId);
+    uint32_t fileIdBE = htobe32(header.fileId);
+    uint64_t offsetBE = htobe64(header.offset);
+    uint64_t lengthBE = htobe64(header.length);
+    uint32_t payloadBE = htobe32(header.payloadLength);
+    uint32_t checksumBE = htobe32(header.checksum);
+
+    std::memcpy(out, &magicBE, 4);
+    out[4] = static_cast<char>(header.version);
+    out[5] = static_cast<char>(header.op);
+    std::memcpy(out + 6, &flagsBE, 2);
+    std::memcpy(out + 8, &requestIdBE, 4);
+    std::memcpy(out + 12, &fileIdBE, 4);
+    std::memcpy(out + 16, &offsetBE, 8);
+    std::memcpy(out + 24, &lengthBE, 8);
+    std::memcpy(out + 32, &payloadBE, 4);
+    std::memcpy(out + 36, &checksumBE, 4);
+}
+
+// Throws on a bad magic, an unknown version or an oversized payload, so a
+// corrupt or misaligned stream is rejected instead of misparsed.
+inline FrameHeader decodeHeader(const char* in) {
+    uint32_t magicBE, requestIdBE, fileIdBE, payloadBE, checksumBE;
+    uint16_t flagsBE;
+    uint64_t offsetBE, lengthBE;
+    std::memcpy(&magicBE, in, 4);
+    std::memcpy(&flagsBE, in + 6, 2);
+    std::memcpy(&requestIdBE, in + 8, 4);
+    std::memcpy(&fileIdBE, in + 12, 4);
+    std::memcpy(&offsetBE, in + 16, 8);
+    std::memcpy(&lengthBE, in + 24, 8);
+    std::memcpy(&payloadBE, in + 32, 4);
+    std::memcpy(&checksumBE, in + 36, 4);
+
+    if (be32toh(magicBE) != magic) {
+        throw std::runtime_error("Bad frame magic");
+    }
+
+    FrameHeader header;
+    header.version = static_cast<uint8_t>(in[4]);
+    header.op = static_cast<Op>(static_cast<uint8_t>(in[5]));
+    header.flags = be16toh(flagsBE);
+    header.requestId = be32toh(requestIdBE);
+    header.fileId = be32toh(fileIdBE);
+    header.offset = be64toh(offsetBE);
+    header.length = be64toh(lengthBE);
+    header.payloadLength = be32toh(payloadBE);
+    header.checksum = be32toh(checksumBE);
+
+    if (header.version != version) {
+        throw std::runtime_error("Unsupported protocol version " + std::to_string(header.version));
+    }
+    if (header.payloadLength > maxPayload) {
+        throw std::runtime_error("Frame payload too large");
+    }
+    return header;
+}
+
+// Header plus payload, ready to send.
+inline std::string encodeFrame(const FrameHeader& header, const std::string& payload = std::string()) {
+    FrameHeader framed = header;
+    framed.payloadLength = static_cast<uint32_t>(payload.size());
+    std::string frame(headerSize, '\0');
+    encodeHeader(framed, &frame[0]);
+    frame += payload;
+    return frame;
+}
+
+// Appends length-prefixed fields to a payload.
+class PayloadWriter {
+private:
+    std::string data;
+
+public:
+    void putU32(uint32_t value) {
+        uint32_t valueBE = htobe32(value);
+        data.append(reinterpret_cast<const char*>(&valueBE), 4);
+    }
+
+    void putU64(uint64_t value) {
+        uint64_t valueBE = htobe64(value);
+        data.append(reinterpret_cast<const char*>(&valueBE), 8);
+    }
+
+    void putString(const std::string& value) {
+        putU32(static_cast<uint32_t>(value.size()));
+        data += value;
+    }
+
+    const std::string& str() const {
+        return data;
+    }
+};
+
+// Reads fields written by PayloadWriter, with bounds checks.
+class PayloadReader {
+private:
+    const std::string& data;
+    size_t position = 0;
+
+    void require(size_t bytes) {
+        if (data.size() - position < bytes) {
+            throw std::runtime_error("Truncated frame payload");
+        }
+    }
+
+public:
+    explicit PayloadReader(const std::string& data) : data(data) {}
+
+    uint32_t getU32() {
+        require(4);
+        uint32_t valueBE;
+        std::memcpy(&valueBE, data.data() + position, 4);
+        position += 4;
+        return be32toh(valueBE);
+    }
+
+    uint64_t getU64() {
+        require(8);
+        uint64_t valueBE;
+        std::memcpy(&valueBE, data.data() + position, 8);
+        position += 8;
+        return be64toh(valueBE);
+    }
+
+    std::string getString() {
+        uint32_t length = getU32();
+        require(length);
+        std::string value = data.substr(position, length);
+        position += length;
+        return value;
+    }
+
+    bool done() const {
+        return position == data.size();
+    }
+
+    size_t remaining() const {
+        return data.size() - position;
+    }
+};
+
+// One file in a LIST or BATCH response. An empty version marks a file the
+// server could not open; it carries no data. The checksum is only filled in
+// for BATCH responses with flagChecksum.
+struct Entry {
+    uint64_t size = 0;
+    std::string version;
+    std::string name;
+    uint32_t checksum = 0;
+};
+
+// Smallest encoding of an Entry: size, two empty strings and the checksum.
+constexpr size_t minEntrySize = 8 + 4 + 4 + 4;
+
+inline void putEntry(PayloadWriter& writer, const Entry& entry) {
+    writer.putU64(entry.size);
+    writer.putString(entry.version);
+    writer.putString(entry.name);
+    writer.putU32(entry.checksum);
+}
+
+inline std::vector<Entry> getEntries(const std::string& payload) {
+    PayloadReader reader(payload);
+    uint32_t count = reader.getU32();
+    // The count is checked against the payload before anything is sized
+    // from it, so a corrupt frame cannot ask for a huge allocation
+    if (count > reader.remaining() / minEntrySize) {
+        throw std::runtime_error("Entry count " + std::to_string(count) + " exceeds the payload");
+    }
+    std::vector<Entry> entries(count);
+    for (Entry& entry : entries) {
+        entry.size = reader.getU64();
+        entry.version = reader.getString();
+        entry.name = reader.getString();
+        entry.checksum = reader.getU32();
+    }
+    return entries;
+}
+
+} // namespace protocol
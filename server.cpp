@@ -1,294 +1,1727 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <thread>
-#include <mutex>
-#include <memory>
-#include <system_error>
-#include <fstream>
-#include <filesystem>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#pragma comment(lib, "ws2_32.lib")
-
-namespace fs = std::filesystem;
-
-class DownloadServer {
-private:
-    std::mutex transferMutex;
-    SOCKET listenSocket;
-    sockaddr_in serverAddr;
-    
-    struct ThreadParams {
-        SOCKET connectionFd;
-        int threadId;
-        int totalThreads;
-        std::string filename;
-        std::streampos position;
-        size_t bytesToSend;
-    };
-
-    void sendFile(const ThreadParams& params) {
-        try {
-            // Get file information
-            fs::path filePath(params.filename);
-            if (!fs::exists(filePath)) {
-                throw std::runtime_error("File does not exist");
-            }
-    
-            auto fileSize = fs::file_size(filePath);
-            
-            // Calculate portion to send
-            size_t bytesToSend;
-            std::streampos position;
-            
-            // Calculate chunk size and position
-            position = params.position;
-            if (params.threadId == params.totalThreads - 1) {
-                bytesToSend = static_cast<size_t>(fileSize) - position;
-            } else {
-                bytesToSend = static_cast<size_t>(fileSize) / params.totalThreads;
-            }
-            
-            // Open file (without mutex - each thread has its own file handle)
-            std::ifstream file(filePath, std::ios::binary);
-            if (!file) {
-                throw std::runtime_error("Failed to open file");
-            }
-    
-            // Set file position
-            file.seekg(position);
-            
-            // Send combined header (size + filename)
-            std::string header = "SIZE:" + std::to_string(bytesToSend) + 
-                               ":FILENAME:" + params.filename + "\n";
-            
-            if (send(params.connectionFd, header.c_str(), header.size(), 0) == SOCKET_ERROR) {
-                throw std::system_error(WSAGetLastError(), std::system_category(), "Header send failed");
-            }
-    
-            // Send file data
-            char buffer[8192]; // Increased buffer size for better performance
-            size_t remaining = bytesToSend;
-            size_t totalSent = 0;
-            
-            while (remaining > 0) {
-                size_t chunkSize = std::min(sizeof(buffer), remaining);
-                file.read(buffer, chunkSize);
-                size_t bytesRead = file.gcount();
-                
-                if (bytesRead == 0) {
-                    break; // End of file reached unexpectedly
-                }
-                
-                size_t bytesWritten = 0;
-                while (bytesWritten < bytesRead) {
-                    int bytesSent = send(params.connectionFd, buffer + bytesWritten, bytesRead - bytesWritten, 0);
-                    if (bytesSent <= 0) {
-                        if (WSAGetLastError() == WSAEWOULDBLOCK) {
-                            // Socket buffer is full, wait a bit
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                            continue;
-                        }
-                        throw std::system_error(WSAGetLastError(), std::system_category(), "Data send failed");
-                    }
-                    
-                    bytesWritten += bytesSent;
-                }
-                
-                totalSent += bytesRead;
-                remaining -= bytesRead;
-                
-                int progress = static_cast<int>((totalSent * 100) / bytesToSend);
-                std::cout << "\rThread " << params.threadId << ": " << progress << "%" << std::flush;
-            }
-    
-            std::cout << "\nThread " << params.threadId << " completed. Sent "
-                      << totalSent << "/" << bytesToSend << " bytes" << std::endl;
-
-            // Proper connection teardown
-            shutdown(params.connectionFd, SD_SEND);
-            file.close();
-        } catch (const std::exception& e) {
-            std::cerr << "Thread " << params.threadId << " error: " << e.what() << std::endl;
-        }
-
-        closesocket(params.connectionFd);
-    }
-
-public:
-    DownloadServer(int port) {
-        // Initialize Winsock
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            throw std::system_error(WSAGetLastError(), std::system_category(), "WSAStartup failed");
-        }
-
-        // Create socket with reuse option
-        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (listenSocket == INVALID_SOCKET) {
-            WSACleanup();
-            throw std::system_error(WSAGetLastError(), std::system_category(), "Socket creation failed");
-        }
-
-        // Allow port reuse
-        int optval = 1;
-        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&optval, sizeof(optval));
-
-        // Configure server address
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        serverAddr.sin_port = htons(port);
-
-        // Bind socket
-        if (bind(listenSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
-            closesocket(listenSocket);
-            WSACleanup();
-            throw std::system_error(WSAGetLastError(), std::system_category(), "Bind failed");
-        }
-
-        // Start listening with a backlog of SOMAXCONN
-        if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
-            closesocket(listenSocket);
-            WSACleanup();
-            throw std::system_error(WSAGetLastError(), std::system_category(), "Listen failed");
-        }
-    }
-
-    ~DownloadServer() {
-        if (listenSocket != INVALID_SOCKET) {
-            closesocket(listenSocket);
-        }
-        WSACleanup();
-    }
-
-    void run() {
-        std::cout << "Server started. Waiting for connections..." << std::endl;
-
-        while (true) {
-            sockaddr_in clientAddr;
-            int clientLen = sizeof(clientAddr);
-            
-            SOCKET connectionFd = accept(listenSocket, reinterpret_cast<sockaddr*>(&clientAddr), &clientLen);
-            if (connectionFd == INVALID_SOCKET) {
-                std::cerr << "Accept failed: " << WSAGetLastError() << std::endl;
-                continue;
-            }
-
-            // Set non-blocking socket
-            u_long mode = 1;
-            ioctlsocket(connectionFd, FIONBIO, &mode);
-
-            // Set send timeout (5000ms)
-            DWORD timeout = 5000;
-            setsockopt(connectionFd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
-            
-            // Set receive timeout (5000ms)
-            setsockopt(connectionFd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-
-            // Receive client message
-            char clientMessage[4096] = {0}; // Increased buffer size
-            int bytesReceived = 0;
-            
-            // Receive with timeout handling
-            auto startTime = std::chrono::steady_clock::now();
-            bool receivedComplete = false;
-            
-            while (!receivedComplete) {
-                int result = recv(connectionFd, clientMessage + bytesReceived, 
-                              sizeof(clientMessage) - bytesReceived - 1, 0);
-                
-                if (result > 0) {
-                    bytesReceived += result;
-                    receivedComplete = true; // We got data, assume it's complete
-                } else if (result == 0) {
-                    // Connection closed
-                    break;
-                } else {
-                    int error = WSAGetLastError();
-                    if (error == WSAEWOULDBLOCK) {
-                        // Not ready yet, check timeout
-                        auto now = std::chrono::steady_clock::now();
-                        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime).count() > 3000) {
-                            std::cerr << "Timeout receiving client message" << std::endl;
-                            closesocket(connectionFd);
-                            continue;
-                        }
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                        continue;
-                    } else {
-                        // Real error
-                        std::cerr << "Receive error: " << error << std::endl;
-                        closesocket(connectionFd);
-                        continue;
-                    }
-                }
-            }
-
-            if (bytesReceived <= 0) {
-                closesocket(connectionFd);
-                std::cerr << "Failed to receive client message" << std::endl;
-                continue;
-            }
-
-            // Ensure null termination
-            clientMessage[bytesReceived] = '\0';
-
-            // Parse client message (threadId,threadCount,filename)
-            std::string message(clientMessage, bytesReceived);
-            size_t pos1 = message.find(',');
-            size_t pos2 = message.find(',', pos1 + 1);
-
-            if (pos1 == std::string::npos || pos2 == std::string::npos) {
-                closesocket(connectionFd);
-                std::cerr << "Invalid client message format" << std::endl;
-                continue;
-            }
-
-            ThreadParams params;
-            params.connectionFd = connectionFd;
-            
-            try {
-                params.threadId = std::stoi(message.substr(0, pos1));
-                params.totalThreads = std::stoi(message.substr(pos1 + 1, pos2 - pos1 - 1));
-                params.filename = message.substr(pos2 + 1);
-            } catch (const std::exception& e) {
-                closesocket(connectionFd);
-                std::cerr << "Failed to parse client message: " << e.what() << std::endl;
-                continue;
-            }
-
-            // Verify file exists before proceeding
-            if (!fs::exists(params.filename)) {
-                closesocket(connectionFd);
-                std::cerr << "Requested file not found: " << params.filename << std::endl;
-                continue;
-            }
-
-            auto fileSize = fs::file_size(params.filename);
-            params.position = (params.threadId * (fileSize / params.totalThreads));
-            
-            // Compute bytes to send for this thread
-            if (params.threadId == params.totalThreads - 1) {
-                params.bytesToSend = fileSize - params.position;
-            } else {
-                params.bytesToSend = fileSize / params.totalThreads;
-            }
-
-            // Start thread to handle this connection
-            std::thread(&DownloadServer::sendFile, this, params).detach();
-        }
-    }
-};
-
-int main() {
-    try {
-        DownloadServer server(8000);
-        server.run();
-    } catch (const std::exception& e) {
-        std::cerr << "Server error: " << e.what() << std::endl;
-        return 1;
-    }
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <system_error>
+#include <filesystem>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include "net.h"
+#include "file_cache.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include "compression.h"
+#include "bandwidth.h"
+#include "delta.h"
+#include "buffer_pool.h"
+#include "admission.h"
+#include "digest_worker.h"
+#include "prepare_pool.h"
+#include "phase_trace.h"
+
+namespace fs = std::filesystem;
+
+// Event-driven server: a fixed set of worker loops, one per core, each with
+// its own epoll instance. Every connection is a non-blocking state machine
+// (request frame -> response segments), so the thread count stays constant
+// no matter how many clients are connected.
+class DownloadServer {
+public:
+    // ZeroCopy moves file pages straight to the socket with sendfile(2);
+    // Buffered reads each chunk into user space first and is used when
+    // requested or when the file system cannot do sendfile. Mapped sends
+    // from one shared read-only mapping of each cached file. Direct is
+    // Buffered with O_DIRECT reads, so bulk transfers do not push the hot
+    // working set out of the page cache.
+    enum class SendMode {
+        ZeroCopy,
+        Buffered,
+        Mapped,
+        Direct
+    };
+
+private:
+    enum class State {
+        ReadingRequest,
+        Sending
+    };
+
+    // One piece of a response: an encoded frame (or other inline bytes)
+    // followed by an optional byte range of a pinned file. A BATCH response
+    // is the frame plus one segment per file, everything else is a single
+    // segment.
+    struct Segment {
+        std::string header;
+        std::shared_ptr<const CachedFile> file;
+        off_t position = 0;
+        size_t length = 0;
+    };
+
+    struct Connection {
+        socket_t fd = INVALID_SOCKET_FD;
+        uint64_t id = 0;          // Serial number; fds are reused
+        State state = State::ReadingRequest;
+        std::string request;
+
+        // Handles opened with OPEN, keyed by the client's file id. Each pins
+        // the version that was current when it was opened.
+        std::unordered_map<uint32_t, std::shared_ptr<const CachedFile>> openFiles;
+
+        // Block signatures of the client's copy of a file, keyed by the
+        // file id they were sent for; DELTA requests match against them.
+        std::unordered_map<uint32_t, std::shared_ptr<const delta::SignatureIndex>> signatures;
+
+        std::deque<Segment> segments;
+        size_t headerSent = 0;
+        size_t totalSent = 0;     // Data bytes sent from the front segment
+        size_t prefetched = 0;    // Bytes of the front segment hinted to the page cache
+        size_t responseSent = 0;  // Data bytes sent for the whole response
+        bool peerClosed = false;
+        int requestsServed = 0;
+        uint64_t bytesServed = 0;
+        bool zeroCopy = true;
+
+        BufferPool::Buffer buffer;  // Leased for the buffered send paths
+        size_t bufferOffset = 0;
+        size_t bufferLength = 0;
+
+        std::chrono::steady_clock::time_point lastActivity;
+
+        // Bandwidth scheduling; client is null when no limits are set
+        std::shared_ptr<BandwidthScheduler::Client> client;
+        size_t credit = 0;        // Bytes reserved and not yet sent
+        bool throttled = false;   // Parked until resumeAt
+        std::chrono::steady_clock::time_point resumeAt;
+
+        // Admission control: a data request waits for a transfer slot
+        bool queued = false;         // Waiting; the request stays buffered
+        bool holdsTransfer = false;  // Owns a slot until the response is out
+        bool rejected = false;       // Waited too long; answer busy
+        std::chrono::steady_clock::time_point queuedAt;
+
+        // Whole-file digests the buffered request needs, being computed by
+        // the DigestWorker; digestsWaited once they are done
+        int digestsPending = 0;
+        bool digestsWaited = false;
+
+        // The response is being built on the PreparePool; nothing is sent
+        // until processHandoffs hands it over
+        bool preparing = false;
+        std::chrono::steady_clock::time_point prepareStart;
+
+        // Phase timing; left at the epoch while timing is off
+        std::chrono::steady_clock::time_point sendStart;     // Response built
+        std::chrono::steady_clock::time_point stalledSince;  // Socket buffer full
+        std::chrono::steady_clock::time_point throttledAt;
+
+        ~Connection() {
+            net::closeSocket(fd);
+        }
+    };
+
+    // A response built off the worker loop for the connection in ticket.
+    // A non-empty error is answered with an ERROR frame instead.
+    struct Prepared {
+        AdmissionControl::Ticket ticket;
+        protocol::FrameHeader request;
+        Segment segment;
+        std::string error;
+    };
+
+    struct Worker {
+        int id = 0;
+        int epollFd = -1;
+        socket_t listenFd = INVALID_SOCKET_FD;
+        uint32_t listenEvents = EPOLLIN;
+        bool ownsListener = false;
+        bool listening = true;    // Listener registered with epollFd; guarded by acceptMutex
+        std::unordered_map<socket_t, std::unique_ptr<Connection>> connections;
+
+        // Transfer slots handed to this worker's queued connections by
+        // other workers, digests finished for its connections by the
+        // DigestWorker and responses built by the PreparePool, announced
+        // through wakeFd
+        int wakeFd = -1;
+        std::mutex handoffMutex;
+        std::vector<AdmissionControl::Ticket> handoffs;
+        std::vector<AdmissionControl::Ticket> digested;
+        std::vector<Prepared> prepared;
+
+        std::atomic<bool> draining{false};
+        std::chrono::steady_clock::time_point drainDeadline;
+    };
+
+    static constexpr size_t maxBatchFiles = 1024;
+    static constexpr size_t maxOpenHandles = 256;
+    static constexpr uint64_t maxCompressedRead = 16 * 1024 * 1024;  // Larger READs go out raw
+    static constexpr uint64_t maxDeltaRead = 16 * 1024 * 1024;
+    // A checksummed READ is hashed before its header goes out, so its length
+    // is bounded like a DELTA's
+    static constexpr uint64_t maxChecksumRead = 16 * 1024 * 1024;
+    static constexpr size_t prefetchWindow = 2 * 1024 * 1024;
+    static constexpr int requestTimeoutMs = 3000;     // A request that has started to arrive
+    static constexpr int keepAliveTimeoutMs = 15000;  // Between requests; clients pool idle connections
+    static constexpr int sendTimeoutMs = 5000;
+
+    int port;
+    SendMode sendMode;
+    FileCache fileCache;
+    BandwidthScheduler bandwidth;
+    BufferPool buffers;
+    AdmissionControl admission;
+    std::chrono::seconds drainTimeout;
+    PhaseTimer phases;  // One trace track per connection serial
+    std::mutex logMutex;
+    std::mutex acceptMutex;
+    bool acceptPaused = false;
+    std::atomic<uint64_t> nextConnectionId{1};
+    std::atomic<bool> drainAnnounced{false};
+    socket_t sharedListenFd = INVALID_SOCKET_FD;
+    std::vector<std::unique_ptr<Worker>> workers;
+    // Declared last: stopped before the workers go
+    PreparePool prepares;
+    DigestWorker digests;
+
+    // Written by the SIGTERM/SIGINT handler; every worker polls it
+    static inline int stopFd = -1;
+
+    // Takes every worker's listener out of its epoll set, so new clients
+    // wait in the listen backlog. Accepting resumes when a connection
+    // closes; with untilClose false, also right away if there is room
+    // again by now (a connection closed while this one was paused).
+    void pauseAccepting(bool untilClose) {
+        std::lock_guard<std::mutex> lock(acceptMutex);
+        if (!acceptPaused) {
+            acceptPaused = true;
+            for (auto& worker : workers) {
+                if (worker->listening) {
+                    epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, worker->listenFd, nullptr);
+                    worker->listening = false;
+                }
+            }
+        }
+        if (!untilClose && admission.hasRoom()) {
+            resumeAcceptingLocked();
+        }
+    }
+
+    void resumeAcceptingLocked() {
+        acceptPaused = false;
+        for (auto& worker : workers) {
+            if (!worker->listening && !worker->draining) {
+                epoll_event ev;
+                ev.events = worker->listenEvents;
+                ev.data.fd = worker->listenFd;
+                epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listenFd, &ev);
+                worker->listening = true;
+            }
+        }
+    }
+
+    void acceptConnections(Worker& worker) {
+        while (true) {
+            if (!admission.tryOpen()) {
+                pauseAccepting(false);
+                return;
+            }
+            sockaddr_in clientAddr;
+            socklen_t clientLen = sizeof(clientAddr);
+            socket_t connectionFd = accept4(worker.listenFd, reinterpret_cast<sockaddr*>(&clientAddr),
+                                            &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connectionFd == INVALID_SOCKET_FD) {
+                admission.close();
+                int error = net::lastError();
+                if (!net::wouldBlock(error) && error != EINTR) {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cerr << "Accept failed: " << std::strerror(error) << std::endl;
+                }
+                // Out of descriptors: the listener would stay readable
+                if (error == EMFILE || error == ENFILE) {
+                    pauseAccepting(true);
+                }
+                return;
+            }
+
+            // Responses are written whole; Nagle would only hold back the
+            // tail of a small READ until the header is acknowledged
+            net::setNoDelay(connectionFd);
+
+            auto conn = std::make_unique<Connection>();
+            conn->fd = connectionFd;
+            conn->id = nextConnectionId++;
+            conn->lastActivity = std::chrono::steady_clock::now();
+            if (bandwidth.enabled()) {
+                char address[INET_ADDRSTRLEN] = {};
+                inet_ntop(AF_INET, &clientAddr.sin_addr, address, sizeof(address));
+                conn->client = bandwidth.join(address);
+            }
+
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = connectionFd;
+            if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, connectionFd, &ev) != 0) {
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cerr << "epoll_ctl failed: " << std::strerror(net::lastError()) << std::endl;
+                admission.close();
+                continue;
+            }
+
+            if (phases.tracing()) {
+                phases.nameTrack(conn->id, "connection " + std::to_string(conn->id) + " (worker " +
+                                               std::to_string(worker.id) + ")");
+            }
+            worker.connections.emplace(connectionFd, std::move(conn));
+        }
+    }
+
+    // A request is a fixed-size frame header followed by its payload.
+    // Returns the number of buffered bytes the first complete request
+    // spans, or 0 if it has not fully arrived yet.
+    static size_t completeRequestLength(const std::string& buffer) {
+        if (buffer.size() < protocol::headerSize) {
+            return 0;
+        }
+        protocol::FrameHeader header = protocol::decodeHeader(buffer.data());
+        size_t length = protocol::headerSize + header.payloadLength;
+        return buffer.size() >= length ? length : 0;
+    }
+
+    // Reads until a full request has arrived or the socket runs dry.
+    // Returns true once the request is complete. Bytes after it stay
+    // buffered: they are the next pipelined request.
+    bool readRequest(Connection& conn) {
+        if (completeRequestLength(conn.request) > 0) {
+            return true;
+        }
+
+        char chunk[4096];
+        while (true) {
+            ssize_t result = recv(conn.fd, chunk, sizeof(chunk), 0);
+            if (result > 0) {
+                conn.request.append(chunk, static_cast<size_t>(result));
+                conn.lastActivity = std::chrono::steady_clock::now();
+                if (completeRequestLength(conn.request) > 0) {
+                    return true;
+                }
+            } else if (result == 0) {
+                if (conn.request.empty()) {
+                    // Client closed between requests; nothing is lost
+                    conn.peerClosed = true;
+                    return false;
+                }
+                throw std::runtime_error("Connection closed before request was received");
+            } else {
+                int error = net::lastError();
+                if (net::wouldBlock(error)) {
+                    return false;
+                }
+                if (error != EINTR) {
+                    throw std::system_error(error, std::system_category(), "Receive error");
+                }
+            }
+        }
+    }
+
+    static protocol::FrameHeader responseTo(const protocol::FrameHeader& request) {
+        protocol::FrameHeader response;
+        response.op = request.op;
+        response.requestId = request.requestId;
+        response.fileId = request.fileId;
+        return response;
+    }
+
+    void queueFrame(Connection& conn, const protocol::FrameHeader& header, const std::string& payload) {
+        Segment segment;
+        segment.header = protocol::encodeFrame(header, payload);
+        conn.segments.push_back(std::move(segment));
+    }
+
+    std::shared_ptr<const CachedFile> openHandle(Connection& conn, uint32_t fileId) {
+        auto it = conn.openFiles.find(fileId);
+        if (it == conn.openFiles.end()) {
+            throw std::runtime_error("Unknown file id " + std::to_string(fileId));
+        }
+        return it->second;
+    }
+
+    // Recursive listing of a directory: one entry per regular file, named
+    // by its path relative to the directory. Entries are only stat()ed, so
+    // a large listing neither opens every file nor evicts the files being
+    // served from the cache.
+    std::string listDirectory(const std::string& directory) {
+        if (!fs::is_directory(directory)) {
+            throw std::runtime_error("Requested path is not a directory: " + directory);
+        }
+
+        std::vector<protocol::Entry> entries;
+        auto options = fs::directory_options::skip_permission_denied;
+        for (const auto& item : fs::recursive_directory_iterator(directory, options)) {
+            if (!item.is_regular_file()) {
+                continue;
+            }
+            struct stat st;
+            if (stat(item.path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;  // Removed or replaced since the directory was read
+            }
+            entries.push_back({static_cast<uint64_t>(st.st_size), CachedFile::versionOf(st),
+                               fs::relative(item.path(), directory).string()});
+        }
+
+        protocol::PayloadWriter writer;
+        writer.putU32(static_cast<uint32_t>(entries.size()));
+        for (const protocol::Entry& entry : entries) {
+            protocol::putEntry(writer, entry);
+        }
+        return writer.str();
+    }
+
+    // Coalesces several whole files into one response: the payload lists
+    // every file's size and version, and the data section holds the files
+    // back to back. A file that cannot be opened is listed with an empty
+    // version and contributes no data.
+    void queueBatch(Connection& conn, const protocol::FrameHeader& request, const std::string& payload) {
+        protocol::PayloadReader reader(payload);
+        uint32_t count = reader.getU32();
+        if (count == 0 || count > maxBatchFiles) {
+            throw std::runtime_error("Batch of " + std::to_string(count) + " files is not allowed");
+        }
+
+        protocol::PayloadWriter writer;
+        writer.putU32(count);
+        std::deque<Segment> segments;
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            protocol::Entry entry;
+            entry.name = reader.getString();
+            Segment segment;
+            try {
+                segment.file = fileCache.acquire(entry.name);
+                segment.length = static_cast<size_t>(segment.file->size);
+                entry.size = segment.file->size;
+                entry.version = segment.file->version();
+                if (request.flags & protocol::flagChecksum) {
+                    entry.checksum = segment.file->digest(sendMode == SendMode::Direct);
+                }
+            } catch (const std::exception&) {
+                // Listed with an empty version and no data
+            }
+            protocol::putEntry(writer, entry);
+            total += segment.length;
+            if (segment.file) {
+                segments.push_back(std::move(segment));
+            }
+        }
+
+        protocol::FrameHeader response = responseTo(request);
+        response.flags = request.flags & protocol::flagChecksum;
+        response.length = total;
+        Segment first;
+        first.header = protocol::encodeFrame(response, writer.str());
+        segments.push_front(std::move(first));
+        conn.segments = std::move(segments);
+    }
+
+    static std::string readRange(const CachedFile& file, uint64_t offset, uint64_t length) {
+        std::string data(static_cast<size_t>(length), '\0');
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t bytesRead = pread(file.fd, &data[done], data.size() - done, static_cast<off_t>(offset + done));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "File read failed");
+            }
+            if (bytesRead == 0) {
+                throw std::runtime_error("End of file reached unexpectedly");
+            }
+            done += static_cast<size_t>(bytesRead);
+        }
+        return data;
+    }
+
+    // Answers a DELTA with the instructions that rebuild the range from the
+    // client's copy.
+    static Segment deltaResponse(const protocol::FrameHeader& request, protocol::FrameHeader response,
+                                 const CachedFile& file, const delta::SignatureIndex& signature) {
+        std::string raw = readRange(file, response.offset, response.length);
+        if (request.flags & protocol::flagChecksum) {
+            response.flags |= protocol::flagChecksum;
+            response.checksum = crc32c::compute(raw.data(), raw.size());
+        }
+
+        std::string data;
+        delta::encode(signature, raw.data(), raw.size(), data);
+
+        protocol::PayloadWriter writer;
+        writer.putU64(raw.size());
+        response.length = data.size();
+
+        Segment segment;
+        segment.header = protocol::encodeFrame(response, writer.str()) + data;
+        return segment;
+    }
+
+    // Answers a READ by sending the range from the file, hashed first if the
+    // request asks for a checksum. In Direct mode a checksummed range is read
+    // once with O_DIRECT into memory and sent from there instead of being
+    // read twice.
+    Segment readResponse(const protocol::FrameHeader& request, protocol::FrameHeader response,
+                         std::shared_ptr<const CachedFile> file) {
+        if ((request.flags & protocol::flagChecksum) && sendMode == SendMode::Direct && response.length > 0 &&
+            file->direct() >= 0) {
+            return directReadResponse(response, *file);
+        }
+        if (request.flags & protocol::flagChecksum) {
+            // Read through the page cache once more; the data itself
+            // still goes out with sendfile
+            response.flags = protocol::flagChecksum;
+            response.checksum = crc32c::ofFile(file->fd, response.offset, response.length);
+        }
+
+        Segment segment;
+        segment.header = protocol::encodeFrame(response);
+        segment.position = static_cast<off_t>(response.offset);
+        segment.length = static_cast<size_t>(response.length);
+        segment.file = std::move(file);
+        return segment;
+    }
+
+    Segment directReadResponse(protocol::FrameHeader response, const CachedFile& file) {
+        int directFd = file.direct();
+        BufferPool::Buffer buffer = buffers.acquire();
+        std::string data;
+        data.reserve(static_cast<size_t>(response.length));
+        uint64_t position = response.offset;
+        uint64_t end = response.offset + response.length;
+        uint32_t crc = 0;
+        while (position < end) {
+            size_t skip = position % BufferPool::alignment;
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(buffer.size() - skip, end - position));
+            ssize_t bytesRead = pread(directFd, buffer.data(), BufferPool::roundUp(skip + chunk),
+                                      static_cast<off_t>(position - skip));
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "File read failed");
+            }
+            if (static_cast<size_t>(bytesRead) <= skip) {
+                throw std::runtime_error("End of file reached unexpectedly");
+            }
+            chunk = std::min(chunk, static_cast<size_t>(bytesRead) - skip);
+            crc = crc32c::extend(crc, buffer.data() + skip, chunk);
+            data.append(buffer.data() + skip, chunk);
+            position += chunk;
+        }
+
+        response.flags = protocol::flagChecksum;
+        response.checksum = crc;
+        Segment segment;
+        segment.header = protocol::encodeFrame(response) + data;
+        return segment;
+    }
+
+    // Answers a READ with a compressed data section. The range is read into
+    // memory once; the checksum, if asked for, covers the raw bytes. How well
+    // it compressed is fed back to the file's sampler, which turns
+    // compression off for data that does not shrink.
+    static Segment compressedReadResponse(const protocol::FrameHeader& request, protocol::FrameHeader response,
+                                          const CachedFile& file) {
+        std::string raw = readRange(file, response.offset, response.length);
+        if (request.flags & protocol::flagChecksum) {
+            response.flags |= protocol::flagChecksum;
+            response.checksum = crc32c::compute(raw.data(), raw.size());
+        }
+
+        std::string data;
+        compression::encode(raw.data(), raw.size(), data);
+        file.compression.record(raw.size(), data.size());
+
+        protocol::PayloadWriter writer;
+        writer.putU64(raw.size());
+        response.flags |= protocol::flagCompress;
+        response.length = data.size();
+
+        Segment segment;
+        segment.header = protocol::encodeFrame(response, writer.str()) + data;
+        return segment;
+    }
+
+    // Builds the response on the PreparePool. The connection sends nothing
+    // until processHandoffs resumes it with the result.
+    void prepareOffLoop(Worker& worker, Connection& conn, const protocol::FrameHeader& request,
+                        std::function<Segment()> build) {
+        conn.preparing = true;
+        AdmissionControl::Ticket ticket = ticketFor(worker, conn);
+        prepares.submit([this, ticket, request, build = std::move(build)] {
+            Prepared result;
+            result.ticket = ticket;
+            result.request = request;
+            try {
+                result.segment = build();
+            } catch (const std::exception& e) {
+                result.error = e.what();
+            }
+            Worker& target = *workers[static_cast<size_t>(ticket.worker)];
+            {
+                std::lock_guard<std::mutex> lock(target.handoffMutex);
+                target.prepared.push_back(std::move(result));
+            }
+            wake(target);
+        });
+    }
+
+    // Parses one request frame and queues the response (see protocol.h for
+    // the layout of each op). A request that fails - a missing file, an
+    // unknown handle - is answered with an ERROR frame and the connection
+    // stays usable; only a malformed frame closes it.
+    void parseRequest(Worker& worker, Connection& conn) {
+        size_t frameLength = completeRequestLength(conn.request);
+        protocol::FrameHeader request = protocol::decodeHeader(conn.request.data());
+        std::string payload = conn.request.substr(protocol::headerSize, request.payloadLength);
+        conn.request.erase(0, frameLength);
+
+        conn.totalSent = 0;
+        conn.prefetched = 0;
+        conn.responseSent = 0;
+        conn.headerSent = 0;
+        conn.bufferOffset = 0;
+        conn.bufferLength = 0;
+        conn.zeroCopy = sendMode == SendMode::ZeroCopy;
+        conn.state = State::Sending;
+
+        if (conn.rejected) {
+            conn.rejected = false;
+            protocol::FrameHeader response = responseTo(request);
+            response.op = protocol::Op::Error;
+            response.flags = protocol::flagBusy;
+            queueFrame(conn, response, "Server busy");
+            return;
+        }
+
+        try {
+            handleRequest(worker, conn, request, payload);
+        } catch (const std::exception& e) {
+            conn.segments.clear();
+            protocol::FrameHeader response = responseTo(request);
+            response.op = protocol::Op::Error;
+            queueFrame(conn, response, e.what());
+        }
+    }
+
+    void handleRequest(Worker& worker, Connection& conn, const protocol::FrameHeader& request,
+                       const std::string& payload) {
+        protocol::FrameHeader response = responseTo(request);
+
+        switch (request.op) {
+        case protocol::Op::Stat:
+        case protocol::Op::Open: {
+            auto file = fileCache.acquire(payload);
+            if (request.op == protocol::Op::Open) {
+                if (conn.openFiles.size() >= maxOpenHandles && conn.openFiles.count(request.fileId) == 0) {
+                    throw std::runtime_error("Too many open files on this connection");
+                }
+                conn.openFiles[request.fileId] = file;
+            }
+            response.length = file->size;
+            queueFrame(conn, response, file->version());
+            return;
+        }
+
+        case protocol::Op::Read: {
+            auto file = openHandle(conn, request.fileId);
+
+            // Clamp to the end of the file; a range past EOF sends nothing
+            uint64_t offset = std::min(request.offset, file->size);
+            uint64_t length = std::min(request.length, file->size - offset);
+            if ((request.flags & protocol::flagChecksum) && length > maxChecksumRead) {
+                throw std::runtime_error("Checksummed READ range too large");
+            }
+            response.offset = offset;
+            response.length = length;
+            bool compress = (request.flags & protocol::flagCompress) && length > 0 &&
+                            length <= maxCompressedRead && file->compression.shouldCompress();
+            // Hashing or compressing reads the whole range first
+            if (length > 0 && (compress || (request.flags & protocol::flagChecksum))) {
+                prepareOffLoop(worker, conn, request, [this, request, response, file, compress] {
+                    return compress ? compressedReadResponse(request, response, *file)
+                                    : readResponse(request, response, file);
+                });
+                return;
+            }
+            conn.segments.push_back(readResponse(request, response, std::move(file)));
+            return;
+        }
+
+        case protocol::Op::Signature:
+            openHandle(conn, request.fileId);
+            conn.signatures[request.fileId] = std::make_shared<const delta::SignatureIndex>(payload);
+            queueFrame(conn, response, std::string());
+            return;
+
+        case protocol::Op::Delta: {
+            auto file = openHandle(conn, request.fileId);
+            auto signature = conn.signatures.find(request.fileId);
+            if (signature == conn.signatures.end()) {
+                throw std::runtime_error("DELTA without a signature for this file");
+            }
+            uint64_t offset = std::min(request.offset, file->size);
+            uint64_t length = std::min(request.length, file->size - offset);
+            if (length > maxDeltaRead) {
+                throw std::runtime_error("DELTA range too large");
+            }
+            response.offset = offset;
+            response.length = length;
+            prepareOffLoop(worker, conn, request, [request, response, file, signature = signature->second] {
+                return deltaResponse(request, response, *file, *signature);
+            });
+            return;
+        }
+
+        case protocol::Op::Digest: {
+            auto file = fileCache.acquire(payload);
+            response.length = file->size;
+            response.checksum = file->digest(sendMode == SendMode::Direct);
+            queueFrame(conn, response, file->version());
+            return;
+        }
+
+        case protocol::Op::Close:
+            conn.openFiles.erase(request.fileId);
+            conn.signatures.erase(request.fileId);
+            queueFrame(conn, response, std::string());
+            return;
+
+        case protocol::Op::List:
+            queueFrame(conn, response, listDirectory(payload));
+            return;
+
+        case protocol::Op::Batch:
+            queueBatch(conn, request, payload);
+            return;
+
+        default:
+            throw std::runtime_error("Unknown op " + std::to_string(static_cast<int>(request.op)));
+        }
+    }
+
+    // Bytes the connection may send now, at most wanted. Zero means the
+    // bandwidth scheduler made it wait: the connection is parked until its
+    // reservation comes due and the worker resumes it from its epoll
+    // timeout, so a throttled connection costs no wakeups in between.
+    size_t allowance(Connection& conn, size_t wanted) {
+        if (!conn.client) {
+            return wanted;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (conn.throttled) {
+            if (now < conn.resumeAt) {
+                return 0;
+            }
+            conn.throttled = false;
+            phases.record(Phase::Throttle, conn.id, conn.throttledAt);
+        }
+        if (conn.credit == 0) {
+            std::chrono::nanoseconds wait(0);
+            conn.credit = bandwidth.acquire(*conn.client, wanted, wait);
+            if (conn.credit == 0 || wait.count() > 0) {
+                // Pacing by the server does not count as an idle client
+                conn.throttled = true;
+                conn.throttledAt = phases.now();
+                conn.lastActivity = now;
+                conn.resumeAt = now + wait;
+                return 0;
+            }
+        }
+        return std::min(conn.credit, wanted);
+    }
+
+    void spend(Connection& conn, ssize_t sent) {
+        if (conn.client && sent > 0) {
+            conn.credit -= static_cast<size_t>(sent);
+        }
+    }
+
+    // Pushes as much of the segment header as the socket accepts. Returns
+    // true once the whole header has been sent.
+    bool sendHeader(Connection& conn, const Segment& segment) {
+        while (conn.headerSent < segment.header.size()) {
+            size_t allowed = allowance(conn, segment.header.size() - conn.headerSent);
+            if (allowed == 0) {
+                return false;
+            }
+            ssize_t sent = send(conn.fd, segment.header.data() + conn.headerSent, allowed, MSG_NOSIGNAL);
+            spend(conn, sent);
+            if (sent < 0) {
+                int error = net::lastError();
+                if (net::wouldBlock(error)) {
+                    return false;
+                }
+                if (error == EINTR) {
+                    continue;
+                }
+                throw std::system_error(error, std::system_category(), "Header send failed");
+            }
+            conn.headerSent += static_cast<size_t>(sent);
+            conn.lastActivity = std::chrono::steady_clock::now();
+        }
+        return true;
+    }
+
+    void countSent(Connection& conn, size_t sent) {
+        conn.totalSent += sent;
+        conn.responseSent += sent;
+        conn.lastActivity = std::chrono::steady_clock::now();
+    }
+
+    // Keeps the page cache one window ahead of the segment's send position.
+    void prefetchAhead(Connection& conn, const Segment& segment) {
+        if (sendMode == SendMode::Direct) {
+            return;
+        }
+        if (conn.prefetched < segment.length && conn.totalSent + prefetchWindow / 2 >= conn.prefetched) {
+            size_t start = std::max(conn.prefetched, conn.totalSent);
+            segment.file->prefetch(segment.position + start, prefetchWindow);
+            conn.prefetched = start + prefetchWindow;
+        }
+    }
+
+    // Mapped variant of sendData: send(2) copies straight from the shared
+    // mapping, with no read call and no per-connection buffer.
+    bool sendDataMapped(Connection& conn, const Segment& segment, const char* mapping) {
+        while (conn.totalSent < segment.length) {
+            prefetchAhead(conn, segment);
+            size_t allowed = allowance(conn, segment.length - conn.totalSent);
+            if (allowed == 0) {
+                return false;
+            }
+            ssize_t sent = send(conn.fd, mapping + segment.position + conn.totalSent, allowed, MSG_NOSIGNAL);
+            spend(conn, sent);
+            if (sent < 0) {
+                int error = net::lastError();
+                if (net::wouldBlock(error)) {
+                    return false;
+                }
+                if (error == EINTR) {
+                    continue;
+                }
+                throw std::system_error(error, std::system_category(), "Data send failed");
+            }
+            countSent(conn, static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    // Zero-copy variant of sendData: the kernel advances through
+    // [position, position + length) without the data entering user space.
+    // Returns false when the socket would block; switches the connection to
+    // the buffered path if the file cannot be sendfile'd.
+    bool sendDataZeroCopy(Connection& conn, const Segment& segment) {
+        while (conn.totalSent < segment.length) {
+            prefetchAhead(conn, segment);
+            size_t allowed = allowance(conn, segment.length - conn.totalSent);
+            if (allowed == 0) {
+                return false;
+            }
+            off_t offset = segment.position + static_cast<off_t>(conn.totalSent);
+            ssize_t sent = sendfile(conn.fd, segment.file->fd, &offset, allowed);
+            spend(conn, sent);
+            if (sent < 0) {
+                int error = net::lastError();
+                if (net::wouldBlock(error)) {
+                    return false;
+                }
+                if (error == EINTR) {
+                    continue;
+                }
+                if ((error == EINVAL || error == ENOSYS) && conn.totalSent == 0) {
+                    conn.zeroCopy = false;
+                    return true;
+                }
+                throw std::system_error(error, std::system_category(), "Data send failed");
+            }
+            if (sent == 0) {
+                throw std::runtime_error("End of file reached unexpectedly");
+            }
+            countSent(conn, static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    // Streams the segment's file range until it is complete or the socket
+    // would block. Returns true once every byte has been sent.
+    bool sendData(Connection& conn, const Segment& segment) {
+        if (sendMode == SendMode::Mapped) {
+            if (const char* mapping = segment.file->mapped()) {
+                return sendDataMapped(conn, segment, mapping);
+            }
+        }
+        if (conn.zeroCopy) {
+            if (!sendDataZeroCopy(conn, segment)) {
+                return false;
+            }
+            if (conn.zeroCopy) {
+                return true;
+            }
+        }
+
+        if (conn.buffer.empty()) {
+            conn.buffer = buffers.acquire();
+        }
+        int directFd = sendMode == SendMode::Direct ? segment.file->direct() : -1;
+
+        while (conn.totalSent < segment.length) {
+            if (conn.bufferOffset == conn.bufferLength) {
+                prefetchAhead(conn, segment);
+                uint64_t position = static_cast<uint64_t>(segment.position) + conn.totalSent;
+                size_t remaining = segment.length - conn.totalSent;
+                int fd = segment.file->fd;
+                // O_DIRECT reads whole aligned blocks around the wanted bytes;
+                // the last block of the file comes back short
+                size_t skip = directFd >= 0 ? position % BufferPool::alignment : 0;
+                size_t chunkSize = std::min(conn.buffer.size() - skip, remaining);
+                size_t readSize = chunkSize;
+                if (directFd >= 0) {
+                    fd = directFd;
+                    readSize = BufferPool::roundUp(skip + chunkSize);
+                }
+                auto readStart = phases.now();
+                ssize_t bytesRead = pread(fd, conn.buffer.data(), readSize, static_cast<off_t>(position - skip));
+                if (bytesRead < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "File read failed");
+                }
+                phases.record(Phase::Read, conn.id, readStart, static_cast<uint64_t>(bytesRead));
+                if (static_cast<size_t>(bytesRead) <= skip) {
+                    throw std::runtime_error("End of file reached unexpectedly");
+                }
+                conn.bufferOffset = skip;
+                conn.bufferLength = std::min(static_cast<size_t>(bytesRead), skip + chunkSize);
+            }
+
+            size_t allowed = allowance(conn, conn.bufferLength - conn.bufferOffset);
+            if (allowed == 0) {
+                return false;
+            }
+            ssize_t sent = send(conn.fd, conn.buffer.data() + conn.bufferOffset, allowed, MSG_NOSIGNAL);
+            spend(conn, sent);
+            if (sent < 0) {
+                int error = net::lastError();
+                if (net::wouldBlock(error)) {
+                    return false;
+                }
+                if (error == EINTR) {
+                    continue;
+                }
+                throw std::system_error(error, std::system_category(), "Data send failed");
+            }
+
+            conn.bufferOffset += static_cast<size_t>(sent);
+            countSent(conn, static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    // Sends queued segments in order. Returns true once the response is out.
+    bool sendResponse(Connection& conn) {
+        while (!conn.segments.empty()) {
+            const Segment& segment = conn.segments.front();
+            if (!sendHeader(conn, segment)) {
+                return false;
+            }
+            if (segment.file && !sendData(conn, segment)) {
+                return false;
+            }
+            conn.segments.pop_front();
+            conn.headerSent = 0;
+            conn.totalSent = 0;
+            conn.prefetched = 0;
+            conn.bufferOffset = 0;
+            conn.bufferLength = 0;
+        }
+        conn.buffer.reset();
+        return true;
+    }
+
+    static AdmissionControl::Ticket ticketFor(const Worker& worker, const Connection& conn) {
+        return AdmissionControl::Ticket{worker.id, conn.fd, conn.id};
+    }
+
+    // Lets the buffered request through if it carries no file data or a
+    // transfer slot is free; otherwise queues the connection and returns
+    // false. It is resumed by processHandoffs once a slot passes to it.
+    bool admit(Worker& worker, Connection& conn) {
+        if (conn.holdsTransfer || conn.rejected || !admission.limitsTransfers()) {
+            return true;
+        }
+        protocol::Op op = protocol::decodeHeader(conn.request.data()).op;
+        if (op != protocol::Op::Read && op != protocol::Op::Batch && op != protocol::Op::Delta) {
+            return true;
+        }
+        if (admission.enter(ticketFor(worker, conn))) {
+            conn.holdsTransfer = true;
+            return true;
+        }
+        if (worker.draining) {
+            admission.cancel(ticketFor(worker, conn));
+            conn.rejected = true;
+            return true;
+        }
+        conn.queued = true;
+        conn.queuedAt = std::chrono::steady_clock::now();
+        return false;
+    }
+
+    static void wake(Worker& target) {
+        uint64_t one = 1;
+        ssize_t written = write(target.wakeFd, &one, sizeof(one));
+        (void)written;
+    }
+
+    // Passes a freed slot on to the next queued request's worker.
+    void handOff(const AdmissionControl::Ticket& ticket) {
+        Worker& target = *workers[static_cast<size_t>(ticket.worker)];
+        {
+            std::lock_guard<std::mutex> lock(target.handoffMutex);
+            target.handoffs.push_back(ticket);
+        }
+        wake(target);
+    }
+
+    // Called on the DigestWorker thread: returns the ticket to its worker.
+    void digestDone(const AdmissionControl::Ticket& ticket) {
+        Worker& target = *workers[static_cast<size_t>(ticket.worker)];
+        {
+            std::lock_guard<std::mutex> lock(target.handoffMutex);
+            target.digested.push_back(ticket);
+        }
+        wake(target);
+    }
+
+    // Holds back a DIGEST, or a checksummed BATCH, while a file it names
+    // has no cached digest: those are computed on the DigestWorker and the
+    // connection resumes in processHandoffs. Returns true while waiting.
+    // Malformed requests go through and are answered by parseRequest.
+    bool awaitDigests(Worker& worker, Connection& conn) {
+        if (conn.digestsPending > 0) {
+            return true;
+        }
+        if (conn.digestsWaited) {
+            return false;  // A digest that failed is retried, and reported, inline
+        }
+        protocol::FrameHeader request = protocol::decodeHeader(conn.request.data());
+        std::string payload = conn.request.substr(protocol::headerSize, request.payloadLength);
+        std::vector<std::string> paths;
+        if (request.op == protocol::Op::Digest) {
+            paths.push_back(payload);
+        } else if (request.op == protocol::Op::Batch && (request.flags & protocol::flagChecksum)) {
+            try {
+                protocol::PayloadReader reader(payload);
+                uint32_t count = reader.getU32();
+                for (uint32_t i = 0; i < count && i < maxBatchFiles; ++i) {
+                    paths.push_back(reader.getString());
+                }
+            } catch (const std::exception&) {
+                return false;
+            }
+        }
+
+        for (const std::string& path : paths) {
+            std::shared_ptr<const CachedFile> file;
+            try {
+                file = fileCache.acquire(path);
+            } catch (const std::exception&) {
+                continue;
+            }
+            if (!file->hasDigest()) {
+                digests.submit(std::move(file), ticketFor(worker, conn));
+                conn.digestsPending++;
+            }
+        }
+        return conn.digestsPending > 0;
+    }
+
+    void releaseTransfer(Connection& conn) {
+        conn.holdsTransfer = false;
+        AdmissionControl::Ticket next;
+        if (admission.leave(next)) {
+            handOff(next);
+        }
+    }
+
+    // Resumes queued connections that were handed a slot. A slot whose
+    // connection has closed meanwhile moves on to the next in line. Then
+    // resumes connections whose digests are all done, and connections whose
+    // response has been prepared.
+    void processHandoffs(Worker& worker) {
+        std::vector<AdmissionControl::Ticket> tickets;
+        {
+            std::lock_guard<std::mutex> lock(worker.handoffMutex);
+            tickets.swap(worker.handoffs);
+        }
+        for (const AdmissionControl::Ticket& ticket : tickets) {
+            auto it = worker.connections.find(ticket.fd);
+            if (it == worker.connections.end() || it->second->id != ticket.connection || !it->second->queued) {
+                AdmissionControl::Ticket next;
+                if (admission.leave(next)) {
+                    handOff(next);
+                }
+                continue;
+            }
+            Connection& conn = *it->second;
+            conn.queued = false;
+            conn.holdsTransfer = true;
+            phases.record(Phase::Queue, conn.id, conn.queuedAt);
+            conn.lastActivity = std::chrono::steady_clock::now();
+            serviceConnection(worker, ticket.fd, false);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(worker.handoffMutex);
+            tickets.clear();
+            tickets.swap(worker.digested);
+        }
+        for (const AdmissionControl::Ticket& ticket : tickets) {
+            auto it = worker.connections.find(ticket.fd);
+            if (it == worker.connections.end() || it->second->id != ticket.connection ||
+                it->second->digestsPending == 0) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            if (--conn.digestsPending == 0) {
+                conn.digestsWaited = true;
+                conn.lastActivity = std::chrono::steady_clock::now();
+                serviceConnection(worker, ticket.fd, false);
+            }
+        }
+
+        std::vector<Prepared> prepared;
+        {
+            std::lock_guard<std::mutex> lock(worker.handoffMutex);
+            prepared.swap(worker.prepared);
+        }
+        for (Prepared& result : prepared) {
+            auto it = worker.connections.find(result.ticket.fd);
+            if (it == worker.connections.end() || it->second->id != result.ticket.connection ||
+                !it->second->preparing) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            conn.preparing = false;
+            if (result.error.empty()) {
+                conn.segments.push_back(std::move(result.segment));
+            } else {
+                protocol::FrameHeader response = responseTo(result.request);
+                response.op = protocol::Op::Error;
+                queueFrame(conn, response, result.error);
+            }
+            phases.record(Phase::Prepare, conn.id, conn.prepareStart);
+            conn.sendStart = phases.now();
+            conn.lastActivity = std::chrono::steady_clock::now();
+            serviceConnection(worker, result.ticket.fd, false);
+        }
+    }
+
+    // Advances the connection's state machine as far as the socket allows.
+    // Returns true when the connection is finished and can be closed.
+    bool driveConnection(Worker& worker, Connection& conn) {
+        while (true) {
+            if (conn.preparing) {
+                return false;
+            }
+            if (conn.state == State::ReadingRequest) {
+                if (conn.queued || conn.digestsPending > 0) {
+                    return false;
+                }
+                if (!readRequest(conn)) {
+                    return conn.peerClosed;
+                }
+                if (awaitDigests(worker, conn) || !admit(worker, conn)) {
+                    return false;
+                }
+                auto prepareStart = phases.now();
+                conn.digestsWaited = false;
+                parseRequest(worker, conn);
+                if (conn.preparing) {
+                    conn.prepareStart = prepareStart;
+                    return false;
+                }
+                phases.record(Phase::Prepare, conn.id, prepareStart);
+                conn.sendStart = phases.now();
+            }
+            // A response that stopped on a full socket buffer stalled until
+            // the socket was writable again; one held back by the bandwidth
+            // limits is timed as throttled instead
+            if (conn.stalledSince != std::chrono::steady_clock::time_point()) {
+                phases.record(Phase::Stall, conn.id, conn.stalledSince);
+                conn.stalledSince = std::chrono::steady_clock::time_point();
+            }
+            if (!sendResponse(conn)) {
+                if (!conn.throttled) {
+                    conn.stalledSince = phases.now();
+                }
+                return false;
+            }
+            phases.record(Phase::Send, conn.id, conn.sendStart, conn.responseSent);
+            if (conn.holdsTransfer) {
+                releaseTransfer(conn);
+            }
+
+            conn.requestsServed++;
+            conn.bytesServed += conn.responseSent;
+            conn.state = State::ReadingRequest;
+
+            // While draining, requests that have fully arrived are still
+            // answered; then the connection closes
+            if (worker.draining && completeRequestLength(conn.request) == 0) {
+                return true;
+            }
+        }
+    }
+
+    void closeConnection(Worker& worker, socket_t fd) {
+        auto it = worker.connections.find(fd);
+        if (it == worker.connections.end()) {
+            epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            return;
+        }
+        {
+            Connection& conn = *it->second;
+            if (conn.client) {
+                bandwidth.release(*conn.client, conn.credit);
+            }
+            // A queued connection that is no longer in the queue has a slot
+            // on its way; processHandoffs passes it on
+            if (conn.queued) {
+                admission.cancel(ticketFor(worker, conn));
+            }
+            if (conn.holdsTransfer) {
+                releaseTransfer(conn);
+            }
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "Connection " << fd << " closed after " << conn.requestsServed
+                      << " request(s), " << conn.bytesServed << " bytes sent" << std::endl;
+        }
+        epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        worker.connections.erase(it);
+
+        admission.close();
+        std::lock_guard<std::mutex> lock(acceptMutex);
+        if (acceptPaused) {
+            resumeAcceptingLocked();
+        }
+    }
+
+    // Answers a queued request busy if it is still in the queue.
+    void rejectQueued(Worker& worker, socket_t fd) {
+        auto it = worker.connections.find(fd);
+        if (it == worker.connections.end() || !it->second->queued ||
+            !admission.cancel(ticketFor(worker, *it->second))) {
+            return;
+        }
+        it->second->queued = false;
+        it->second->rejected = true;
+        phases.record(Phase::Queue, it->second->id, it->second->queuedAt);
+        serviceConnection(worker, fd, false);
+    }
+
+    void closeIdleConnections(Worker& worker) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<socket_t> expired;
+        std::vector<socket_t> waitedTooLong;
+        for (auto& entry : worker.connections) {
+            const Connection& conn = *entry.second;
+            if (conn.queued) {
+                if (now - conn.queuedAt > admission.configuration().queueTimeout) {
+                    waitedTooLong.push_back(entry.first);
+                }
+                continue;
+            }
+            if (conn.throttled || conn.digestsPending > 0 || conn.preparing) {
+                continue;
+            }
+            int limit = sendTimeoutMs;
+            if (conn.state == State::ReadingRequest) {
+                limit = conn.request.empty() ? keepAliveTimeoutMs : requestTimeoutMs;
+            }
+            if (std::chrono::duration_cast<std::chrono::milliseconds>(now - conn.lastActivity).count() > limit) {
+                expired.push_back(entry.first);
+            }
+        }
+
+        for (socket_t fd : expired) {
+            {
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cerr << "Timeout on connection " << fd << std::endl;
+            }
+            closeConnection(worker, fd);
+        }
+        for (socket_t fd : waitedTooLong) {
+            rejectQueued(worker, fd);
+        }
+    }
+
+    // Drives one connection and closes it if it finished or failed.
+    void serviceConnection(Worker& worker, socket_t fd, bool socketError) {
+        auto it = worker.connections.find(fd);
+        if (it == worker.connections.end()) {
+            return;
+        }
+
+        Connection& conn = *it->second;
+        bool finished = false;
+        try {
+            if (socketError) {
+                throw std::runtime_error("Socket error");
+            }
+            finished = driveConnection(worker, conn);
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cerr << "Connection " << fd << " error: " << e.what() << std::endl;
+            finished = true;
+        }
+
+        if (finished) {
+            closeConnection(worker, fd);
+        }
+    }
+
+    // Milliseconds until the first parked connection may send again,
+    // capped at limit.
+    int throttleTimeout(const Worker& worker, int limit) const {
+        if (!bandwidth.enabled()) {
+            return limit;
+        }
+        auto now = std::chrono::steady_clock::now();
+        int timeout = limit;
+        for (const auto& entry : worker.connections) {
+            const Connection& conn = *entry.second;
+            if (conn.throttled) {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(conn.resumeAt - now).count();
+                timeout = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(timeout, wait)));
+            }
+        }
+        return timeout;
+    }
+
+    void resumeThrottled(Worker& worker) {
+        if (!bandwidth.enabled()) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        std::vector<socket_t> due;
+        for (const auto& entry : worker.connections) {
+            const Connection& conn = *entry.second;
+            if (conn.throttled && conn.resumeAt <= now) {
+                due.push_back(entry.first);
+            }
+        }
+        for (socket_t fd : due) {
+            serviceConnection(worker, fd, false);
+        }
+    }
+
+    // Graceful drain, on SIGTERM or SIGINT: the worker stops accepting,
+    // closes idle connections and answers queued requests busy. Responses
+    // in progress, and requests that have fully arrived, are completed;
+    // then their connections close. The worker exits once it has no
+    // connections left or drainTimeout has passed.
+    void beginDrain(Worker& worker) {
+        worker.draining = true;
+        worker.drainDeadline = std::chrono::steady_clock::now() + drainTimeout;
+        epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, stopFd, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(acceptMutex);
+            if (worker.listening) {
+                epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, worker.listenFd, nullptr);
+                worker.listening = false;
+            }
+            // Closing a SO_REUSEPORT listener stops the kernel from routing
+            // new connections to it
+            if (worker.ownsListener) {
+                net::closeSocket(worker.listenFd);
+                worker.listenFd = INVALID_SOCKET_FD;
+                worker.ownsListener = false;
+            }
+        }
+
+        if (!drainAnnounced.exchange(true)) {
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "Draining: no new connections; " << admission.openConnections() << " open, "
+                      << admission.transfersInFlight() << " transfer(s) in flight, " << admission.queued()
+                      << " queued; waiting up to " << drainTimeout.count() << " s" << std::endl;
+        }
+
+        std::vector<socket_t> idle;
+        std::vector<socket_t> queued;
+        for (const auto& entry : worker.connections) {
+            const Connection& conn = *entry.second;
+            if (conn.queued) {
+                queued.push_back(entry.first);
+            } else if (conn.state == State::ReadingRequest && conn.request.empty()) {
+                idle.push_back(entry.first);
+            }
+        }
+        for (socket_t fd : idle) {
+            closeConnection(worker, fd);
+        }
+        for (socket_t fd : queued) {
+            rejectQueued(worker, fd);
+        }
+    }
+
+    void runWorker(Worker& worker) {
+        std::vector<epoll_event> events(256);
+        auto lastSweep = std::chrono::steady_clock::now();
+
+        while (true) {
+            int ready = epoll_wait(worker.epollFd, events.data(), static_cast<int>(events.size()),
+                                   throttleTimeout(worker, 1000));
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "epoll_wait failed");
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                socket_t fd = events[i].data.fd;
+                if (fd == worker.listenFd) {
+                    acceptConnections(worker);
+                    continue;
+                }
+                if (fd == worker.wakeFd) {
+                    uint64_t count;
+                    ssize_t result = read(worker.wakeFd, &count, sizeof(count));
+                    (void)result;
+                    continue;
+                }
+                if (fd == stopFd) {
+                    if (!worker.draining) {
+                        beginDrain(worker);
+                    }
+                    continue;
+                }
+                serviceConnection(worker, fd, events[i].events & EPOLLERR);
+            }
+            processHandoffs(worker);
+            resumeThrottled(worker);
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastSweep >= std::chrono::seconds(1)) {
+                closeIdleConnections(worker);
+                lastSweep = now;
+            }
+
+            if (worker.draining) {
+                if (worker.connections.empty()) {
+                    return;
+                }
+                if (now >= worker.drainDeadline) {
+                    std::vector<socket_t> remaining;
+                    for (const auto& entry : worker.connections) {
+                        remaining.push_back(entry.first);
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(logMutex);
+                        std::cerr << "Drain timed out; closing " << remaining.size() << " connection(s)"
+                                  << std::endl;
+                    }
+                    for (socket_t fd : remaining) {
+                        closeConnection(worker, fd);
+                    }
+                    return;
+                }
+            }
+        }
+    }
+
+    static const char* sendModeName(SendMode mode) {
+        switch (mode) {
+        case SendMode::ZeroCopy:
+            return "sendfile";
+        case SendMode::Mapped:
+            return "mmap";
+        case SendMode::Direct:
+            return "O_DIRECT";
+        default:
+            return "buffered";
+        }
+    }
+
+public:
+    DownloadServer(int port, int workerCount = 0, SendMode sendMode = SendMode::ZeroCopy,
+                   size_t maxOpenFiles = defaultMaxOpenFiles(), const BandwidthScheduler::Limits& limits = {},
+                   size_t bufferSize = BufferPool::defaultBufferSize,
+                   const AdmissionControl::Limits& admissionLimits = AdmissionControl::Limits(),
+                   std::chrono::seconds drainTimeout = std::chrono::seconds(30),
+                   const PhaseTimer::Options& timing = PhaseTimer::Options())
+        : port(port), sendMode(sendMode), fileCache(maxOpenFiles), bandwidth(limits), buffers(bufferSize),
+          admission(admissionLimits), drainTimeout(drainTimeout), phases(timing),
+          prepares(workerCount),
+          digests(sendMode == SendMode::Direct,
+                  [this](const AdmissionControl::Ticket& ticket) { digestDone(ticket); }) {
+        if (workerCount <= 0) {
+            workerCount = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        if (stopFd < 0) {
+            stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (stopFd < 0) {
+                throw std::system_error(errno, std::system_category(), "eventfd failed");
+            }
+        }
+
+        for (int i = 0; i < workerCount; ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->id = i;
+            worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (worker->epollFd < 0) {
+                throw std::system_error(errno, std::system_category(), "epoll_create1 failed");
+            }
+
+            // Prefer one SO_REUSEPORT listener per worker; otherwise all
+            // workers share a single listener and wake exclusively.
+            uint32_t listenEvents = EPOLLIN;
+            if (sharedListenFd == INVALID_SOCKET_FD) {
+                worker->listenFd = net::listenOn(port, true);
+            }
+            if (worker->listenFd != INVALID_SOCKET_FD) {
+                worker->ownsListener = true;
+            } else {
+                if (sharedListenFd == INVALID_SOCKET_FD) {
+                    sharedListenFd = net::listenOn(port, false);
+                }
+                worker->listenFd = sharedListenFd;
+                listenEvents |= EPOLLEXCLUSIVE;
+            }
+
+            worker->listenEvents = listenEvents;
+            epoll_event ev;
+            ev.events = listenEvents;
+            ev.data.fd = worker->listenFd;
+            if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listenFd, &ev) != 0) {
+                throw std::system_error(errno, std::system_category(), "epoll_ctl(listener) failed");
+            }
+
+            worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (worker->wakeFd < 0) {
+                throw std::system_error(errno, std::system_category(), "eventfd failed");
+            }
+            for (int fd : {worker->wakeFd, stopFd}) {
+                ev.events = EPOLLIN;
+                ev.data.fd = fd;
+                if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                    throw std::system_error(errno, std::system_category(), "epoll_ctl(eventfd) failed");
+                }
+            }
+
+            workers.push_back(std::move(worker));
+        }
+    }
+
+    // Leaves three quarters of the descriptor limit for sockets.
+    static size_t defaultMaxOpenFiles() {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+            return 256;
+        }
+        return std::max<size_t>(1, std::min<size_t>(256, limit.rlim_cur / 4));
+    }
+
+    // Connections that fit in the descriptor limit next to the file cache
+    // (and its O_DIRECT twins) and the listeners, epoll and event fds.
+    static size_t defaultMaxConnections(size_t maxOpenFiles) {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+            return 0;
+        }
+        uint64_t reserved = 2 * static_cast<uint64_t>(maxOpenFiles) + 64;
+        return static_cast<size_t>(std::max<uint64_t>(16, limit.rlim_cur > reserved ? limit.rlim_cur - reserved : 0));
+    }
+
+    ~DownloadServer() {
+        for (auto& worker : workers) {
+            worker->connections.clear();
+            if (worker->ownsListener) {
+                net::closeSocket(worker->listenFd);
+            }
+            if (worker->epollFd >= 0) {
+                close(worker->epollFd);
+            }
+            if (worker->wakeFd >= 0) {
+                close(worker->wakeFd);
+            }
+        }
+        net::closeSocket(sharedListenFd);
+    }
+
+    // Starts a graceful drain of the running server. Async-signal-safe; a
+    // second call exits at once.
+    static void requestStop() {
+        static std::atomic<int> requests{0};
+        if (requests++ > 0) {
+            _exit(1);
+        }
+        uint64_t one = 1;
+        ssize_t written = write(stopFd, &one, sizeof(one));
+        (void)written;
+    }
+
+    void run() {
+        std::cout << "Server started on port " << port << " with " << workers.size()
+                  << " worker loop(s), " << sendModeName(sendMode) << " sends";
+        if (sendMode == SendMode::Buffered || sendMode == SendMode::Direct) {
+            std::cout << " (" << buffers.bufferSize() / 1024 << " KB buffers)";
+        }
+        std::cout << ". Waiting for connections..." << std::endl;
+        if (bandwidth.enabled()) {
+            const BandwidthScheduler::Limits& limits = bandwidth.configuration();
+            auto describe = [](double rate) {
+                return rate > 0 ? std::to_string(static_cast<uint64_t>(rate / 1024)) + " KB/s" : std::string("none");
+            };
+            std::cout << "Bandwidth limits: " << describe(limits.globalRate) << " total, "
+                      << describe(limits.clientRate) << " per client, " << limits.weights.size()
+                      << " weighted client(s)" << std::endl;
+        }
+        const AdmissionControl::Limits& admitted = admission.configuration();
+        auto bound = [](size_t limit) { return limit > 0 ? std::to_string(limit) : std::string("unlimited"); };
+        std::cout << "Admission: " << bound(admitted.maxConnections) << " connections, "
+                  << bound(admitted.maxTransfers) << " transfers in flight";
+        if (admitted.maxTransfers > 0) {
+            std::cout << " (queue timeout " << admitted.queueTimeout.count() << " ms)";
+        }
+        std::cout << std::endl;
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers.size(); ++i) {
+            threads.emplace_back(&DownloadServer::runWorker, this, std::ref(*workers[i]));
+        }
+        runWorker(*workers[0]);
+
+        for (auto& t : threads) {
+            t.join();
+        }
+        phases.report(std::cout);
+        try {
+            phases.writeTrace();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+        std::cout << "Server stopped" << std::endl;
+    }
+};
+
+// A byte count or bytes per second from a number with an optional K, M or
+// G suffix (powers of 1024).
+static double parseRate(const std::string& text) {
+    size_t end = 0;
+    double value = std::stod(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") {
+        value *= 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        value *= 1024 * 1024;
+    } else if (suffix == "G" || suffix == "g") {
+        value *= 1024.0 * 1024 * 1024;
+    } else if (!suffix.empty()) {
+        throw std::invalid_argument("Bad rate: " + text);
+    }
+    if (value < 0) {
+        throw std::invalid_argument("Bad rate: " + text);
+    }
+    return value;
+}
+
+int main(int argc, char* argv[]) {
+    // sendfile has no MSG_NOSIGNAL; a client that resets mid-transfer must
+    // cost its connection, not the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    DownloadServer::SendMode sendMode = DownloadServer::SendMode::ZeroCopy;
+    size_t maxOpenFiles = DownloadServer::defaultMaxOpenFiles();
+    BandwidthScheduler::Limits limits;
+    size_t bufferSize = BufferPool::defaultBufferSize;
+    AdmissionControl::Limits admissionLimits;
+    bool maxConnectionsSet = false;
+    int drainSeconds = 30;
+    PhaseTimer::Options timing;
+    std::vector<std::string> positional;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--copy") {
+                sendMode = DownloadServer::SendMode::Buffered;
+            } else if (arg == "--mmap") {
+                sendMode = DownloadServer::SendMode::Mapped;
+            } else if (arg == "--direct-io") {
+                sendMode = DownloadServer::SendMode::Direct;
+            } else if (arg == "--max-connections" && i + 1 < argc) {
+                admissionLimits.maxConnections = std::stoul(argv[++i]);
+                maxConnectionsSet = true;
+            } else if (arg == "--max-transfers" && i + 1 < argc) {
+                admissionLimits.maxTransfers = std::stoul(argv[++i]);
+            } else if (arg == "--queue-timeout" && i + 1 < argc) {
+                admissionLimits.queueTimeout = std::chrono::milliseconds(std::stoul(argv[++i]));
+            } else if (arg == "--drain-timeout" && i + 1 < argc) {
+                drainSeconds = std::stoi(argv[++i]);
+            } else if (arg == "--latency") {
+                timing.histograms = true;
+            } else if (arg == "--trace" && i + 1 < argc) {
+                timing.tracePath = argv[++i];
+            } else if (arg == "--buffer-size" && i + 1 < argc) {
+                bufferSize = static_cast<size_t>(parseRate(argv[++i]));
+            } else if (arg == "--max-open-files" && i + 1 < argc) {
+                maxOpenFiles = std::stoul(argv[++i]);
+            } else if (arg == "--rate-limit" && i + 1 < argc) {
+                limits.globalRate = parseRate(argv[++i]);
+            } else if (arg == "--client-rate-limit" && i + 1 < argc) {
+                limits.clientRate = parseRate(argv[++i]);
+            } else if (arg == "--client-weight" && i + 1 < argc) {
+                std::string spec = argv[++i];
+                size_t split = spec.find('=');
+                if (split == std::string::npos) {
+                    throw std::invalid_argument("Expected <ip>=<weight>: " + spec);
+                }
+                limits.weights[spec.substr(0, split)] = std::stod(spec.substr(split + 1));
+            } else {
+                positional.push_back(arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        return 1;
+    }
+
+    try {
+        int port = positional.size() > 0 ? std::stoi(positional[0]) : 8000;
+        int workerCount = positional.size() > 1 ? std::stoi(positional[1]) : 0;
+        if (!maxConnectionsSet) {
+            admissionLimits.maxConnections = DownloadServer::defaultMaxConnections(maxOpenFiles);
+        }
+        DownloadServer server(port, workerCount, sendMode, maxOpenFiles, limits, bufferSize, admissionLimits,
+                              std::chrono::seconds(std::max(0, drainSeconds)), timing);
+        // SIGTERM or Ctrl-C drains; a second one exits at once
+        std::signal(SIGTERM, [](int) { DownloadServer::requestStop(); });
+        std::signal(SIGINT, [](int) { DownloadServer::requestStop(); });
+        server.run();
+    } catch (const std::exception& e) {
+        std::cerr << "Server error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
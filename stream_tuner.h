@@ -0,0 +1,118 @@
+#pragma once
+
+// Picks the number of parallel streams from measured goodput, the way TCP
+// slow start picks a window. The count doubles while each doubling raises
+// the aggregate rate by at least slowStartGain. After the first doubling
+// that does not help, the tuner steps up linearly from the best count so
+// far, and settles on that count once a step gains less than probeGain.
+// A settled tuner tries one more step every reprobeIntervals, so it can
+// follow a path that improves later.
+//
+// The tuner keeps no clock of its own. update() is called once per
+// interval with the goodput measured over that interval. After a change,
+// the first warmupIntervals samples are ignored while the new connections
+// ramp up.
+
+#include <algorithm>
+
+class StreamTuner {
+private:
+    static constexpr double slowStartGain = 0.10;
+    static constexpr double probeGain = 0.05;
+    static constexpr int warmupIntervals = 1;
+    static constexpr int measureIntervals = 2;
+    static constexpr int reprobeIntervals = 20;
+
+    enum class Phase {
+        SlowStart,
+        Probe,
+        Settled
+    };
+
+    int maximum;
+    int current;
+    int best = 0;
+    double bestRate = 0;
+    int ceiling;            // Smallest count known not to help
+    Phase phase = Phase::SlowStart;
+    int intervals = 0;      // Samples since the last change
+    double rateSum = 0;
+
+    int step() const {
+        return std::max(1, best / 4);
+    }
+
+    void moveTo(int streams) {
+        current = std::max(1, std::min(streams, maximum));
+        intervals = 0;
+        rateSum = 0;
+    }
+
+public:
+    StreamTuner(int initial, int maximum)
+        : maximum(std::max(1, maximum)), current(std::max(1, std::min(initial, this->maximum))),
+          ceiling(this->maximum + 1) {}
+
+    int streams() const {
+        return current;
+    }
+
+    // Records one interval's goodput in bytes per second and returns the
+    // stream count to use from now on.
+    int update(double rate) {
+        intervals++;
+        if (phase == Phase::Settled) {
+            // The probe is judged against the settled count measured like
+            // any other: the last measureIntervals samples before it, long
+            // after the warm-up
+            if (intervals > reprobeIntervals - measureIntervals) {
+                rateSum += rate;
+            }
+            if (intervals >= reprobeIntervals && current < maximum) {
+                phase = Phase::Probe;
+                ceiling = maximum + 1;
+                bestRate = rateSum / measureIntervals;
+                moveTo(current + step());
+            }
+            return current;
+        }
+
+        if (intervals <= warmupIntervals) {
+            return current;
+        }
+        rateSum += rate;
+        if (intervals < warmupIntervals + measureIntervals) {
+            return current;
+        }
+        double measured = rateSum / measureIntervals;
+
+        double gain = phase == Phase::SlowStart ? slowStartGain : probeGain;
+        if (best == 0 || measured >= bestRate * (1 + gain)) {
+            best = current;
+            bestRate = measured;
+            int next = std::min(phase == Phase::SlowStart ? current * 2 : current + step(), maximum);
+            if (current >= maximum || next >= ceiling) {
+                phase = Phase::Settled;
+                moveTo(best);
+            } else {
+                moveTo(next);
+            }
+            return current;
+        }
+
+        // The extra streams did not pay for themselves
+        ceiling = std::min(ceiling, current);
+        if (phase == Phase::SlowStart && best + step() < ceiling) {
+            phase = Phase::Probe;
+            moveTo(best + step());
+        } else {
+            phase = Phase::Settled;
+            moveTo(best);
+        }
+        return current;
+    }
+
+    bool settled() const {
+        return phase == Phase::Settled;
+    }
+};
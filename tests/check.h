@@ -0,0 +1,92 @@
+#pragma once
+
+// Minimal harness for the unit tests, so they build with nothing but the
+// compiler. TEST(name) registers a case; CHECK and friends record a failure
+// and carry on, and an exception escaping a case fails just that case.
+// main() is check::runAll(), which exits non-zero if anything failed.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <exception>
+
+namespace check {
+
+struct Case {
+    const char* name;
+    void (*run)();
+};
+
+inline std::vector<Case>& cases() {
+    static std::vector<Case> registered;
+    return registered;
+}
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char* file, int line, const std::string& what) {
+    std::cerr << file << ":" << line << ": " << what << std::endl;
+    failures()++;
+}
+
+struct Register {
+    Register(const char* name, void (*run)()) {
+        cases().push_back(Case{name, run});
+    }
+};
+
+inline int runAll() {
+    for (const Case& test : cases()) {
+        int before = failures();
+        try {
+            test.run();
+        } catch (const std::exception& e) {
+            fail(test.name, 0, std::string("unexpected exception: ") + e.what());
+        }
+        std::cout << (failures() == before ? "ok     " : "FAILED ") << test.name << std::endl;
+    }
+    return failures() == 0 ? 0 : 1;
+}
+
+} // namespace check
+
+#define TEST(name)                                        \
+    static void name();                                   \
+    static check::Register name##Registered(#name, name); \
+    static void name()
+
+#define CHECK(condition)                                              \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            check::fail(__FILE__, __LINE__, "CHECK(" #condition ")"); \
+        }                                                             \
+    } while (0)
+
+// For numbers; compare anything else with CHECK(a == b).
+#define CHECK_EQ(actual, expected)                                                   \
+    do {                                                                             \
+        auto actualValue = (actual);                                                 \
+        auto expectedValue = (expected);                                             \
+        if (!(actualValue == expectedValue)) {                                       \
+            check::fail(__FILE__, __LINE__,                                          \
+                        "CHECK_EQ(" #actual ", " #expected "): got " +               \
+                            std::to_string(actualValue) + ", expected " +            \
+                            std::to_string(expectedValue));                          \
+        }                                                                            \
+    } while (0)
+
+#define CHECK_THROWS(statement)                                                            \
+    do {                                                                                   \
+        bool threw = false;                                                                \
+        try {                                                                              \
+            statement;                                                                     \
+        } catch (const std::exception&) {                                                  \
+            threw = true;                                                                  \
+        }                                                                                  \
+        if (!threw) {                                                                      \
+            check::fail(__FILE__, __LINE__, "CHECK_THROWS(" #statement "): no exception"); \
+        }                                                                                  \
+    } while (0)
@@ -0,0 +1,249 @@
+// Unit tests for the codecs: CRC32C (hardware and table paths, combine),
+// the LZ4 block codec and the chunked compression format, and delta
+// encoding against a block signature.
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <endian.h>
+#include "check.h"
+#include "crc32c.h"
+#include "compression.h"
+#include "delta.h"
+
+namespace {
+
+std::string randomBytes(size_t length, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::string data(length, '\0');
+    for (char& c : data) {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+std::string repetitiveText(size_t length) {
+    std::string data;
+    for (uint64_t i = 0; data.size() < length; ++i) {
+        data += "line " + std::to_string(i % 97) + " of a fairly repetitive log file\n";
+    }
+    data.resize(length);
+    return data;
+}
+
+// Compresses with lz4 and expands the result again.
+std::string lz4RoundTrip(const std::string& data) {
+    std::string compressed;
+    lz4::compress(data.data(), data.size(), compressed);
+    CHECK(compressed.size() <= lz4::bound(data.size()));
+    std::string restored(data.size(), '\0');
+    lz4::decompress(compressed.data(), compressed.size(), &restored[0], restored.size());
+    return restored;
+}
+
+// Rebuilds a range from delta instructions and the basis they refer to, the
+// way the client applies a DELTA response.
+std::string applyDelta(const std::string& instructions, const std::string& basis, uint32_t blockSize) {
+    std::string out;
+    size_t position = 0;
+    auto getU32 = [&] {
+        uint32_t valueBE;
+        std::memcpy(&valueBE, instructions.data() + position, 4);
+        position += 4;
+        return be32toh(valueBE);
+    };
+    while (position < instructions.size()) {
+        char op = instructions[position++];
+        if (op == delta::opCopy) {
+            uint32_t block = getU32();
+            uint32_t count = getU32();
+            out.append(basis, static_cast<size_t>(block) * blockSize, static_cast<size_t>(count) * blockSize);
+        } else {
+            uint32_t length = getU32();
+            out.append(instructions, position, length);
+            position += length;
+        }
+    }
+    return out;
+}
+
+std::string signatureOf(const std::string& basis, uint32_t blockSize) {
+    std::vector<delta::BlockSignature> blocks;
+    for (size_t offset = 0; offset + blockSize <= basis.size(); offset += blockSize) {
+        blocks.push_back(delta::signBlock(basis.data() + offset, blockSize));
+    }
+    return delta::encodeSignature(blockSize, blocks);
+}
+
+} // namespace
+
+TEST(crc32cKnownValues) {
+    CHECK_EQ(crc32c::compute("", 0), 0u);
+    CHECK_EQ(crc32c::compute("123456789", 9), 0xE3069283u);
+    std::string zeros(32, '\0');
+    CHECK_EQ(crc32c::compute(zeros.data(), zeros.size()), 0x8A9136AAu);
+}
+
+TEST(crc32cHardwareMatchesTable) {
+    std::string data = randomBytes(100000, 1);
+    // Odd lengths and offsets exercise the unaligned head and tail
+    for (size_t offset : {0, 1, 3, 7}) {
+        for (size_t length : {0, 1, 15, 255, 4096, 99990}) {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data()) + offset;
+            uint32_t table = ~crc32c::detail::software(~0u, bytes, length);
+            CHECK_EQ(crc32c::compute(bytes, length), table);
+        }
+    }
+}
+
+TEST(crc32cExtendInPieces) {
+    std::string data = randomBytes(50000, 2);
+    uint32_t crc = 0;
+    for (size_t offset = 0; offset < data.size(); offset += 777) {
+        crc = crc32c::extend(crc, data.data() + offset, std::min<size_t>(777, data.size() - offset));
+    }
+    CHECK_EQ(crc, crc32c::compute(data.data(), data.size()));
+}
+
+TEST(crc32cCombine) {
+    std::string data = randomBytes(300000, 3);
+    uint32_t whole = crc32c::compute(data.data(), data.size());
+    for (size_t split : {0, 1, 4096, 123457, 300000}) {
+        uint32_t a = crc32c::compute(data.data(), split);
+        uint32_t b = crc32c::compute(data.data() + split, data.size() - split);
+        CHECK_EQ(crc32c::combine(a, b, data.size() - split), whole);
+    }
+}
+
+TEST(lz4RoundTrips) {
+    CHECK(lz4RoundTrip(repetitiveText(200000)) == repetitiveText(200000));
+    CHECK(lz4RoundTrip(randomBytes(70000, 4)) == randomBytes(70000, 4));
+    CHECK(lz4RoundTrip(std::string(100000, 'a')) == std::string(100000, 'a'));
+    for (size_t length : {0, 1, 4, 12, 13, 64}) {
+        std::string data = repetitiveText(length);
+        CHECK(lz4RoundTrip(data) == data);
+    }
+}
+
+TEST(lz4CompressesRepetitiveData) {
+    std::string data = repetitiveText(compression::blockSize);
+    std::string compressed;
+    lz4::compress(data.data(), data.size(), compressed);
+    CHECK(compressed.size() < data.size() / 4);
+}
+
+TEST(lz4RejectsCorruptBlocks) {
+    std::string data = repetitiveText(10000);
+    std::string compressed;
+    lz4::compress(data.data(), data.size(), compressed);
+    std::string out(data.size(), '\0');
+
+    CHECK_THROWS(lz4::decompress(compressed.data(), compressed.size() / 2, &out[0], out.size()));
+    CHECK_THROWS(lz4::decompress(compressed.data(), compressed.size(), &out[0], out.size() - 1));
+    CHECK_THROWS(lz4::decompress(compressed.data(), 0, &out[0], out.size()));
+
+    // One literal, then a match reaching back before the start of the output
+    const char badOffset[] = {0x10, 'a', static_cast<char>(0xff), 0x00};
+    CHECK_THROWS(lz4::decompress(badOffset, sizeof(badOffset), &out[0], 1 + 4));
+}
+
+TEST(compressionStoresIncompressibleBlocksRaw) {
+    std::string data = randomBytes(compression::blockSize + 1000, 5);
+    std::string encoded;
+    compression::encode(data.data(), data.size(), encoded);
+    CHECK_EQ(encoded.size(), data.size() + 2 * compression::blockHeaderSize);
+
+    size_t rawLength = 0;
+    size_t storedLength = 0;
+    compression::decodeBlockHeader(encoded.data(), rawLength, storedLength);
+    CHECK_EQ(rawLength, compression::blockSize);
+    CHECK_EQ(storedLength, rawLength);
+}
+
+TEST(compressionRejectsBadBlockHeaders) {
+    size_t rawLength = 0;
+    size_t storedLength = 0;
+    char header[compression::blockHeaderSize] = {};
+    CHECK_THROWS(compression::decodeBlockHeader(header, rawLength, storedLength));
+
+    uint32_t rawBE = htobe32(100);
+    uint32_t storedBE = htobe32(101);
+    std::memcpy(header, &rawBE, 4);
+    std::memcpy(header + 4, &storedBE, 4);
+    CHECK_THROWS(compression::decodeBlockHeader(header, rawLength, storedLength));
+}
+
+TEST(deltaBlockSize) {
+    CHECK_EQ(delta::blockSizeFor(0), delta::minBlockSize);
+    CHECK_EQ(delta::blockSizeFor(1ull << 40), delta::maxBlockSize);
+    uint32_t size = delta::blockSizeFor(1ull << 30);
+    CHECK((size & (size - 1)) == 0);
+    CHECK(static_cast<uint64_t>(size) * delta::targetBlocks >= (1ull << 30));
+}
+
+TEST(deltaRollingMatchesReset) {
+    std::string data = randomBytes(10000, 6);
+    const size_t window = 2048;
+    delta::RollingChecksum rolling;
+    rolling.reset(data.data(), window);
+    for (size_t position = 1; position + window <= data.size(); ++position) {
+        rolling.roll(data[position - 1], data[position + window - 1]);
+        if (position % 997 == 0) {
+            delta::RollingChecksum fresh;
+            fresh.reset(data.data() + position, window);
+            CHECK_EQ(rolling.value(), fresh.value());
+        }
+    }
+}
+
+TEST(deltaIdenticalFileIsOneCopy) {
+    const uint32_t blockSize = delta::minBlockSize;
+    std::string basis = randomBytes(64 * blockSize, 7);
+    delta::SignatureIndex index(signatureOf(basis, blockSize));
+
+    std::string instructions;
+    delta::encode(index, basis.data(), basis.size(), instructions);
+    CHECK_EQ(instructions.size(), 9u);  // 'C' block count
+    CHECK(applyDelta(instructions, basis, blockSize) == basis);
+}
+
+TEST(deltaRebuildsEditedFile) {
+    const uint32_t blockSize = delta::minBlockSize;
+    std::string basis = randomBytes(40 * blockSize + 100, 8);
+    std::string current = basis;
+    current.insert(5 * blockSize + 17, "inserted bytes");
+    current.erase(20 * blockSize, 300);
+    current.replace(30 * blockSize, 50, randomBytes(50, 9));
+    current += randomBytes(blockSize / 2, 10);
+
+    delta::SignatureIndex index(signatureOf(basis, blockSize));
+    std::string instructions;
+    delta::encode(index, current.data(), current.size(), instructions);
+    CHECK(applyDelta(instructions, basis, blockSize) == current);
+    // Most blocks are reused, so far less than the file goes out as literals
+    CHECK(instructions.size() < current.size() / 4);
+}
+
+TEST(deltaRangesAreIndependent) {
+    const uint32_t blockSize = delta::minBlockSize;
+    std::string basis = randomBytes(16 * blockSize, 11);
+    delta::SignatureIndex index(signatureOf(basis, blockSize));
+    for (size_t begin : std::vector<size_t>{0, 100, 3 * blockSize, 15 * blockSize + 1}) {
+        size_t length = std::min<size_t>(5 * blockSize + 7, basis.size() - begin);
+        std::string instructions;
+        delta::encode(index, basis.data() + begin, length, instructions);
+        CHECK(applyDelta(instructions, basis, blockSize) == basis.substr(begin, length));
+    }
+}
+
+TEST(deltaRejectsBadSignatures) {
+    CHECK_THROWS(delta::SignatureIndex(std::string(4, '\0')));
+    std::string signature = signatureOf(randomBytes(4 * delta::minBlockSize, 12), delta::minBlockSize);
+    CHECK_THROWS(delta::SignatureIndex(signature.substr(0, signature.size() - 1)));
+    CHECK_THROWS(delta::SignatureIndex(delta::encodeSignature(3000, {})));
+}
+
+int main() {
+    return check::runAll();
+}
@@ -0,0 +1,199 @@
+// Unit tests for the client's on-disk download state: the progress journal
+// that resumes direct-write downloads, and the merge stage of --parts
+// downloads.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <unistd.h>
+#include "check.h"
+#include "progress_journal.h"
+#include "part_merger.h"
+
+namespace {
+
+// A fresh directory under the system temp directory, removed afterwards.
+class TempDir {
+private:
+    std::string root;
+
+public:
+    TempDir() {
+        std::string pattern = "/tmp/tft-test-XXXXXX";
+        if (!mkdtemp(&pattern[0])) {
+            throw std::system_error(errno, std::system_category(), "mkdtemp failed");
+        }
+        root = pattern;
+    }
+
+    ~TempDir() {
+        std::error_code ignored;
+        std::filesystem::remove_all(root, ignored);
+    }
+
+    std::string path(const std::string& name) const {
+        return root + "/" + name;
+    }
+};
+
+void writeFile(const std::string& path, const std::string& contents) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+bool sameRanges(const std::vector<ProgressJournal::ByteRange>& ranges,
+                const std::vector<std::pair<uint64_t, uint64_t>>& expected) {
+    if (ranges.size() != expected.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].begin != expected[i].first || ranges[i].end != expected[i].second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+TEST(journalResumesRecordedRanges) {
+    TempDir dir;
+    std::string path = dir.path("file.journal");
+    {
+        ProgressJournal journal(path, 1000, "v1", {{0, 100}});
+        journal.record(300, 400);
+        journal.record(100, 200);
+        journal.record(150, 250);
+    }
+
+    std::vector<ProgressJournal::ByteRange> durable;
+    CHECK(ProgressJournal::load(path, 1000, "v1", durable));
+    CHECK(sameRanges(durable, {{0, 250}, {300, 400}}));
+    CHECK(sameRanges(ProgressJournal::missing(durable, 1000), {{250, 300}, {400, 1000}}));
+}
+
+TEST(journalRejectsAnotherFile) {
+    TempDir dir;
+    std::string path = dir.path("file.journal");
+    ProgressJournal(path, 1000, "v1").record(0, 10);
+
+    std::vector<ProgressJournal::ByteRange> durable;
+    CHECK(!ProgressJournal::load(path, 1000, "v2", durable));
+    CHECK(!ProgressJournal::load(path, 999, "v1", durable));
+    CHECK(!ProgressJournal::load(dir.path("missing.journal"), 1000, "v1", durable));
+}
+
+TEST(journalIgnoresTornAndInvalidLines) {
+    TempDir dir;
+    std::string path = dir.path("file.journal");
+    writeFile(path, "FILE 1000 v1\n0 10\n20 10\n900 2000\nnonsense\n500 6");
+
+    std::vector<ProgressJournal::ByteRange> durable;
+    CHECK(ProgressJournal::load(path, 1000, "v1", durable));
+    CHECK(sameRanges(durable, {{0, 10}}));
+}
+
+TEST(journalCompactsOnRestart) {
+    TempDir dir;
+    std::string path = dir.path("file.journal");
+    {
+        ProgressJournal journal(path, 100, "v1");
+        journal.record(0, 50);
+        journal.record(50, 60);
+    }
+    std::vector<ProgressJournal::ByteRange> durable;
+    CHECK(ProgressJournal::load(path, 100, "v1", durable));
+    ProgressJournal restarted(path, 100, "v1", durable);
+    CHECK(readFile(path) == "FILE 100 v1\n0 60\n");
+    CHECK(access((path + ".tmp").c_str(), F_OK) != 0);
+
+    restarted.remove();
+    CHECK(access(path.c_str(), F_OK) != 0);
+}
+
+namespace {
+
+// Splits contents into parts and merges them into output with a PartMerger;
+// skip names a part that is left out.
+uint32_t mergeParts(const TempDir& dir, const std::string& contents, size_t partSize, int outputFd,
+                    size_t skip = SIZE_MAX) {
+    BufferPool buffers;
+    PhaseTimer phases;
+    PartMerger merger(outputFd, true, buffers, phases, 0);
+    size_t part = 0;
+    for (size_t offset = 0; offset < contents.size(); offset += partSize, ++part) {
+        if (part == skip) {
+            continue;
+        }
+        std::string path = dir.path("part" + std::to_string(part));
+        size_t length = std::min(partSize, contents.size() - offset);
+        writeFile(path, contents.substr(offset, length));
+        merger.submit(path, offset, length);
+    }
+    merger.finish();
+    CHECK_EQ(merger.merged(), contents.size() - (skip == SIZE_MAX ? 0 : partSize));
+    return merger.digest(contents.size());
+}
+
+std::string testContents() {
+    std::string contents;
+    for (int i = 0; contents.size() < 300000; ++i) {
+        contents += "record " + std::to_string(i * 7919) + "\n";
+    }
+    return contents;
+}
+
+} // namespace
+
+TEST(mergerAssemblesPartsAndDigest) {
+    TempDir dir;
+    std::string contents = testContents();
+    std::string output = dir.path("output");
+    int fd = open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0);
+
+    uint32_t digest = mergeParts(dir, contents, 65536, fd);
+    close(fd);
+    CHECK(readFile(output) == contents);
+    CHECK_EQ(digest, crc32c::compute(contents.data(), contents.size()));
+    // Merged parts are deleted
+    CHECK(access(dir.path("part0").c_str(), F_OK) != 0);
+}
+
+TEST(mergerDigestReportsGaps) {
+    TempDir dir;
+    std::string contents = testContents();
+    std::string output = dir.path("output");
+    int fd = open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0);
+
+    CHECK_THROWS(mergeParts(dir, contents, 65536, fd, 2));
+    close(fd);
+}
+
+TEST(mergerReportsMissingParts) {
+    TempDir dir;
+    std::string output = dir.path("output");
+    int fd = open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0);
+    {
+        BufferPool buffers;
+        PhaseTimer phases;
+        PartMerger merger(fd, false, buffers, phases, 0);
+        merger.submit(dir.path("no-such-part"), 0, 100);
+        CHECK_THROWS(merger.finish());
+    }
+    close(fd);
+}
+
+int main() {
+    return check::runAll();
+}
@@ -0,0 +1,123 @@
+// Unit tests for protocol framing: header encoding, the checks applied to
+// headers and payloads that come off the network, and manifest entries.
+
+#include <string>
+#include <vector>
+#include "check.h"
+#include "protocol.h"
+
+TEST(headerRoundTrips) {
+    protocol::FrameHeader header;
+    header.op = protocol::Op::Read;
+    header.flags = protocol::flagChecksum | protocol::flagCompress;
+    header.requestId = 0x01020304;
+    header.fileId = 77;
+    header.offset = 0x0102030405060708ull;
+    header.length = 1ull << 40;
+    header.checksum = 0xDEADBEEF;
+
+    std::string frame = protocol::encodeFrame(header, "payload");
+    CHECK_EQ(frame.size(), protocol::headerSize + 7);
+    // Network byte order on the wire
+    CHECK(frame.compare(0, 4, "TFTP") == 0);
+    CHECK_EQ(static_cast<int>(frame[5]), static_cast<int>(protocol::Op::Read));
+
+    protocol::FrameHeader decoded = protocol::decodeHeader(frame.data());
+    CHECK(decoded.op == protocol::Op::Read);
+    CHECK_EQ(decoded.flags, header.flags);
+    CHECK_EQ(decoded.requestId, header.requestId);
+    CHECK_EQ(decoded.fileId, header.fileId);
+    CHECK_EQ(decoded.offset, header.offset);
+    CHECK_EQ(decoded.length, header.length);
+    CHECK_EQ(decoded.payloadLength, 7u);
+    CHECK_EQ(decoded.checksum, header.checksum);
+    CHECK(frame.substr(protocol::headerSize) == "payload");
+}
+
+TEST(headerRejectsBadFrames) {
+    protocol::FrameHeader header;
+    header.op = protocol::Op::Stat;
+    std::string frame = protocol::encodeFrame(header);
+
+    std::string badMagic = frame;
+    badMagic[0] = 'X';
+    CHECK_THROWS(protocol::decodeHeader(badMagic.data()));
+
+    std::string badVersion = frame;
+    badVersion[4] = static_cast<char>(protocol::version + 1);
+    CHECK_THROWS(protocol::decodeHeader(badVersion.data()));
+
+    protocol::FrameHeader oversized = header;
+    oversized.payloadLength = protocol::maxPayload + 1;
+    std::string tooLarge(protocol::headerSize, '\0');
+    protocol::encodeHeader(oversized, &tooLarge[0]);
+    CHECK_THROWS(protocol::decodeHeader(tooLarge.data()));
+}
+
+TEST(payloadFieldsRoundTrip) {
+    protocol::PayloadWriter writer;
+    writer.putU32(42);
+    writer.putU64(1ull << 50);
+    writer.putString("some/path");
+    writer.putString("");
+
+    protocol::PayloadReader reader(writer.str());
+    CHECK_EQ(reader.getU32(), 42u);
+    CHECK_EQ(reader.getU64(), 1ull << 50);
+    CHECK(reader.getString() == "some/path");
+    CHECK(reader.getString().empty());
+    CHECK(reader.done());
+    CHECK_THROWS(reader.getU32());
+}
+
+TEST(payloadRejectsTruncatedStrings) {
+    protocol::PayloadWriter writer;
+    writer.putU32(100);  // Length of a string that is not there
+    writer.putU32(0);
+    protocol::PayloadReader reader(writer.str());
+    CHECK_THROWS(reader.getString());
+}
+
+TEST(entriesRoundTrip) {
+    std::vector<protocol::Entry> entries(3);
+    entries[0] = {123, "v1", "a.txt", 0x11111111};
+    entries[1] = {0, "", "missing.bin", 0};
+    entries[2] = {1ull << 33, "v2", "dir/b.bin", 0x22222222};
+
+    protocol::PayloadWriter writer;
+    writer.putU32(static_cast<uint32_t>(entries.size()));
+    for (const protocol::Entry& entry : entries) {
+        protocol::putEntry(writer, entry);
+    }
+
+    std::vector<protocol::Entry> decoded = protocol::getEntries(writer.str());
+    CHECK_EQ(decoded.size(), entries.size());
+    for (size_t i = 0; i < decoded.size() && i < entries.size(); ++i) {
+        CHECK_EQ(decoded[i].size, entries[i].size);
+        CHECK(decoded[i].version == entries[i].version);
+        CHECK(decoded[i].name == entries[i].name);
+        CHECK_EQ(decoded[i].checksum, entries[i].checksum);
+    }
+}
+
+TEST(entriesRejectCountBeyondPayload) {
+    protocol::PayloadWriter writer;
+    writer.putU32(0xFFFFFFFF);
+    protocol::putEntry(writer, protocol::Entry{});
+    CHECK_THROWS(protocol::getEntries(writer.str()));
+
+    protocol::PayloadWriter truncated;
+    truncated.putU32(2);
+    protocol::putEntry(truncated, protocol::Entry{1, "v", "name", 0});
+    truncated.putU64(0);
+    truncated.putU32(0);
+    truncated.putU32(0);
+    truncated.putU32(0);
+    // Long enough for two entries by the count check, but the second is cut short
+    std::string payload = truncated.str().substr(0, truncated.str().size() - 1);
+    CHECK_THROWS(protocol::getEntries(payload));
+}
+
+int main() {
+    return check::runAll();
+}
@@ -0,0 +1,247 @@
+// Unit tests for the scheduling logic: the client's range scheduler and
+// stream tuner, and the server's admission control.
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "check.h"
+#include "chunk_scheduler.h"
+#include "stream_tuner.h"
+#include "admission.h"
+
+TEST(schedulerCoversTheFile) {
+    ChunkScheduler scheduler(100, 30, 10);
+    CHECK_EQ(scheduler.rangeCount(), 4);
+
+    int rangeId = -1;
+    uint64_t expectedOffset = 0;
+    while (scheduler.claim(rangeId)) {
+        ChunkScheduler::Range range = scheduler.range(rangeId);
+        CHECK_EQ(range.offset, expectedOffset);
+        uint64_t offset = 0;
+        uint64_t length = scheduler.nextRequest(rangeId, 16, offset);
+        CHECK_EQ(offset, range.offset);
+        CHECK_EQ(length, std::min<uint64_t>(16, range.end - range.offset));
+        scheduler.markReceived(rangeId, length);
+        while ((length = scheduler.nextRequest(rangeId, 16, offset)) > 0) {
+            scheduler.markReceived(rangeId, length);
+        }
+        scheduler.complete(rangeId);
+        expectedOffset = range.end;
+    }
+    CHECK_EQ(expectedOffset, 100u);
+    CHECK(scheduler.finished());
+}
+
+TEST(schedulerSchedulesOnlyGivenSpans) {
+    ChunkScheduler scheduler({{10, 20}, {50, 75}}, 10, 1);
+    CHECK_EQ(scheduler.rangeCount(), 4);
+    std::vector<std::pair<uint64_t, uint64_t>> claimed;
+    int rangeId = -1;
+    for (int i = 0; i < 4 && scheduler.claim(rangeId); ++i) {
+        ChunkScheduler::Range range = scheduler.range(rangeId);
+        claimed.emplace_back(range.offset, range.end);
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> expected{{10, 20}, {50, 60}, {60, 70}, {70, 75}};
+    CHECK(claimed == expected);
+}
+
+TEST(schedulerStealsTheUnrequestedHalf) {
+    ChunkScheduler scheduler(100, 100, 10);
+    int first = -1;
+    CHECK(scheduler.claim(first));
+    uint64_t offset = 0;
+    CHECK_EQ(scheduler.nextRequest(first, 20, offset), 20u);
+
+    int second = -1;
+    CHECK(scheduler.claim(second));
+    CHECK(second != first);
+    CHECK_EQ(scheduler.range(first).end, 60u);
+    CHECK_EQ(scheduler.range(second).offset, 60u);
+    CHECK_EQ(scheduler.range(second).end, 100u);
+
+    // The victim keeps fetching only up to its new end
+    CHECK_EQ(scheduler.nextRequest(first, 100, offset), 40u);
+    CHECK_EQ(offset, 20u);
+    CHECK_EQ(scheduler.nextRequest(first, 100, offset), 0u);
+}
+
+TEST(schedulerDoesNotStealSmallRemainders) {
+    ChunkScheduler scheduler(100, 100, 10);
+    int first = -1;
+    CHECK(scheduler.claim(first));
+    uint64_t offset = 0;
+    scheduler.nextRequest(first, 81, offset);  // 19 bytes left, under two steal sizes
+    int second = -1;
+    CHECK(!scheduler.claim(second));
+    CHECK(!scheduler.finished());
+}
+
+TEST(schedulerStealsFromTheSlowestRange) {
+    ChunkScheduler scheduler(200, 100, 10);
+    int fast = -1;
+    int slow = -1;
+    CHECK(scheduler.claim(fast));
+    CHECK(scheduler.claim(slow));
+    uint64_t offset = 0;
+    scheduler.nextRequest(fast, 50, offset);
+    scheduler.markReceived(fast, 50);
+    scheduler.nextRequest(slow, 10, offset);
+
+    // Nothing received yet counts as slowest
+    int thief = -1;
+    CHECK(scheduler.claim(thief));
+    CHECK_EQ(scheduler.range(thief).offset, 155u);
+    CHECK_EQ(scheduler.range(slow).end, 155u);
+    CHECK_EQ(scheduler.range(fast).end, 100u);
+}
+
+TEST(schedulerRequeuesAbandonedRemainder) {
+    ChunkScheduler scheduler(100, 100, 10);
+    int rangeId = -1;
+    CHECK(scheduler.claim(rangeId));
+    uint64_t offset = 0;
+    scheduler.nextRequest(rangeId, 60, offset);
+    scheduler.markReceived(rangeId, 30);
+    scheduler.abandon(rangeId);
+    CHECK_EQ(scheduler.range(rangeId).end, 30u);
+
+    int retry = -1;
+    CHECK(scheduler.claim(retry));
+    CHECK_EQ(scheduler.range(retry).offset, 30u);
+    CHECK_EQ(scheduler.range(retry).end, 100u);
+    CHECK(!scheduler.finished());
+    CHECK_EQ(scheduler.nextRequest(retry, 100, offset), 70u);
+    scheduler.markReceived(retry, 70);
+    scheduler.complete(retry);
+    CHECK(scheduler.finished());
+
+    std::vector<ChunkScheduler::Range> filled = scheduler.filledRanges();
+    CHECK_EQ(filled.size(), 2u);
+    CHECK_EQ(filled[0].received, 30u);
+    CHECK_EQ(filled[1].offset, 30u);
+}
+
+namespace {
+
+// Drives a tuner against a path whose goodput grows linearly with the
+// stream count up to limit streams and is flat beyond, and returns the
+// count it settles on.
+int settleOn(StreamTuner& tuner, int limit) {
+    for (int interval = 0; interval < 200 && !tuner.settled(); ++interval) {
+        tuner.update(100.0 * std::min(tuner.streams(), limit));
+    }
+    return tuner.streams();
+}
+
+} // namespace
+
+TEST(tunerFindsTheKnee) {
+    StreamTuner tuner(1, 64);
+    CHECK_EQ(settleOn(tuner, 8), 8);
+    CHECK(tuner.settled());
+}
+
+TEST(tunerStopsAtTheMaximum) {
+    StreamTuner tuner(1, 6);
+    CHECK_EQ(settleOn(tuner, 100), 6);
+}
+
+TEST(tunerIgnoresWarmupSample) {
+    StreamTuner tuner(4, 64);
+    CHECK_EQ(tuner.update(0), 4);  // Warmup interval: not measured
+    CHECK_EQ(tuner.update(400), 4);
+    CHECK_EQ(tuner.update(400), 8);
+}
+
+TEST(tunerReprobesAfterSettling) {
+    StreamTuner tuner(1, 64);
+    CHECK_EQ(settleOn(tuner, 8), 8);
+    // The path improves: the periodic probe finds the extra streams pay off
+    bool grew = false;
+    for (int interval = 0; interval < 200 && !grew; ++interval) {
+        grew = tuner.update(100.0 * std::min(tuner.streams(), 32)) > 8;
+    }
+    CHECK(grew);
+    CHECK(settleOn(tuner, 32) > 8);
+}
+
+TEST(tunerReprobeBaselineIsAveraged) {
+    StreamTuner tuner(1, 64);
+    CHECK_EQ(settleOn(tuner, 8), 8);
+    // One slow interval just before the probe does not make the extra
+    // streams look like a gain
+    for (int interval = 0; interval < 19; ++interval) {
+        CHECK_EQ(tuner.update(800), 8);
+    }
+    CHECK_EQ(tuner.update(760), 10);
+    for (int interval = 0; interval < 3; ++interval) {
+        tuner.update(800);
+    }
+    CHECK_EQ(tuner.streams(), 8);
+    CHECK(tuner.settled());
+}
+
+TEST(admissionCapsConnections) {
+    AdmissionControl::Limits limits;
+    limits.maxConnections = 2;
+    AdmissionControl admission(limits);
+    CHECK(admission.tryOpen());
+    CHECK(admission.tryOpen());
+    CHECK(!admission.tryOpen());
+    CHECK(!admission.hasRoom());
+    admission.close();
+    CHECK(admission.hasRoom());
+    CHECK(admission.tryOpen());
+    CHECK_EQ(admission.openConnections(), 2u);
+}
+
+TEST(admissionHandsSlotsToTheOldestWaiter) {
+    AdmissionControl::Limits limits;
+    limits.maxTransfers = 1;
+    AdmissionControl admission(limits);
+    AdmissionControl::Ticket first{0, 10, 1};
+    AdmissionControl::Ticket second{1, 11, 2};
+    AdmissionControl::Ticket third{0, 12, 3};
+
+    CHECK(admission.enter(first));
+    CHECK(!admission.enter(second));
+    CHECK(!admission.enter(third));
+    CHECK_EQ(admission.queued(), 2u);
+
+    AdmissionControl::Ticket next;
+    CHECK(admission.leave(next));
+    CHECK_EQ(next.connection, 2u);
+    CHECK_EQ(admission.transfersInFlight(), 1u);
+
+    // A slot already on its way cannot be cancelled; a queued ticket can
+    CHECK(!admission.cancel(second));
+    CHECK(admission.cancel(third));
+    CHECK_EQ(admission.queued(), 0u);
+
+    CHECK(!admission.leave(next));
+    CHECK_EQ(admission.transfersInFlight(), 0u);
+}
+
+TEST(admissionQueuesBehindWaiters) {
+    AdmissionControl::Limits limits;
+    limits.maxTransfers = 2;
+    AdmissionControl admission(limits);
+    AdmissionControl::Ticket a{0, 10, 1};
+    AdmissionControl::Ticket b{0, 11, 2};
+    AdmissionControl::Ticket c{0, 12, 3};
+    CHECK(admission.enter(a));
+    CHECK(admission.enter(b));
+    CHECK(!admission.enter(c));
+
+    // A newcomer does not overtake the queue while a slot is handed over
+    AdmissionControl::Ticket next;
+    CHECK(admission.leave(next));
+    CHECK_EQ(next.connection, 3u);
+    AdmissionControl::Ticket d{0, 13, 4};
+    CHECK(!admission.enter(d));
+}
+
+int main() {
+    return check::runAll();
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+// Transfer progress without touching stdout on the data path. Every
+// connection owns a cache-line-sized block of relaxed atomic counters that
+// only it writes; one reporter thread reads them all at a fixed interval and
+// prints the aggregate rate, per-stream rates and ETA, and optionally
+// exports the same numbers as JSON lines or a Prometheus text file.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <stdexcept>
+#include <cstdint>
+#include <unistd.h>
+
+// Counters for one connection. Aligned to a cache line so streams on
+// different cores never write the same line.
+struct alignas(64) StreamCounters {
+    std::atomic<uint64_t> bytes{0};     // Data bytes received
+    std::atomic<uint64_t> chunks{0};    // Requests completed
+    std::atomic<uint64_t> retries{0};   // Failed attempts that were retried
+    std::atomic<bool> active{false};    // Between connection start and finish
+
+    void addBytes(uint64_t count) {
+        bytes.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void addChunk() {
+        chunks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void addRetry() {
+        retries.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+class TransferStats {
+private:
+    std::unique_ptr<StreamCounters[]> counters;
+    size_t count;
+
+public:
+    explicit TransferStats(size_t streams) : counters(new StreamCounters[streams]), count(streams) {}
+
+    StreamCounters& stream(size_t index) {
+        return counters[index];
+    }
+
+    size_t streams() const {
+        return count;
+    }
+
+    uint64_t totalBytes() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            total += counters[i].bytes.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+// Samples a TransferStats every interval on its own thread. A stream that is
+// active but received nothing during an interval is counted as stalled for
+// that interval.
+class StatsReporter {
+public:
+    struct Options {
+        std::chrono::milliseconds interval{1000};
+        std::string jsonPath;        // Appends one JSON object per sample
+        std::string prometheusPath;  // Rewritten with the latest sample
+        bool console = true;
+    };
+
+private:
+    struct StreamSample {
+        uint64_t bytes = 0;
+        uint64_t chunks = 0;
+        uint64_t retries = 0;
+        double stallSeconds = 0;
+        double rate = 0;  // Bytes per second over the last interval
+    };
+
+    TransferStats& stats;
+    Options options;
+    uint64_t expectedBytes;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point lastSample;
+    std::vector<StreamSample> samples;
+    bool interactive;
+    std::ofstream json;
+
+    std::mutex stopMutex;
+    std::condition_variable stopSignal;
+    bool stopping = false;
+    std::thread worker;
+
+    static std::string formatEta(double seconds) {
+        if (seconds < 0) {
+            return "--:--";
+        }
+        uint64_t whole = static_cast<uint64_t>(seconds + 0.5);
+        std::ostringstream out;
+        out << whole / 60 << ":" << std::setw(2) << std::setfill('0') << whole % 60;
+        return out.str();
+    }
+
+    void sample() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastSample).count();
+        lastSample = now;
+        for (size_t i = 0; i < samples.size(); ++i) {
+            StreamCounters& counters = stats.stream(i);
+            StreamSample& sample = samples[i];
+            uint64_t bytes = counters.bytes.load(std::memory_order_relaxed);
+            sample.rate = elapsed > 0 ? (bytes - sample.bytes) / elapsed : 0;
+            if (bytes == sample.bytes && counters.active.load(std::memory_order_relaxed)) {
+                sample.stallSeconds += elapsed;
+            }
+            sample.bytes = bytes;
+            sample.chunks = counters.chunks.load(std::memory_order_relaxed);
+            sample.retries = counters.retries.load(std::memory_order_relaxed);
+        }
+    }
+
+    void report(bool final) {
+        sample();
+        double seconds = std::chrono::duration<double>(lastSample - startTime).count();
+        uint64_t bytes = 0;
+        uint64_t retries = 0;
+        double rate = 0;
+        double stallSeconds = 0;
+        for (const StreamSample& sample : samples) {
+            bytes += sample.bytes;
+            retries += sample.retries;
+            rate += sample.rate;
+            stallSeconds += sample.stallSeconds;
+        }
+        double eta = -1;
+        if (bytes >= expectedBytes) {
+            eta = 0;
+        } else if (rate > 0) {
+            eta = (expectedBytes - bytes) / rate;
+        }
+
+        if (options.console) {
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(1);
+            if (final) {
+                line << "Received " << bytes / 1048576.0 << " MB in " << seconds << " s ("
+                     << (seconds > 0 ? bytes / 1048576.0 / seconds : 0) << " MB/s), " << retries
+                     << " retries, " << stallSeconds << " s stalled";
+            } else {
+                line << (expectedBytes > 0 ? 100.0 * bytes / expectedBytes : 100.0) << "%  "
+                     << bytes / 1048576.0 << "/" << expectedBytes / 1048576.0 << " MB  "
+                     << rate / 1048576.0 << " MB/s  ETA " << formatEta(eta) << "  |";
+                line << std::setprecision(0);
+                for (const StreamSample& sample : samples) {
+                    line << " " << sample.rate / 1048576.0;
+                }
+            }
+            // Redraw in place on a terminal, one line per sample otherwise
+            if (interactive) {
+                std::cout << "\r\033[K" << line.str() << (final ? "\n" : "") << std::flush;
+            } else {
+                std::cout << line.str() << std::endl;
+            }
+        }
+
+        if (json.is_open()) {
+            json << std::fixed << std::setprecision(3) << "{\"time\":" << seconds << ",\"bytes\":" << bytes
+                 << ",\"expected\":" << expectedBytes << ",\"rate\":" << rate << ",\"eta\":" << eta
+                 << ",\"retries\":" << retries << ",\"final\":" << (final ? "true" : "false") << ",\"streams\":[";
+            for (size_t i = 0; i < samples.size(); ++i) {
+                const StreamSample& sample = samples[i];
+                json << (i > 0 ? "," : "") << "{\"id\":" << i << ",\"bytes\":" << sample.bytes
+                     << ",\"chunks\":" << sample.chunks << ",\"retries\":" << sample.retries
+                     << ",\"stall\":" << sample.stallSeconds << ",\"rate\":" << sample.rate << "}";
+            }
+            json << "]}" << std::endl;
+        }
+
+        if (!options.prometheusPath.empty()) {
+            writePrometheus(rate, eta);
+        }
+    }
+
+    // Written to a temporary file and renamed, so a collector never reads a
+    // half-written file.
+    void writePrometheus(double rate, double eta) {
+        std::string temporary = options.prometheusPath + ".tmp";
+        std::ofstream out(temporary, std::ios::trunc);
+        out << std::fixed << std::setprecision(3);
+        out << "# HELP transfer_expected_bytes Bytes this transfer has to receive.\n"
+            << "# TYPE transfer_expected_bytes gauge\n"
+            << "transfer_expected_bytes " << expectedBytes << "\n"
+            << "# HELP transfer_rate_bytes Receive rate over the last interval.\n"
+            << "# TYPE transfer_rate_bytes gauge\n"
+            << "transfer_rate_bytes " << rate << "\n"
+            << "# HELP transfer_eta_seconds Estimated time to completion, -1 if unknown.\n"
+            << "# TYPE transfer_eta_seconds gauge\n"
+            << "transfer_eta_seconds " << eta << "\n"
+            << "# HELP transfer_received_bytes_total Data bytes received.\n"
+            << "# TYPE transfer_received_bytes_total counter\n";
+        for (size_t i = 0; i < samples.size(); ++i) {
+            out << "transfer_received_bytes_total{stream=\"" << i << "\"} " << samples[i].bytes << "\n";
+        }
+        out << "# HELP transfer_chunks_total Requests completed.\n"
+            << "# TYPE transfer_chunks_total counter\n";
+        for (size_t i = 0; i < samples.size(); ++i) {
+            out << "transfer_chunks_total{stream=\"" << i << "\"} " << samples[i].chunks << "\n";
+        }
+        out << "# HELP transfer_retries_total Failed attempts that were retried.\n"
+            << "# TYPE transfer_retries_total counter\n";
+        for (size_t i = 0; i < samples.size(); ++i) {
+            out << "transfer_retries_total{stream=\"" << i << "\"} " << samples[i].retries << "\n";
+        }
+        out << "# HELP transfer_stall_seconds_total Time active without receiving data.\n"
+            << "# TYPE transfer_stall_seconds_total counter\n";
+        for (size_t i = 0; i < samples.size(); ++i) {
+            out << "transfer_stall_seconds_total{stream=\"" << i << "\"} " << samples[i].stallSeconds << "\n";
+        }
+        out.close();
+        if (out) {
+            std::rename(temporary.c_str(), options.prometheusPath.c_str());
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(stopMutex);
+        while (!stopSignal.wait_for(lock, options.interval, [this] { return stopping; })) {
+            report(false);
+        }
+    }
+
+public:
+    StatsReporter(TransferStats& stats, const Options& options, uint64_t expectedBytes)
+        : stats(stats), options(options), expectedBytes(expectedBytes), samples(stats.streams()),
+          interactive(isatty(STDOUT_FILENO)) {
+        if (!options.jsonPath.empty()) {
+            json.open(options.jsonPath, std::ios::app);
+            if (!json) {
+                throw std::runtime_error("Cannot open stats file: " + options.jsonPath);
+            }
+        }
+        startTime = lastSample = std::chrono::steady_clock::now();
+        worker = std::thread(&StatsReporter::run, this);
+    }
+
+    ~StatsReporter() {
+        stop();
+    }
+
+    StatsReporter(const StatsReporter&) = delete;
+    StatsReporter& operator=(const StatsReporter&) = delete;
+
+    // Stops sampling and reports the totals once.
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stopMutex);
+            stopping = true;
+        }
+        stopSignal.notify_one();
+        worker.join();
+        report(true);
+    }
+};